@@ -9,6 +9,8 @@
 
 PubSubClient::PubSubClient() {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     this->_client = NULL;
     this->stream = NULL;
     setCallback(NULL);
@@ -16,24 +18,32 @@ PubSubClient::PubSubClient() {
 
 PubSubClient::PubSubClient(TCPCLIENT& client) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setClient(client);
     this->stream = NULL;
 }
 
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, TCPCLIENT& client) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setServer(addr, port);
     setClient(client);
     this->stream = NULL;
 }
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, TCPCLIENT& client, Stream& stream) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setServer(addr,port);
     setClient(client);
     setStream(stream);
 }
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, TCPCLIENT& client) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setServer(addr, port);
     setCallback(callback);
     setClient(client);
@@ -41,6 +51,8 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATUR
 }
 PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATURE, TCPCLIENT& client, Stream& stream) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setServer(addr,port);
     setCallback(callback);
     setClient(client);
@@ -49,18 +61,24 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATUR
 
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, TCPCLIENT& client) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setServer(ip, port);
     setClient(client);
     this->stream = NULL;
 }
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, TCPCLIENT& client, Stream& stream) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setServer(ip,port);
     setClient(client);
     setStream(stream);
 }
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, TCPCLIENT& client) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setServer(ip, port);
     setCallback(callback);
     setClient(client);
@@ -68,6 +86,8 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE,
 }
 PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE, TCPCLIENT& client, Stream& stream) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setServer(ip,port);
     setCallback(callback);
     setClient(client);
@@ -76,18 +96,24 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE,
 
 PubSubClient::PubSubClient(const char* domain, uint16_t port, TCPCLIENT& client) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setServer(domain,port);
     setClient(client);
     this->stream = NULL;
 }
 PubSubClient::PubSubClient(const char* domain, uint16_t port, TCPCLIENT& client, Stream& stream) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setServer(domain,port);
     setClient(client);
     setStream(stream);
 }
 PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, TCPCLIENT& client) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setServer(domain,port);
     setCallback(callback);
     setClient(client);
@@ -95,6 +121,8 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGN
 }
 PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE, TCPCLIENT& client, Stream& stream) {
     this->_state = MQTT_DISCONNECTED;
+    this->inflightCount = 0;
+    setAckCallback(NULL);
     setServer(domain,port);
     setCallback(callback);
     setClient(client);
@@ -124,6 +152,8 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
         }
         if (result == 1) {
             nextMsgId = 1;
+            // clean session: the messages in flight are lost
+            inflightCount = 0;
             // Leave room in the buffer for header and variable length field
             uint16_t length = 5;
             unsigned int j;
@@ -282,6 +312,14 @@ uint16_t PubSubClient::readPacket(uint8_t* lengthLength) {
 boolean PubSubClient::loop() {
     if (connected()) {
         unsigned long t = millis();
+        for (uint8_t i = 0;i<inflightCount;) {
+            if (t - inflightTime[i] > MQTT_ACK_TIMEOUT*1000UL) {
+                // no PUBACK: the message is lost
+                removeInflight(i);
+            } else {
+                i++;
+            }
+        }
         if ((t - lastInActivity > MQTT_KEEPALIVE*1000UL) || (t - lastOutActivity > MQTT_KEEPALIVE*1000UL)) {
             if (pingOutstanding) {
                 this->_state = MQTT_CONNECTION_TIMEOUT;
@@ -336,6 +374,17 @@ boolean PubSubClient::loop() {
                     _client->write(buffer,2);
                 } else if (type == MQTTPINGRESP) {
                     pingOutstanding = false;
+                } else if (type == MQTTPUBACK) {
+                    msgId = (buffer[llen+1]<<8)+buffer[llen+2];
+                    for (uint8_t i = 0;i<inflightCount;i++) {
+                        if (inflightId[i] == msgId) {
+                            removeInflight(i);
+                            if (ackcallback) {
+                                ackcallback(msgId);
+                            }
+                            break;
+                        }
+                    }
                 }
             }
 	}
@@ -378,6 +427,61 @@ boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigne
     return false;
 }
 
+uint16_t PubSubClient::publishQos1(const char* topic, const char* payload) {
+    return publishQos1(topic,(const uint8_t*)payload,strlen(payload),false);
+}
+
+uint16_t PubSubClient::publishQos1(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
+    if (connected()) {
+        if (inflightCount >= MQTT_MAX_INFLIGHT) {
+            // Wait for a PUBACK
+            return 0;
+        }
+        if (MQTT_MAX_PACKET_SIZE < 5 + 2+strlen(topic) + 2 + plength) {
+            // Too long
+            return 0;
+        }
+        // Leave room in the buffer for header and variable length field
+        uint16_t length = 5;
+        length = writeString(topic,buffer,length);
+        nextMsgId++;
+        if (nextMsgId == 0) {
+            nextMsgId = 1;
+        }
+        buffer[length++] = (nextMsgId >> 8);
+        buffer[length++] = (nextMsgId & 0xFF);
+        uint16_t i;
+        for (i=0;i<plength;i++) {
+            buffer[length++] = payload[i];
+        }
+        uint8_t header = MQTTPUBLISH|MQTTQOS1;
+        if (retained) {
+            header |= 1;
+        }
+        if (write(header,buffer,length-5)) {
+            inflightId[inflightCount] = nextMsgId;
+            inflightTime[inflightCount] = millis();
+            inflightCount++;
+            return nextMsgId;
+        }
+    }
+    return 0;
+}
+
+uint8_t PubSubClient::inflight() {
+    return inflightCount;
+}
+
+boolean PubSubClient::removeInflight(uint8_t i) {
+    if (i >= inflightCount) {
+        return false;
+    }
+    inflightCount--;
+    inflightId[i] = inflightId[inflightCount];
+    inflightTime[i] = inflightTime[inflightCount];
+    return true;
+}
+
 boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
     uint8_t llen = 0;
     uint8_t digit;
@@ -517,6 +621,7 @@ void PubSubClient::disconnect() {
     buffer[1] = 0;
     _client->write(buffer,2);
     _state = MQTT_DISCONNECTED;
+    inflightCount = 0;
     _client->stop();
     lastInActivity = lastOutActivity = millis();
 }
@@ -544,6 +649,7 @@ boolean PubSubClient::connected() {
         if (!rc) {
             if (this->_state == MQTT_CONNECTED) {
                 this->_state = MQTT_CONNECTION_LOST;
+                this->inflightCount = 0;
                 _client->flush();
                 _client->stop();
             }
@@ -575,6 +681,11 @@ PubSubClient& PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
     return *this;
 }
 
+PubSubClient& PubSubClient::setAckCallback(MQTT_ACK_CALLBACK_SIGNATURE) {
+    this->ackcallback = ackcallback;
+    return *this;
+}
+
 PubSubClient& PubSubClient::setClient(TCPCLIENT& client){
     this->_client = &client;
     return *this;
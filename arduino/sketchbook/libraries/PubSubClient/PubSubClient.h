@@ -45,6 +45,17 @@
 #define MQTT_SOCKET_TIMEOUT 6
 #endif
 
+// MQTT_MAX_INFLIGHT : QoS 1 messages published and waiting for PUBACK
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 4
+#endif
+
+// MQTT_ACK_TIMEOUT : seconds after which a QoS 1 message without PUBACK
+//  is considered lost and leaves the in flight window
+#ifndef MQTT_ACK_TIMEOUT
+#define MQTT_ACK_TIMEOUT MQTT_SOCKET_TIMEOUT
+#endif
+
 // MQTT_MAX_TRANSFER_SIZE : limit how much data is passed to the network client
 //  in each write call. Needed for the Arduino Wifi Shield. Leave undefined to
 //  pass the entire MQTT packet in each write call.
@@ -85,8 +96,10 @@
 #ifdef ESP8266
 #include <functional>
 #define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+#define MQTT_ACK_CALLBACK_SIGNATURE std::function<void(uint16_t)> ackcallback
 #else
 #define MQTT_CALLBACK_SIGNATURE void (*callback)(char*,uint8_t*,unsigned int)
+#define MQTT_ACK_CALLBACK_SIGNATURE void (*ackcallback)(uint16_t)
 #endif
 
 class PubSubClient {
@@ -98,6 +111,11 @@ private:
    unsigned long lastInActivity;
    bool pingOutstanding;
    MQTT_CALLBACK_SIGNATURE;
+   MQTT_ACK_CALLBACK_SIGNATURE;
+   uint16_t inflightId[MQTT_MAX_INFLIGHT];
+   unsigned long inflightTime[MQTT_MAX_INFLIGHT];
+   uint8_t inflightCount;
+   boolean removeInflight(uint8_t i);
    uint16_t readPacket(uint8_t*);
    boolean readByte(uint8_t * result);
    boolean readByte(uint8_t * result, uint16_t * index);
@@ -128,6 +146,7 @@ public:
    PubSubClient& setServer(uint8_t * ip, uint16_t port);
    PubSubClient& setServer(const char * domain, uint16_t port);
    PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE);
+   PubSubClient& setAckCallback(MQTT_ACK_CALLBACK_SIGNATURE);
    PubSubClient& setClient(TCPCLIENT& client);
    PubSubClient& setStream(Stream& stream);
 
@@ -141,6 +160,11 @@ public:
    boolean publish(const char* topic, const uint8_t * payload, unsigned int plength);
    boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
    boolean publish_P(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
+   // QoS 1: return the message id, 0 on error or if the in flight window is
+   // full; the ack callback is called by loop() when PUBACK is received
+   uint16_t publishQos1(const char* topic, const char* payload);
+   uint16_t publishQos1(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
+   uint8_t inflight();
    boolean subscribe(const char* topic);
    boolean subscribe(const char* topic, uint8_t qos);
    boolean unsubscribe(const char* topic);
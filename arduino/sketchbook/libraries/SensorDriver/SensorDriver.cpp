@@ -152,6 +152,55 @@ SensorDriver* SensorDriver::create(const char* driver,const char* type) {
 }
 SensorDriver::~SensorDriver() {}
 
+int SensorWriter::payload(char* buf, size_t len, long value, const char* timestamp)
+{
+  if (timestamp == NULL) return snprintf(buf, len, "{\"v\":%ld}", value);
+  return snprintf(buf, len, "{\"v\":%ld,\"t\":\"%s\"}", value, timestamp);
+}
+
+int SensorDriver::writeValues(SensorWriter& writer)
+{
+#if defined(USEAJSON)
+  aJsonObject* jsonvalues = getJson();
+  if (jsonvalues == NULL) return SD_INTERNAL_ERROR;
+
+  for (aJsonObject* item = jsonvalues->child; item; item = item->next){
+    if (item->type == aJson_NULL){
+      writer.missing(item->name);
+    }else{
+      writer.value(item->name, item->valuelong);
+    }
+  }
+  aJson.deleteItem(jsonvalues);
+  return SD_SUCCESS;
+#else
+  return SD_INTERNAL_ERROR;
+#endif
+}
+
+#if defined(USEAJSON)
+// add to an aJson object the values received from writeValues()
+class SensorWriterJson : public SensorWriter
+{
+  public:
+    aJsonObject* jsonvalues;
+    virtual void value(const char* code, long value) {
+      aJson.addNumberToObject(jsonvalues, code, value);
+    }
+    virtual void missing(const char* code) {
+      aJson.addNullToObject(jsonvalues, code);
+    }
+};
+
+aJsonObject* SensorDriver::getJsonFromValues()
+{
+  SensorWriterJson writer;
+  writer.jsonvalues = aJson.createObject();
+  writeValues(writer);
+  return writer.jsonvalues;
+}
+#endif
+
 #if defined (RADIORF24)
   #if defined (AES)
 void SensorDriver::aes_enc( char* mainbuf, size_t* buflen){
@@ -312,23 +361,26 @@ int SensorDriverTmp::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-  #if defined(USEAJSON)
-aJsonObject* SensorDriverTmp::getJson()
+int SensorDriverTmp::writeValues(SensorWriter& writer)
 {
   long values[1];
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
   if (SensorDriverTmp::get(values,1) == SD_SUCCESS){
-    aJson.addNumberToObject(jsonvalues, "B12101", values[0]);      
+    writer.value("B12101", values[0]);      
     // if you have a second value add here
-    //aJson.addNumberToObject(jsonvalues, "B12102", values2);      
+    //writer.value("B12102", values2);      
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B12101");
+    writer.missing("B12101");
     // if you have a second value add here
-    //aJson.addNullToObject(jsonvalues, "B12102");
+    //writer.missing("B12102");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+  #if defined(USEAJSON)
+aJsonObject* SensorDriverTmp::getJson()
+{
+  return getJsonFromValues();
 }
   #endif
 #endif
@@ -436,24 +488,27 @@ int SensorDriverAdt7420::getdata(unsigned long &data,unsigned short &width)
 }
 #endif
 
-  #if defined(USEAJSON)
-aJsonObject* SensorDriverAdt7420::getJson()
+int SensorDriverAdt7420::writeValues(SensorWriter& writer)
 {
   long values[1];
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
   
   if (SensorDriverAdt7420::get(values,1) == SD_SUCCESS){
-    aJson.addNumberToObject(jsonvalues, "B12101", values[0]);      
+    writer.value("B12101", values[0]);      
     // if you have a second value add here
-    //aJson.addNumberToObject(jsonvalues, "B12102", values2);      
+    //writer.value("B12102", values2);      
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B12101");
+    writer.missing("B12101");
     // if you have a second value add here
-    //aJson.addNullToObject(jsonvalues, "B12102");
+    //writer.missing("B12102");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+  #if defined(USEAJSON)
+aJsonObject* SensorDriverAdt7420::getJson()
+{
+  return getJsonFromValues();
 }
   #endif
 
@@ -860,29 +915,32 @@ int SensorDriverHih6100::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverHih6100::getJson()
+int SensorDriverHih6100::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
   //if (SensorDriverTmp::get2(&humidity,&temperature) == SD_SUCCESS){
   if (SensorDriverHih6100::get(values,2) == SD_SUCCESS){
-    aJson.addNumberToObject(jsonvalues, "B13003", values[0]);      
+    writer.value("B13003", values[0]);      
 
 #if defined(SECONDARYPARAMETER)
     // if you have a second value add here
-    aJson.addNumberToObject(jsonvalues, "B12101", values[1]);      
+    writer.value("B12101", values[1]);      
 #endif
   }else{
-    aJson.addNullToObject(jsonvalues, "B12101");
+    writer.missing("B12101");
 #if defined(SECONDARYPARAMETER)
     // if you have a second value add here
-    aJson.addNullToObject(jsonvalues, "B13003");
+    writer.missing("B13003");
 #endif
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverHih6100::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 #if defined(USEARDUINOJSON)
@@ -987,22 +1045,26 @@ int SensorDriverHyt271::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverHyt271::getJson() {
+int SensorDriverHyt271::writeValues(SensorWriter& writer)
+{
 	long values[2];
-	aJsonObject* jsonvalues;
-	jsonvalues = aJson.createObject();
 	
 	if (SensorDriverHyt271::get(values,2) == SD_SUCCESS) {
-		aJson.addNumberToObject(jsonvalues, "B13003", values[0]);
-		aJson.addNumberToObject(jsonvalues, "B12101", values[1]);
+		writer.value("B13003", values[0]);
+		writer.value("B12101", values[1]);
 	}
 	else {
-		aJson.addNullToObject(jsonvalues, "B12101");
-		aJson.addNullToObject(jsonvalues, "B13003");
+		writer.missing("B12101");
+		writer.missing("B13003");
 	}
 	
-	return jsonvalues;
+	return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverHyt271::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 #endif
@@ -1320,28 +1382,31 @@ int SensorDriverBmp085::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverBmp085::getJson()
+int SensorDriverBmp085::writeValues(SensorWriter& writer)
 {
   long values[2];
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
   //if (SensorDriverBmp085::get2(&pressure,&temperature) == SD_SUCCESS){
   if (SensorDriverBmp085::get(values,2) == SD_SUCCESS){
     // pressure
-    aJson.addNumberToObject(jsonvalues, "B10004", values[0]);      
+    writer.value("B10004", values[0]);      
 #if defined(SECONDARYPARAMETER)
     // temperature
-    aJson.addNumberToObject(jsonvalues, "B12101", values[1]);      
+    writer.value("B12101", values[1]);      
 #endif
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B10004");
+    writer.missing("B10004");
 #if defined(SECONDARYPARAMETER)
-    aJson.addNullToObject(jsonvalues, "B12101");
+    writer.missing("B12101");
 #endif
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverBmp085::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 #endif
@@ -1437,29 +1502,32 @@ int SensorDriverSI7021::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverSI7021::getJson()
+int SensorDriverSI7021::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
   //if (SensorDriverTmp::get2(&humidity,&temperature) == SD_SUCCESS){
   if (SensorDriverSI7021::get(values,2) == SD_SUCCESS){
-    aJson.addNumberToObject(jsonvalues, "B13003", values[0]);      
+    writer.value("B13003", values[0]);      
 
 #if defined(SECONDARYPARAMETER)
     // if you have a second value add here
-    aJson.addNumberToObject(jsonvalues, "B12101", values[1]);      
+    writer.value("B12101", values[1]);      
 #endif
   }else{
-    aJson.addNullToObject(jsonvalues, "B12101");
+    writer.missing("B12101");
 #if defined(SECONDARYPARAMETER)
     // if you have a second value add here
-    aJson.addNullToObject(jsonvalues, "B13003");
+    writer.missing("B13003");
 #endif
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverSI7021::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 #endif
@@ -1578,31 +1646,34 @@ int SensorDriverDw1::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-  #if defined(USEAJSON)
-aJsonObject* SensorDriverDw1::getJson()
+int SensorDriverDw1::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
   if (SensorDriverDw1::get(values,2) == SD_SUCCESS){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B11001", values[0]);      
+      writer.value("B11001", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B11001");
+      writer.missing("B11001");
     }
     // if you have a second value add here
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B11002", values[1]);      
+      writer.value("B11002", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B11002");
+      writer.missing("B11002");
     }
   }else{
-    aJson.addNullToObject(jsonvalues, "B11001");
+    writer.missing("B11001");
     // if you have a second value add here
-    aJson.addNullToObject(jsonvalues, "B11002");
+    writer.missing("B11002");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+  #if defined(USEAJSON)
+aJsonObject* SensorDriverDw1::getJson()
+{
+  return getJsonFromValues();
 }
   #endif
 #endif
@@ -1693,23 +1764,26 @@ int SensorDriverTbr::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverTbr::getJson()
+int SensorDriverTbr::writeValues(SensorWriter& writer)
 {
   long values[1];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
   if (SensorDriverTbr::get(values,1) == SD_SUCCESS){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B13011", values[0]);      
+      writer.value("B13011", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B13011");
+      writer.missing("B13011");
     }
   }else{
-    aJson.addNullToObject(jsonvalues, "B13011");
+    writer.missing("B13011");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverTbr::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 #endif
@@ -1829,31 +1903,34 @@ int SensorDriverTHoneshot::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverTHoneshot::getJson()
+int SensorDriverTHoneshot::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
   if (SensorDriverTHoneshot::get(values,2) == SD_SUCCESS){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B12101", values[0]);      
+      writer.value("B12101", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B12101");
+      writer.missing("B12101");
     }
 
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B13003", values[1]);      
+      writer.value("B13003", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B13003");
+      writer.missing("B13003");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B12101");
-    aJson.addNullToObject(jsonvalues, "B13003");
+    writer.missing("B12101");
+    writer.missing("B13003");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverTHoneshot::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 #endif
@@ -2033,13 +2110,10 @@ int SensorDriverTH60mean::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverTH60mean::getJson()
+int SensorDriverTH60mean::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
 
   short unsigned int ntry=NTRY;
 
@@ -2051,21 +2125,27 @@ aJsonObject* SensorDriverTH60mean::getJson()
 
   if (ntry > 0){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B12101", values[0]);      
+      writer.value("B12101", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B12101");
+      writer.missing("B12101");
     }
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B13003", values[1]);      
+      writer.value("B13003", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B13003");
+      writer.missing("B13003");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B12101");
-    aJson.addNullToObject(jsonvalues, "B13003");
+    writer.missing("B12101");
+    writer.missing("B13003");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverTH60mean::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -2236,13 +2316,10 @@ int SensorDriverTHmean::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverTHmean::getJson()
+int SensorDriverTHmean::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
 
   short unsigned int ntry=NTRY;
 
@@ -2254,22 +2331,28 @@ aJsonObject* SensorDriverTHmean::getJson()
 
   if (ntry > 0){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B12101", values[0]);      
+      writer.value("B12101", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B12101");
+      writer.missing("B12101");
     }
 
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B13003", values[1]);      
+      writer.value("B13003", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B13003");      
+      writer.missing("B13003");      
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B12101");
-    aJson.addNullToObject(jsonvalues, "B13003");
+    writer.missing("B12101");
+    writer.missing("B13003");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverTHmean::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -2442,13 +2525,10 @@ int SensorDriverTHmean::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverTHmin::getJson()
+int SensorDriverTHmin::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
 
   short unsigned int ntry=NTRY;
 
@@ -2460,21 +2540,27 @@ aJsonObject* SensorDriverTHmin::getJson()
 
   if (ntry > 0){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B12101", values[0]);      
+      writer.value("B12101", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B12101");
+      writer.missing("B12101");
     }
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B13003", values[1]);      
+      writer.value("B13003", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B13003");
+      writer.missing("B13003");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B12101");
-    aJson.addNullToObject(jsonvalues, "B13003");
+    writer.missing("B12101");
+    writer.missing("B13003");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverTHmin::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -2643,13 +2729,10 @@ int SensorDriverTHmax::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverTHmax::getJson()
+int SensorDriverTHmax::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
 
   short unsigned int ntry=NTRY;
 
@@ -2661,22 +2744,28 @@ aJsonObject* SensorDriverTHmax::getJson()
 
   if (ntry > 0){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B12101", values[0]);      
+      writer.value("B12101", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B12101");
+      writer.missing("B12101");
     }
 
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B13003", values[1]);      
+      writer.value("B13003", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B13003");
+      writer.missing("B13003");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B12101");
-    aJson.addNullToObject(jsonvalues, "B13003");
+    writer.missing("B12101");
+    writer.missing("B13003");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverTHmax::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -2805,31 +2894,34 @@ int SensorDriverSDS011oneshot::getdata(unsigned long& data,unsigned short& width
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverSDS011oneshot::getJson()
+int SensorDriverSDS011oneshot::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
   if (SensorDriverSDS011oneshot::get(values,2) == SD_SUCCESS){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15198", values[0]);      
+      writer.value("B15198", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15198");
+      writer.missing("B15198");
     }
 
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15195", values[1]);      
+      writer.value("B15195", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15195");
+      writer.missing("B15195");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B15198");
-    aJson.addNullToObject(jsonvalues, "B15195");
+    writer.missing("B15198");
+    writer.missing("B15195");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverSDS011oneshot::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 #if defined(USEARDUINOJSON)
@@ -2981,31 +3073,34 @@ int SensorDriverSDS011oneshotSerial::getdata(unsigned long& data,unsigned short&
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverSDS011oneshotSerial::getJson()
+int SensorDriverSDS011oneshotSerial::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
   if (SensorDriverSDS011oneshotSerial::get(values,2) == SD_SUCCESS){
     if (values[0] != 0xFFFFFFFF){
-      aJson.addNumberToObject(jsonvalues, "B15198", values[0]);      
+      writer.value("B15198", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15198");
+      writer.missing("B15198");
     }
 
     if (values[1] != 0xFFFFFFFF){
-      aJson.addNumberToObject(jsonvalues, "B15195", values[1]);      
+      writer.value("B15195", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15195");
+      writer.missing("B15195");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B15198");
-    aJson.addNullToObject(jsonvalues, "B15195");
+    writer.missing("B15198");
+    writer.missing("B15195");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverSDS011oneshotSerial::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -3225,13 +3320,10 @@ int SensorDriverSDS011mean::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverSDS01160mean::getJson()
+int SensorDriverSDS01160mean::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
 
   short unsigned int ntry=NTRY;
 
@@ -3243,21 +3335,27 @@ aJsonObject* SensorDriverSDS01160mean::getJson()
 
   if (ntry > 0){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15198", values[0]);      
+      writer.value("B15198", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15198");
+      writer.missing("B15198");
     }
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15195", values[1]);      
+      writer.value("B15195", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15195");
+      writer.missing("B15195");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B15198");
-    aJson.addNullToObject(jsonvalues, "B15195");
+    writer.missing("B15198");
+    writer.missing("B15195");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverSDS01160mean::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -3428,13 +3526,10 @@ int SensorDriverSDS011mean::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverSDS011mean::getJson()
+int SensorDriverSDS011mean::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
 
   short unsigned int ntry=NTRY;
 
@@ -3446,22 +3541,28 @@ aJsonObject* SensorDriverSDS011mean::getJson()
 
   if (ntry > 0){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15198", values[0]);      
+      writer.value("B15198", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15198");
+      writer.missing("B15198");
     }
 
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15195", values[1]);      
+      writer.value("B15195", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15195");      
+      writer.missing("B15195");      
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B15198");
-    aJson.addNullToObject(jsonvalues, "B15195");
+    writer.missing("B15198");
+    writer.missing("B15195");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverSDS011mean::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -3634,13 +3735,10 @@ int SensorDriverSDS011min::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverSDS011min::getJson()
+int SensorDriverSDS011min::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
 
   short unsigned int ntry=NTRY;
 
@@ -3652,21 +3750,27 @@ aJsonObject* SensorDriverSDS011min::getJson()
 
   if (ntry > 0){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15198", values[0]);      
+      writer.value("B15198", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15198");
+      writer.missing("B15198");
     }
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15195", values[1]);      
+      writer.value("B15195", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15195");
+      writer.missing("B15195");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B15198");
-    aJson.addNullToObject(jsonvalues, "B15195");
+    writer.missing("B15198");
+    writer.missing("B15195");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverSDS011min::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -3835,13 +3939,10 @@ int SensorDriverSDS011max::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverSDS011max::getJson()
+int SensorDriverSDS011max::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
 
   short unsigned int ntry=NTRY;
 
@@ -3853,22 +3954,28 @@ aJsonObject* SensorDriverSDS011max::getJson()
 
   if (ntry > 0){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15198", values[0]);      
+      writer.value("B15198", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15198");
+      writer.missing("B15198");
     }
 
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15195", values[1]);      
+      writer.value("B15195", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15195");
+      writer.missing("B15195");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B15198");
-    aJson.addNullToObject(jsonvalues, "B15195");
+    writer.missing("B15198");
+    writer.missing("B15195");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverSDS011max::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -3995,31 +4102,34 @@ int SensorDriverMICS4514oneshot::getdata(unsigned long& data,unsigned short& wid
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverMICS4514oneshot::getJson()
+int SensorDriverMICS4514oneshot::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
   if (SensorDriverMICS4514oneshot::get(values,2) == SD_SUCCESS){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15196", values[0]);      
+      writer.value("B15196", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15196");
+      writer.missing("B15196");
     }
 
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15193", values[1]);      
+      writer.value("B15193", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15193");
+      writer.missing("B15193");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B15196");
-    aJson.addNullToObject(jsonvalues, "B15193");
+    writer.missing("B15196");
+    writer.missing("B15193");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverMICS4514oneshot::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -4229,13 +4339,10 @@ int SensorDriverMICS451460mean::getdata(unsigned long& data,unsigned short& widt
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverMICS451460mean::getJson()
+int SensorDriverMICS451460mean::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
 
   short unsigned int ntry=NTRY;
 
@@ -4247,21 +4354,27 @@ aJsonObject* SensorDriverMICS451460mean::getJson()
 
   if (ntry > 0){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15198", values[0]);      
+      writer.value("B15198", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15198");
+      writer.missing("B15198");
     }
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15195", values[1]);      
+      writer.value("B15195", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15195");
+      writer.missing("B15195");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B15198");
-    aJson.addNullToObject(jsonvalues, "B15195");
+    writer.missing("B15198");
+    writer.missing("B15195");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverMICS451460mean::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -4432,13 +4545,10 @@ int SensorDriverMICS4514mean::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverMICS4514mean::getJson()
+int SensorDriverMICS4514mean::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
 
   short unsigned int ntry=NTRY;
 
@@ -4450,22 +4560,28 @@ aJsonObject* SensorDriverMICS4514mean::getJson()
 
   if (ntry > 0){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15196", values[0]);      
+      writer.value("B15196", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15196");
+      writer.missing("B15196");
     }
 
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15193", values[1]);      
+      writer.value("B15193", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15193");      
+      writer.missing("B15193");      
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B15196");
-    aJson.addNullToObject(jsonvalues, "B15193");
+    writer.missing("B15196");
+    writer.missing("B15193");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverMICS4514mean::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -4638,13 +4754,10 @@ int SensorDriverMICS4514min::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverMICS4514min::getJson()
+int SensorDriverMICS4514min::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
 
   short unsigned int ntry=NTRY;
 
@@ -4656,21 +4769,27 @@ aJsonObject* SensorDriverMICS4514min::getJson()
 
   if (ntry > 0){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15196", values[0]);      
+      writer.value("B15196", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15196");
+      writer.missing("B15196");
     }
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15193", values[1]);      
+      writer.value("B15193", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15193");
+      writer.missing("B15193");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B15196");
-    aJson.addNullToObject(jsonvalues, "B15193");
+    writer.missing("B15196");
+    writer.missing("B15193");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverMICS4514min::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -4839,13 +4958,10 @@ int SensorDriverMICS4514max::getdata(unsigned long& data,unsigned short& width)
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverMICS4514max::getJson()
+int SensorDriverMICS4514max::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
 
   short unsigned int ntry=NTRY;
 
@@ -4857,22 +4973,28 @@ aJsonObject* SensorDriverMICS4514max::getJson()
 
   if (ntry > 0){
     if (values[0] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15196", values[0]);      
+      writer.value("B15196", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15196");
+      writer.missing("B15196");
     }
 
     if (values[1] >= 0){
-      aJson.addNumberToObject(jsonvalues, "B15193", values[1]);      
+      writer.value("B15193", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15193");
+      writer.missing("B15193");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B15196");
-    aJson.addNullToObject(jsonvalues, "B15193");
+    writer.missing("B15196");
+    writer.missing("B15193");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverMICS4514max::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 #endif
@@ -4976,31 +5098,34 @@ int SensorDriverHPMoneshotSerial::getdata(unsigned long& data,unsigned short& wi
 }
 #endif
 
-#if defined(USEAJSON)
-aJsonObject* SensorDriverHPMoneshotSerial::getJson()
+int SensorDriverHPMoneshotSerial::writeValues(SensorWriter& writer)
 {
   long values[2];
 
-  aJsonObject* jsonvalues;
-  jsonvalues = aJson.createObject();
   if (SensorDriverHPMoneshotSerial::get(values,2) == SD_SUCCESS){
     if (values[0] != 0xFFFFFFFF){
-      aJson.addNumberToObject(jsonvalues, "B15198", values[0]);      
+      writer.value("B15198", values[0]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15198");
+      writer.missing("B15198");
     }
 
     if (values[1] != 0xFFFFFFFF){
-      aJson.addNumberToObject(jsonvalues, "B15195", values[1]);      
+      writer.value("B15195", values[1]);      
     }else{
-      aJson.addNullToObject(jsonvalues, "B15195");
+      writer.missing("B15195");
     }
 
   }else{
-    aJson.addNullToObject(jsonvalues, "B15198");
-    aJson.addNullToObject(jsonvalues, "B15195");
+    writer.missing("B15198");
+    writer.missing("B15195");
   }
-  return jsonvalues;
+  return SD_SUCCESS;
+}
+
+#if defined(USEAJSON)
+aJsonObject* SensorDriverHPMoneshotSerial::getJson()
+{
+  return getJsonFromValues();
 }
 #endif
 
@@ -41,6 +41,21 @@
 //void SensorDriverInit();
 
 
+// receive the values of a sensor from SensorDriver::writeValues
+// without any dynamic allocation: value() or missing() is called for
+// each variable, with the same codes and in the same order of getJson()
+// code is valid only during the call
+class SensorWriter
+{
+  public:
+    virtual void value(const char* code, long value) = 0;
+    virtual void missing(const char* code) = 0;
+    // print in buf the payload {"v":value,"t":"timestamp"} as aJson does
+    // (the same bytes, truncated to len-1 chars); with timestamp NULL
+    // "t" is omitted; return the length of the complete payload
+    static int payload(char* buf, size_t len, long value, const char* timestamp);
+};
+
 
 class SensorDriver
 {
@@ -64,7 +79,10 @@ class SensorDriver
 #endif
 #if defined(USEARDUINOJSON)
    virtual int getJson(char *json_buffer, size_t json_buffer_length) = 0;
-#endif  
+#endif
+    // write the values to writer, as getJson() but with no malloc;
+    // the default walks the object returned by getJson()
+    virtual int writeValues(SensorWriter& writer);
     virtual ~SensorDriver();
     // Factory method
     //   SensorDriver* sd = SensorDriver::create("I2C","TMP");
@@ -76,6 +94,10 @@ class SensorDriver
     const char* _type;
     int _address;
     unsigned long _timing;
+#if defined(USEAJSON)
+    // getJson() of the drivers that implement writeValues()
+    aJsonObject* getJsonFromValues();
+#endif
 
 #if defined (RADIORF24)
     char* _mainbuf;
@@ -108,6 +130,7 @@ class SensorDriverTmp : public SensorDriver
     #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
     #endif
+    virtual int writeValues(SensorWriter& writer);
     #if defined(USEAJSON)
     virtual aJsonObject* getJson();
     #endif
@@ -135,6 +158,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -186,6 +210,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -213,6 +238,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -262,6 +288,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -307,6 +334,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -336,6 +364,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -365,6 +394,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -394,6 +424,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -419,6 +450,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -444,6 +476,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -468,6 +501,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -498,6 +532,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -518,6 +553,7 @@ class SensorDriverTmp : public SensorDriver
   #endif
     virtual ~SensorDriverSDS011oneshotSerial();
 
+    virtual int writeValues(SensorWriter& writer);
 #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -552,6 +588,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -577,6 +614,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -602,6 +640,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -626,6 +665,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -656,6 +696,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -685,6 +726,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -710,6 +752,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -735,6 +778,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -759,6 +803,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -804,6 +849,7 @@ class SensorDriverTmp : public SensorDriver
   #if defined (USEGETDATA)
     virtual int getdata(unsigned long& data,unsigned short& width);
   #endif
+    virtual int writeValues(SensorWriter& writer);
   #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -827,6 +873,7 @@ class SensorDriverTmp : public SensorDriver
   #endif
     virtual ~SensorDriverHPMoneshotSerial();
 
+    virtual int writeValues(SensorWriter& writer);
 #if defined(USEAJSON)
     virtual aJsonObject* getJson();
   #endif
@@ -0,0 +1,22 @@
+// configuration of SensorDriver for the host tests: aJson and the
+// drivers that need only the I2C bus
+
+#define MAXDELAYFORREAD 60000
+#define USEAJSON
+#define NTRY 3
+
+#define TMPDRIVER
+#define ADTDRIVER
+#define HIHDRIVER
+#define HI7021DRIVER
+#define DAVISWIND1
+#define TIPPINGBUCKETRAINGAUGE
+#define TEMPERATUREHUMIDITY_REPORT
+#define SDS011_REPORT
+
+#if defined (TIPPINGBUCKETRAINGAUGE)
+ // how many rain for one tick of the rain gauge (Hg/m^2)
+ #define RAINFORTIP 2
+#endif
+
+#define IF_SDSDEBUG(x)
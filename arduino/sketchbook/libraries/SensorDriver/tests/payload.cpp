@@ -0,0 +1,168 @@
+// Host test: the strings built without malloc by SensorWriter::payload()
+// and getJsonFromValues() must be byte-identical to the ones printed by
+// aJson, as the sketches built them before writeValues().
+//
+// build and run with "make" in this directory
+
+#include "SensorDriver.h"
+#include <limits.h>
+
+HardwareSerial Serial;
+TwoWire Wire;
+
+unsigned long millis()
+{
+  return 1000ul;
+}
+
+void delay(unsigned long ms)
+{
+}
+
+static int failures=0;
+
+static void check(const char* what, const char* expected, const char* got)
+{
+  if (strcmp(expected, got) == 0) return;
+  printf("FAIL %s\n  aJson:  %s\n  writer: %s\n", what, expected, got);
+  failures++;
+}
+
+// the payload as rmap.ino printed it with aJson
+static void ajsonpayload(char* buf, size_t len, long value, const char* timestamp)
+{
+  aJsonObject *payloadobj = aJson.createObject();
+  aJson.addNumberToObject(payloadobj, "v", value);
+  if (timestamp != NULL) aJson.addStringToObject(payloadobj, "t", timestamp);
+  aJson.print(payloadobj, buf, len);
+  aJson.deleteItem(payloadobj);
+}
+
+static void testpayload()
+{
+  const long values[] = {0, 1, -1, 27315, 123456789, LONG_MAX, LONG_MIN};
+  const char* timestamps[] = {NULL, "2014-09-24T12:00:00"};
+  // 40 is PAYLOADLEN of rmap.ino, the shorter ones truncate
+  const size_t lens[] = {40, 24, 8, 2};
+
+  for (size_t v=0; v < sizeof(values)/sizeof(*values); v++){
+    for (size_t t=0; t < sizeof(timestamps)/sizeof(*timestamps); t++){
+      for (size_t l=0; l < sizeof(lens)/sizeof(*lens); l++){
+	char expected[40], got[40], what[80];
+	ajsonpayload(expected, lens[l], values[v], timestamps[t]);
+	SensorWriter::payload(got, lens[l], values[v], timestamps[t]);
+	snprintf(what, sizeof(what), "payload %ld %s len %u", values[v],
+		 timestamps[t] ? timestamps[t] : "NULL", (unsigned)lens[l]);
+	check(what, expected, got);
+      }
+    }
+  }
+}
+
+// a driver with fixed values, null included
+class SensorDriverFixed : public SensorDriver
+{
+  public:
+    virtual int prepare(unsigned long& waittime) { waittime=0; return SD_SUCCESS; }
+    virtual int get(long values[], size_t lenvalues) { return SD_INTERNAL_ERROR; }
+    virtual aJsonObject* getJson() { return getJsonFromValues(); }
+    virtual int writeValues(SensorWriter& writer) {
+      writer.value("B12101", 27315);
+      writer.missing("B13003");
+      writer.value("B10004", -1);
+      writer.value("B15198", LONG_MAX);
+      return SD_SUCCESS;
+    }
+};
+
+static void printjson(const char* what, aJsonObject* expectedobj, SensorDriver* sd)
+{
+  char expected[120], got[120];
+  aJsonObject* gotobj = sd->getJson();
+  aJson.print(expectedobj, expected, sizeof(expected));
+  aJson.print(gotobj, got, sizeof(got));
+  check(what, expected, got);
+  aJson.deleteItem(gotobj);
+  aJson.deleteItem(expectedobj);
+}
+
+static void testfixed()
+{
+  SensorDriverFixed sd;
+  aJsonObject* jsonvalues = aJson.createObject();
+  aJson.addNumberToObject(jsonvalues, "B12101", 27315L);
+  aJson.addNullToObject(jsonvalues, "B13003");
+  aJson.addNumberToObject(jsonvalues, "B10004", -1L);
+  aJson.addNumberToObject(jsonvalues, "B15198", LONG_MAX);
+  printjson("getJsonFromValues fixed", jsonvalues, &sd);
+}
+
+// the real drivers, with the getJson() of the library before writeValues()
+static void testdrivers()
+{
+  const uint8_t adt[] = {0x0c, 0x80};
+  const uint8_t hih[] = {0x1f, 0xff, 0x66, 0x64};
+  long values[2];
+  aJsonObject* jsonvalues;
+
+  SensorDriver* sd = SensorDriver::create("I2C", "ADT");
+  sd->setup("I2C", 72);
+
+  Wire.reply(adt, sizeof(adt));
+  jsonvalues = aJson.createObject();
+  if (sd->get(values, 1) == SD_SUCCESS){
+    aJson.addNumberToObject(jsonvalues, "B12101", values[0]);
+  }else{
+    aJson.addNullToObject(jsonvalues, "B12101");
+  }
+  Wire.reply(adt, sizeof(adt));
+  printjson("getJsonFromValues ADT", jsonvalues, sd);
+
+  Wire.reply(adt, 1);
+  jsonvalues = aJson.createObject();
+  aJson.addNullToObject(jsonvalues, "B12101");
+  printjson("getJsonFromValues ADT missing", jsonvalues, sd);
+  delete sd;
+
+  sd = SensorDriver::create("I2C", "HIH");
+  sd->setup("I2C", 39);
+
+  Wire.reply(hih, sizeof(hih));
+  jsonvalues = aJson.createObject();
+  if (sd->get(values, 2) == SD_SUCCESS){
+    aJson.addNumberToObject(jsonvalues, "B13003", values[0]);
+#if defined(SECONDARYPARAMETER)
+    aJson.addNumberToObject(jsonvalues, "B12101", values[1]);
+#endif
+  }else{
+    aJson.addNullToObject(jsonvalues, "B12101");
+#if defined(SECONDARYPARAMETER)
+    aJson.addNullToObject(jsonvalues, "B13003");
+#endif
+  }
+  Wire.reply(hih, sizeof(hih));
+  printjson("getJsonFromValues HIH", jsonvalues, sd);
+
+  Wire.reply(hih, 0);
+  jsonvalues = aJson.createObject();
+  aJson.addNullToObject(jsonvalues, "B12101");
+#if defined(SECONDARYPARAMETER)
+  aJson.addNullToObject(jsonvalues, "B13003");
+#endif
+  printjson("getJsonFromValues HIH missing", jsonvalues, sd);
+  delete sd;
+}
+
+int main()
+{
+  testpayload();
+  testfixed();
+  testdrivers();
+
+  if (failures){
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,29 @@
+// host stub of the Arduino core used by the SensorDriver tests
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "Print.h"
+
+typedef uint8_t byte;
+
+#define F(x) (x)
+
+unsigned long millis();
+void delay(unsigned long ms);
+
+class HardwareSerial : public Print
+{
+  public:
+    virtual size_t write(uint8_t c) { return fputc(c, stderr) == EOF ? 0 : 1; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
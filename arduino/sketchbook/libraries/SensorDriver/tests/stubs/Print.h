@@ -0,0 +1,42 @@
+// host stub of the Arduino Print class
+#ifndef Print_h
+#define Print_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DEC 10
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+
+    size_t write(const char* str) {
+      size_t n = 0;
+      while (*str) n += write((uint8_t)*str++);
+      return n;
+    }
+    size_t print(const char* str) { return write(str); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int n, int base = DEC) { return print((long)n, base); }
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+    size_t print(long n, int base = DEC) {
+      char buf[24];
+      snprintf(buf, sizeof(buf), base == 16 ? "%lx" : "%ld", n);
+      return write(buf);
+    }
+    size_t print(unsigned long n, int base = DEC) {
+      char buf[24];
+      snprintf(buf, sizeof(buf), base == 16 ? "%lx" : "%lu", n);
+      return write(buf);
+    }
+    size_t println() { return write("\r\n"); }
+    template<class T> size_t println(T x) { size_t n = print(x); return n + println(); }
+    template<class T> size_t println(T x, int base) { size_t n = print(x, base); return n + println(); }
+};
+
+#endif
@@ -0,0 +1,38 @@
+// host stub of the I2C library: requestFrom() returns the bytes queued
+// by the test with Wire.reply()
+#ifndef Wire_h
+#define Wire_h
+
+#include "Arduino.h"
+
+class TwoWire
+{
+  public:
+    TwoWire() : _len(0), _pos(0) {}
+    void begin() {}
+    void beginTransmission(int address) {}
+    uint8_t endTransmission(bool stop = true) { return 0; }
+    size_t write(uint8_t c) { return 1; }
+    uint8_t requestFrom(int address, int quantity) {
+      _pos = 0;
+      if (quantity < _len) _len = quantity;
+      return _len;
+    }
+    int available() { return _len - _pos; }
+    int read() { return _pos < _len ? _data[_pos++] : -1; }
+
+    // the bytes returned by the next requestFrom()
+    void reply(const uint8_t* data, int len) {
+      _len = len < (int)sizeof(_data) ? len : (int)sizeof(_data);
+      memcpy(_data, data, _len);
+      _pos = _len;
+    }
+
+  private:
+    uint8_t _data[32];
+    int _len, _pos;
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,8 @@
+// host stub: no program memory on the host
+#ifndef pgmspace_h
+#define pgmspace_h
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+#endif
@@ -90,6 +90,9 @@ void setMillis(unsigned long new_millis){
 
 #if defined(ETHERNETMQTT) || defined(GSMGPRSMQTT)
 #include <PubSubClient.h>
+#else
+// the values are sent together only by MQTT
+#undef MQTTAGGREGATE
 #endif
 
 #define PAYLOADLEN 40
@@ -121,6 +124,31 @@ typedef struct Records{
 Record record;
 uint32_t pos;
 
+// the records are collected in a sector and written to the data file
+// a sector at a time (see sdqueueappend)
+#define SDSECTOR_SIZE 512
+#define SDSECTOR_RECORDS (SDSECTOR_SIZE/sizeof(Record))
+Record sdsector[SDSECTOR_RECORDS];
+uint8_t sdsectorcount=0;
+uint32_t sdsectorpos=0;
+bool sdsectordirty=false;
+
+// bitmap of the records sent after they were written, one bit for each
+// record of the data file, in a file with extension .snt
+File sentFile;
+char sentfileName[BASE_NAME_SIZE+8];
+int32_t sentbyteindex=-1;
+uint8_t sentbyte;
+
+// the .snt file starts with the cursor: the position of the first record
+// of the data file not sent, all the records before it are sent
+#define SENT_HEADER_SIZE sizeof(uint32_t)
+uint32_t sentcursor=0;
+uint32_t sentcursorsaved=0;
+
+// the name of the first data file with records to send
+#define QUEUE_INDEX_NAME "RMAP_IDX.dat"
+
 // check if filename with two extensions (.que and .don) exixts
 bool exists(char* fileName)
 {
@@ -597,6 +625,10 @@ bool rmapconnect()
     IF_SDEBUG(DBGSERIAL.println(F("#mqtt connected")));
     IF_LCD(lcd.setCursor(0,3)); 
     IF_LCD(lcd.print(F("MQTT: connected")));
+
+#ifdef SDCARD
+    mqttpendingclear();
+#endif
     
     // subcribe to incoming topic
 
@@ -648,6 +680,103 @@ bool rmapdisconnect()
   return true;
 }
 
+// wait for a place in the window of the QoS 1 messages in flight;
+// mqttclient.loop() can call mqttcallback that use mainbuf,
+// so call this before composing a message in mainbuf
+bool mqttwindow()
+{
+  unsigned long start=millis();
+  while (mqttclient.inflight() >= MQTT_MAX_INFLIGHT) {
+    wdt_reset();
+    if (!mqttclient.loop()) return false;
+    if (millis()-start > MQTT_ACK_TIMEOUT*1000UL) return false;
+  }
+  return true;
+}
+
+#ifdef SDCARD
+
+// the records of the data file waiting for the PUBACK of their message:
+// the record is marked as sent only when the broker acknowledges it
+// (a record lost from this list is sent again from the SD card)
+#define MQTTPENDING_LEN (MQTT_MAX_INFLIGHT*MAX_VALUES_FOR_SENSOR)
+struct {
+  uint16_t msgid;
+  uint32_t pos;
+} mqttpending[MQTTPENDING_LEN];
+uint8_t mqttpendingcount=0;
+
+// the last messages acknowledged: with MQTTAGGREGATE the PUBACK can come
+// before the records of the message are written
+uint16_t mqttacked[MAX_VALUES_FOR_SENSOR];
+uint8_t mqttackednext=0;
+
+// the record at pos of the data file was sent in the message msgid:
+// return true if the message was already acknowledged
+bool mqttpendingadd(uint16_t msgid, uint32_t pos)
+{
+  for (uint8_t i = 0; i < MAX_VALUES_FOR_SENSOR; i++) {
+    if (msgid != 0 && mqttacked[i] == msgid) return true;
+  }
+
+  if (mqttpendingcount >= MQTTPENDING_LEN) {
+    // forget the oldest
+    mqttpendingcount--;
+    memmove(mqttpending, mqttpending+1, mqttpendingcount*sizeof(mqttpending[0]));
+    #ifdef REPORTMODE
+    newqueued=true;
+    #endif
+  }
+  mqttpending[mqttpendingcount].msgid=msgid;
+  mqttpending[mqttpendingcount].pos=pos;
+  mqttpendingcount++;
+  return false;
+}
+
+// PUBACK received: mark the records of the message as sent;
+// mqttclient calls this only for a message in its window
+void mqttack(uint16_t msgid)
+{
+  mqttacked[mqttackednext]=msgid;
+  mqttackednext=(mqttackednext+1) % MAX_VALUES_FOR_SENSOR;
+
+  for (uint8_t i = 0; i < mqttpendingcount;) {
+    if (mqttpending[i].msgid != msgid) {
+      i++;
+      continue;
+    }
+    sdqueuemark(mqttpending[i].pos);
+    mqttpendingcount--;
+    memmove(mqttpending+i, mqttpending+i+1, (mqttpendingcount-i)*sizeof(mqttpending[0]));
+  }
+}
+
+// the message ids start again from 1 on every connect: forget the
+// messages of the previous connection, their records are sent again
+void mqttpendingclear()
+{
+  mqttpendingcount=0;
+  memset(mqttacked,0,sizeof(mqttacked));
+  mqttackednext=0;
+}
+
+// wait for the PUBACK of the records of the data file, before closing it:
+// return true if all the messages were acknowledged
+bool mqttpendingdrain()
+{
+  unsigned long start=millis();
+  while (mqttpendingcount > 0 && mqttclient.inflight() > 0) {
+    wdt_reset();
+    if (!mqttclient.loop()) break;
+    if (millis()-start > MQTT_ACK_TIMEOUT*1000UL) break;
+  }
+  wdt_reset();
+  bool acked = mqttpendingcount == 0;
+  mqttpendingcount=0;
+  return acked;
+}
+
+#endif
 #endif
 
 #ifdef ETHERNETON
@@ -1710,6 +1839,164 @@ void GPS_latlon_read(int32_t* lat,int32_t* lon)
 }
 #endif
 
+// the values of a sensor, collected by SensorDriver::writeValues
+// without using the heap as aJson does
+class SensorValues : public SensorWriter
+{
+ public:
+  uint8_t count;
+  char codes[MAX_VALUES_FOR_SENSOR][7];
+  long values[MAX_VALUES_FOR_SENSOR];
+  bool nulls[MAX_VALUES_FOR_SENSOR];
+
+  SensorValues() : count(0) {}
+
+  virtual void value(const char* code, long value) {
+    if (add(code)) values[count++]=value;
+  }
+  virtual void missing(const char* code) {
+    if (add(code)) nulls[count++]=true;
+  }
+
+ private:
+  bool add(const char* code) {
+    if (count >= MAX_VALUES_FOR_SENSOR) return false;
+    strncpy(codes[count], code, sizeof(codes[count])-1);
+    codes[count][sizeof(codes[count])-1]='\0';
+    nulls[count]=false;
+    return true;
+  }
+};
+
+#ifdef MQTTAGGREGATE
+// the IDE would generate this prototype on top, before SensorValues
+uint8_t mqttaggregate(uint8_t i, SensorValues& values, uint16_t msgids[]);
+#endif
+
+// compose in mainbuf the topic of the values of sensor i:
+// root path and path of the sensor (ending with "/")
+void sensortopic(uint8_t i)
+{
+#ifdef I2CGPSPRESENT
+
+  int32_t lat;
+  int32_t lon;
+  GPS_latlon_read(&lat,&lon);
+
+  // gcc BUG !!!!!!!!!!!!!!!!!! (4.3, 4.8 and 4.9 versions)
+  // sprintf(mainbuf,configuration.mqttrootpath, lon/100,lat/100);
+
+  // char *format;
+  // format=configuration.mqttrootpath;
+  // sprintf(mainbuf,format, lon/100,lat/100);
+
+  char format[MQTTROOTPATH_LEN];
+  strcpy(format,configuration.mqttrootpath);
+  sprintf(mainbuf,format, lon/100,lat/100);
+
+#else
+  strcpy (mainbuf,configuration.mqttrootpath);
+#endif
+
+  strcat (mainbuf,configuration.sensors[i].mqttpath);
+}
+
+#ifdef MQTTAGGREGATE
+
+// compose in mainbuf the topic of the aggregated values of sensor i and
+// return its length
+size_t aggregatetopic(uint8_t i)
+{
+  sensortopic(i);
+  size_t len=strlen(mainbuf);
+  if (len > 0 && mainbuf[len-1] == '/') mainbuf[--len]='\0';
+  return len;
+}
+
+// publish with QoS 1 a message of the values of sensor i;
+// return the message id or 0 on error
+uint16_t aggregatepublish(uint8_t i, const char* payload)
+{
+  if (!mqttwindow()) return 0;
+  aggregatetopic(i);
+  IF_SDEBUG(DBGSERIAL.print(F("#topic:")));
+  IF_SDEBUG(DBGSERIAL.println(mainbuf));
+  IF_SDEBUG(DBGSERIAL.print(F("#payload:")));
+  IF_SDEBUG(DBGSERIAL.println(payload));
+  wdt_reset();
+  uint16_t msgid=mqttclient.publishQos1(mainbuf, payload);
+  wdt_reset();
+  return msgid;
+}
+
+// publish all the values of sensor i (same level, time range and time)
+// in as few messages as possible, instead of one message for each value:
+// topic is the path of the sensor without the variable and payload is
+// {"v":{"B12101":27315,"B13003":45},"t":"2014-09-24T12:00:00"}
+// the values that don't fit in a MQTT packet go in another message
+// return a bit set for each value sent, in the order of the not null values,
+// and in msgids the id of the message of each of them
+uint8_t mqttaggregate(uint8_t i, SensorValues& values, uint16_t msgids[])
+{
+  char payload[MQTT_MAX_PACKET_SIZE];
+  char item[32];
+  char tail[32];
+  uint8_t sentmask=0;
+  uint8_t chunkmask=0;
+  uint8_t chunkstart=0;
+  uint8_t nvalue=0;
+  uint16_t msgid;
+  size_t len;
+  size_t room;
+
+  len=aggregatetopic(i);
+
+  // fixed header, remaining length and topic length come before the topic
+  if (len + 7 >= sizeof(payload)) return 0;
+  room = sizeof(payload) - 7 - len;
+
+  // if time was never setted I suppose I have no time and I do not pubblish time
+  if ( t != 0 ){
+    sprintf(tail, "},\"t\":\"%04u-%02u-%02uT%02u:%02u:%02u\"}",year(t),month(t),day(t),hour(t),minute(t),second(t));
+  }else{
+    strcpy(tail, "}}");
+  }
+
+  strcpy(payload, "{\"v\":{");
+  for (uint8_t n = 0; n < values.count; n++) {
+    if (values.nulls[n]) continue;
+
+    snprintf(item, sizeof(item), "%s\"%s\":%ld", chunkmask ? "," : "", values.codes[n], values.values[n]);
+    if (chunkmask && strlen(payload) + strlen(item) + strlen(tail) > room) {
+      // send the values collected so far and start a new message
+      strcat(payload, tail);
+      msgid=aggregatepublish(i, payload);
+      if (msgid) sentmask |= chunkmask;
+      while (chunkstart < nvalue) msgids[chunkstart++]=msgid;
+      strcpy(payload, "{\"v\":{");
+      chunkmask=0;
+      snprintf(item, sizeof(item), "\"%s\":%ld", values.codes[n], values.values[n]);
+    }
+    strcat(payload, item);
+    chunkmask |= 1 << nvalue;
+    nvalue++;
+  }
+
+  if (chunkmask) {
+    strcat(payload, tail);
+    msgid=aggregatepublish(i, payload);
+    if (msgid) sentmask |= chunkmask;
+    while (chunkstart < nvalue) msgids[chunkstart++]=msgid;
+  }
+
+  mgrmqtt();
+  wdt_reset();
+
+  return sentmask;
+}
+
+#endif
+
 // this is the routine called by a active board
 // do all periodic task 
 // will be called every tr seconds
@@ -1841,28 +2128,35 @@ void Repeats() {
   for (int i = 0; i < SENSORS_LEN; i++) {
     if (drivers[i].manager == NULL) continue;
 
-    IF_SDEBUG(DBGSERIAL.print(F("#getjson: ")));
+    IF_SDEBUG(DBGSERIAL.print(F("#writevalues: ")));
     IF_SDEBUG(DBGSERIAL.println(i));
 
-    aJsonObject *valuesobj = drivers[i].manager->getJson();
-    if (!valuesobj) continue;
-    aJsonObject *valueobj = valuesobj->child;
-    if (!valueobj) continue;
+    SensorValues values;
+    if (drivers[i].manager->writeValues(values) != SD_SUCCESS) continue;
+    if (values.count == 0) continue;
 
     uint8_t nvalue=0;
 
-    do {
+#ifdef MQTTAGGREGATE
+    // all the values are published here, in a single message;
+    // the loop below stores them one by one on the SD card
+    uint16_t msgids[MAX_VALUES_FOR_SENSOR];
+    uint8_t sentmask=mqttaggregate(i, values, msgids);
+    bool aggregatefailed=false;
+#endif
+
+    for (uint8_t n = 0; n < values.count; n++) {
 
       wdt_reset();
+#if (defined(ETHERNETMQTT) || defined(GSMGPRSMQTT)) && !defined(MQTTAGGREGATE)
+      // before composing the message in mainbuf
+      mqttwindow();
+#endif
       sprintf ( mainbuf, "%04u-%02u-%02uT%02u:%02u:%02u",year(t),month(t),day(t),hour(t),minute(t),second(t));
 
-      IF_SDEBUG(DBGSERIAL.println(F("#looping over ajson object: ")));
+      IF_SDEBUG(DBGSERIAL.println(F("#looping over values: ")));
 
-      aJsonObject *payloadobj = aJson.createObject();
-      //char cval[10];
-      //sprintf ( cval, "%i",valueobj->valueint);
-      //aJson.addStringToObject(payloadobj, "v", cval);
-      if (valueobj->type == aJson_NULL) {
+      if (values.nulls[n]) {
 
 	IF_SDEBUG(DBGSERIAL.println(F("#missing")));
 
@@ -1870,71 +2164,35 @@ void Repeats() {
 	IF_LCD(lcd.print(F("missing value       ")));
 
 	//skip
-	aJson.deleteItem(payloadobj);
-	valueobj=valueobj->next;
 	continue;
 
-	// or missing value
-	//aJson.addNullToObject(payloadobj, "v");
-	
       }else{
-	aJson.addNumberToObject(payloadobj, "v", valueobj->valuelong);
 
 	IF_SDEBUG(DBGSERIAL.print(F("#")));
-	IF_SDEBUG(DBGSERIAL.print(valueobj->name));
+	IF_SDEBUG(DBGSERIAL.print(values.codes[n]));
 	IF_SDEBUG(DBGSERIAL.print(F(":")));
-	IF_SDEBUG(DBGSERIAL.println(valueobj->valuelong,DEC));
+	IF_SDEBUG(DBGSERIAL.println(values.values[n],DEC));
 
 	IF_LCD(lcd.setCursor(0,i)); 
 	IF_LCD(lcd.print(F("                    ")));
 	IF_LCD(lcd.setCursor(0,i)); 
-	IF_LCD(lcd.print(valueobj->name));
+	IF_LCD(lcd.print(values.codes[n]));
 	IF_LCD(lcd.setCursor(10,i)); 
-	IF_LCD(lcd.print(valueobj->valuelong));
+	IF_LCD(lcd.print(values.values[n]));
 
       }
       // if time was never setted I suppose I have no time and I do not pubblish time
-      if ( t != 0 ){
-	aJson.addStringToObject(payloadobj, "t", mainbuf);
-	// uncomment if you want to be more restrictive and do not want server to add the timestamp
-	//      }else{
-	//return;
-      }
-      // here I use char
-      //char payload[50];
-      //aJson.print(payloadobj,payload, sizeof(payload));
-      
-      // here I use malloc (aJson.print) 40 will be enought
-      char *payload=aJson.print(payloadobj,PAYLOADLEN);
+      // here I use char, no malloc: PAYLOADLEN is the size of the SD record
+      char payload[PAYLOADLEN];
+      SensorWriter::payload(payload, sizeof(payload), values.values[n], t != 0 ? mainbuf : NULL);
       IF_SDEBUG(DBGSERIAL.print("#"));
       IF_SDEBUG(DBGSERIAL.println(payload));
       // send it to mqtt server appendig path to rootpath
 
       wdt_reset();
 
-#ifdef I2CGPSPRESENT
-
-      int32_t lat;
-      int32_t lon;
-      GPS_latlon_read(&lat,&lon);
-
-      // gcc BUG !!!!!!!!!!!!!!!!!! (4.3, 4.8 and 4.9 versions)
-      // sprintf(mainbuf,configuration.mqttrootpath, lon/100,lat/100);
-
-      // char *format;
-      // format=configuration.mqttrootpath;
-      // sprintf(mainbuf,format, lon/100,lat/100);
-
-      char format[MQTTROOTPATH_LEN];
-      strcpy(format,configuration.mqttrootpath);
-      sprintf(mainbuf,format, lon/100,lat/100);
-
-#else
-      strcpy (mainbuf,configuration.mqttrootpath);
-#endif
-
-      strcat (mainbuf,configuration.sensors[i].mqttpath);
-      strcat (mainbuf,valueobj->name);
+      sensortopic(i);
+      strcat (mainbuf,values.codes[n]);
 
       IF_SDEBUG(DBGSERIAL.print(F("#topic:")));
       IF_SDEBUG(DBGSERIAL.println(mainbuf));
@@ -1943,6 +2201,9 @@ void Repeats() {
 
 #if defined(ETHERNETMQTT) || defined(GSMGPRSMQTT) || defined(GSMGPRSHTTP)
       bool sendstatus;
+#if defined(ETHERNETMQTT) || defined(GSMGPRSMQTT)
+      uint16_t msgid;
+#endif
 
 #ifdef SDCARD
       strcpy(record.topic, mainbuf);
@@ -1955,10 +2216,20 @@ void Repeats() {
 #if defined(ETHERNETMQTT) || defined(GSMGPRSMQTT)
 
       wdt_reset();
-      if (!mqttclient.publish(mainbuf, payload))
+#ifdef MQTTAGGREGATE
+      msgid=msgids[nvalue];
+      // the error is managed only once for all the values of the sensor
+      if (!(sentmask & (1 << nvalue)) && !aggregatefailed)
+#else
+      msgid=mqttclient.publishQos1(mainbuf, payload);
+      if (msgid == 0)
+#endif
 	{
 
 	  sendstatus=false;
+#ifdef MQTTAGGREGATE
+	  aggregatefailed=true;
+#endif
 
 	  IF_SDEBUG(DBGSERIAL.println(F("#error mqtt publish")));
 	  
@@ -1999,13 +2270,14 @@ void Repeats() {
 	{
 	  sendstatus=true;
 	}
+#ifdef MQTTAGGREGATE
+      sendstatus=sentmask & (1 << nvalue);
+#else
       wdt_reset();
 
-      // we cannot put data too fast
-      // we have to develop ack for qos=1
-      delay(100);
-      
+      // the PUBACK of the messages in flight are received here
       mgrmqtt();
+#endif
 
       wdt_reset();
 
@@ -2132,57 +2404,44 @@ void Repeats() {
       if ( t != 0 )
 	{
 
+#if defined(ETHERNETMQTT) || defined(GSMGPRSMQTT)
+	  // the record is marked as sent by mqttack when the broker acknowledges it
+	  record.done=sendstatus && mqttpendingadd(msgid, pos);
+#else
 	  record.done=sendstatus;
+#endif
 	  IF_SDEBUG(DBGSERIAL.print(F("#write:"))); 
 	  IF_SDEBUG(DBGSERIAL.print(record.done)); 
 	  IF_SDEBUG(DBGSERIAL.print(record.separator)); 
 	  IF_SDEBUG(DBGSERIAL.print(record.topic)); 
 	  IF_SDEBUG(DBGSERIAL.println(record.payload)); 
 	  
-	  if (dataFile.write(&record,sizeof(record)) == -1)
+	  // the sector is written when it is full or at the end of the cycle
+	  if (!sdqueueappend())
 	    {
 	      IF_SDEBUG(DBGSERIAL.println(F("#WRITE ERROR")));
 	    }
-	  dataFile.flush();
-	  pos+= sizeof(record);
-	  IF_SDEBUG(DBGSERIAL.println(F("#written record at end")));
+	  IF_SDEBUG(DBGSERIAL.println(F("#queued record at end")));
 	  
 	  if (pos >= MAX_FILESIZE)
 	    {
-	      dataFile.close();
-	      nextName(fileName);
-	      
-	      strcpy(fullfileName,fileName);
-	      strcat (fullfileName,".que");
-	      
-	      IF_SDEBUG(DBGSERIAL.print(F("#open file: ")));
-	      IF_SDEBUG(DBGSERIAL.println(fullfileName));
-	      
-	      // Open up the file we're going to log to!
-	      dataFile = SD.open(fullfileName, FILE_WRITE);
-	      if (! dataFile) {
-		IF_SDEBUG(DBGSERIAL.print(F("#error opening: ")));
-		IF_SDEBUG(DBGSERIAL.println(fullfileName));
-		// Wait forever since we cant write data
-		//while (1) ;
+#if defined(ETHERNETMQTT) || defined(GSMGPRSMQTT)
+	      if (!mqttpendingdrain()){
+		#ifdef REPORTMODE
+		newqueued=true;
+		#endif
 	      }
-	      dataFile.seekSet(0);
-	      pos=0;	  
+#endif
+	      sdqueueclose();
+	      nextName(fileName);
+	      sdqueueopen();
 	    }
 	}
 
 #endif
 
-      // free object in same malloc order !!!
-      free(payload);
-      aJson.deleteItem(payloadobj);
-      
-      valueobj=valueobj->next;
       nvalue++;
-    } while ( valueobj && nvalue < MAX_VALUES_FOR_SENSOR);
-    
-    // free object in same malloc order !!!
-    aJson.deleteItem(valuesobj);
+    }
 
     wdt_reset();
 
@@ -2193,6 +2452,10 @@ void Repeats() {
   // disconnect to mqtt server
   IF_SDEBUG(DBGSERIAL.println("#MQTT disconnect in reportmode"));
   wdt_reset();
+  #ifdef SDCARD
+  // the messages not acknowledged are sent again from the SD card
+  if (!mqttpendingdrain()) newqueued=true;
+  #endif
   rmapdisconnect();
   s800.TCPstop();
   wdt_reset();
@@ -2203,6 +2466,11 @@ void Repeats() {
   #endif
   #endif
 
+  #ifdef SDCARD
+  // write on SD card the records of this cycle
+  sdqueuecommit();
+  #endif
+
 }
 #endif
 
@@ -2631,6 +2899,480 @@ void mgrmqtt()
 
 #if defined(SDCARD)
 
+// the queue of the records on SD card
+//
+// the records are appended to sdsector and written to the data file when
+// the sector is full or by sdqueuecommit(), called at the end of each
+// cycle: the SD card writes a sector once for all the values of a cycle
+// instead of once for each value. A record sent before it is written has
+// done set in sdsector; a record sent later is marked in the bitmap of the
+// .snt file, without rewriting it. The cursor in the header of the .snt
+// file lets the recovery start from the first record not sent.
+
+// a record is written from the first to the last byte: after a power loss
+// the tail of the data file can have a record not complete
+bool sdrecordvalid(uint8_t i)
+{
+  // done is the first byte of the record and it is 0 or 1
+  return *(uint8_t*)&sdsector[i] <= 1 &&
+    sdsector[i].separator == ';' &&
+    memchr(sdsector[i].topic,'\0',TOPICLEN) != NULL &&
+    sdsector[i].payload[0] == '{' &&
+    memchr(sdsector[i].payload,'\0',PAYLOADLEN) != NULL;
+}
+
+// open the bitmap of the data file fileName and read its cursor
+void sdsentopen()
+{
+  strcpy(sentfileName,fileName);
+  strcat (sentfileName,".snt");
+  if (sentFile.isOpen()) sentFile.close();
+  sentbyteindex=-1;
+  sentcursor=0;
+
+  sentFile = SD.open(sentfileName, FILE_WRITE);
+  if (! sentFile) {
+    // the records sent after they are written will be sent again
+    IF_SDEBUG(DBGSERIAL.print(F("#error opening: ")));
+    IF_SDEBUG(DBGSERIAL.println(sentfileName));
+  } else if (sentFile.fileSize() >= SENT_HEADER_SIZE) {
+    sentFile.seekSet(0);
+    if (sentFile.read(&sentcursor,sizeof(sentcursor)) != sizeof(sentcursor)) sentcursor=0;
+  }
+  sentcursorsaved=sentcursor;
+}
+
+// write the cursor in the header of the bitmap
+void sdsentsave()
+{
+  if (!sentFile.isOpen() || sentcursor == sentcursorsaved) return;
+  sentFile.seekSet(0);
+  if (sentFile.write(&sentcursor,sizeof(sentcursor)) == -1)
+    {
+      IF_SDEBUG(DBGSERIAL.println(F("#WRITE ERROR")));
+      return;
+    }
+  sentcursorsaved=sentcursor;
+}
+
+// return true if the record at recordpos of the data file was sent
+// after it was written
+bool sdsent(uint32_t recordpos)
+{
+  uint32_t n=recordpos/sizeof(Record);
+  uint32_t index=SENT_HEADER_SIZE + n/8;
+
+  if (recordpos < sentcursor) return true;
+  if (!sentFile.isOpen()) return false;
+  if ((int32_t)index != sentbyteindex) {
+    sentbyte=0;
+    if (index < sentFile.fileSize()) {
+      sentFile.seekSet(index);
+      if (sentFile.read(&sentbyte,1) != 1) sentbyte=0;
+    }
+    sentbyteindex=index;
+  }
+  return sentbyte & (1 << (n % 8));
+}
+
+// the record at recordpos of the data file was sent
+void sdqueuemark(uint32_t recordpos)
+{
+  if (recordpos >= sdsectorpos && recordpos < sdsectorpos + sdsectorcount*sizeof(Record)) {
+    // done is written with the record
+    sdsector[(recordpos-sdsectorpos)/sizeof(Record)].done=true;
+    sdsectordirty=true;
+    return;
+  }
+
+  if (!sentFile.isOpen()) return;
+  uint32_t n=recordpos/sizeof(Record);
+  uint32_t index=SENT_HEADER_SIZE + n/8;
+  uint32_t size=sentFile.fileSize();
+  uint8_t bits=0;
+
+  if (index < size) {
+    sentFile.seekSet(index);
+    if (sentFile.read(&bits,1) != 1) bits=0;
+  } else {
+    // the records between are not sent
+    sentFile.seekEnd(0);
+    for (; size < index; size++) {
+      if (sentFile.write(&bits,1) == -1) return;
+    }
+  }
+  bits |= 1 << (n % 8);
+  sentFile.seekSet(index);
+  if (sentFile.write(&bits,1) == -1)
+    {
+      IF_SDEBUG(DBGSERIAL.println(F("#WRITE ERROR")));
+    }
+  if ((int32_t)index == sentbyteindex) sentbyte=bits;
+}
+
+// move the cursor over the records sent, up to size
+void sdsentadvance(uint32_t size)
+{
+  uint8_t done;
+
+  while (sentcursor < size) {
+    if (sentcursor >= sdsectorpos && sentcursor < sdsectorpos + sdsectorcount*sizeof(Record)) {
+      done=sdsector[(sentcursor-sdsectorpos)/sizeof(Record)].done;
+    } else if (sdsent(sentcursor)) {
+      done=true;
+    } else {
+      // done is the first byte of the record
+      dataFile.seekSet(sentcursor);
+      if (dataFile.read(&done,1) != 1) break;
+    }
+    if (!done) break;
+    sentcursor+=sizeof(Record);
+    wdt_reset();
+  }
+}
+
+// open the data file fileName to append records and its bitmap;
+// recover the sector at the end of the data file, dropping the records
+// not complete, and forget the bits of the records dropped
+bool sdqueueopen()
+{
+  strcpy(fullfileName,fileName);
+  strcat (fullfileName,".que");
+
+  IF_SDEBUG(DBGSERIAL.print(F("#open file: ")));
+  IF_SDEBUG(DBGSERIAL.println(fullfileName));
+
+  sdsectorpos=0;
+  sdsectorcount=0;
+  sdsectordirty=false;
+  
+  // Open up the file we're going to log to!
+  dataFile = SD.open(fullfileName, FILE_WRITE);
+  if (! dataFile) {
+    IF_SDEBUG(DBGSERIAL.print(F("#error opening: ")));
+    IF_SDEBUG(DBGSERIAL.println(fullfileName));
+    // Wait forever since we cant write data
+    //while (1) ;
+    return false;
+  }
+  sdsentopen();
+
+  wdt_reset();
+  uint32_t size=dataFile.fileSize();
+  // check if position is phased
+  pos=size - (size % sizeof(Record));
+  // the last sector written
+  if (pos > 0) sdsectorpos=(pos-1) - ((pos-1) % SDSECTOR_SIZE);
+  dataFile.seekSet(sdsectorpos);
+  while (sdsectorpos + sdsectorcount*sizeof(Record) < pos) {
+    if (dataFile.read(&sdsector[sdsectorcount],sizeof(Record)) != sizeof(Record) ) break;
+    if (!sdrecordvalid(sdsectorcount)) break;
+    sdsectorcount++;
+  }
+  pos=sdsectorpos + sdsectorcount*sizeof(Record);
+  if (sdsectorcount == SDSECTOR_RECORDS) {
+    sdsectorpos=pos;
+    sdsectorcount=0;
+  }
+
+  if (pos != size){
+    IF_LOGDATEFILE("datafile trunkated\n");
+    IF_SDEBUG(DBGSERIAL.print(F("#ERROR datafile trunkated: ")));
+    IF_SDEBUG(DBGSERIAL.println(size-pos));
+    if (!dataFile.truncate(pos)) {
+      IF_SDEBUG(DBGSERIAL.println(F("#WRITE ERROR")));
+    }
+  }
+
+  if (sentFile.isOpen()) {
+    uint32_t records=pos/sizeof(Record);
+    uint32_t bytes=SENT_HEADER_SIZE + (records+7)/8;
+    if (sentFile.fileSize() > bytes) sentFile.truncate(bytes);
+    if ((records % 8) != 0 && sentFile.fileSize() == bytes) {
+      uint8_t bits;
+      sentFile.seekSet(bytes-1);
+      if (sentFile.read(&bits,1) == 1) {
+	bits &= (1 << (records % 8))-1;
+	sentFile.seekSet(bytes-1);
+	sentFile.write(&bits,1);
+      }
+    }
+    if (sentcursor > pos) sentcursor=pos;
+    sdsentsave();
+    sentFile.flush();
+  }
+
+  wdt_reset();
+  return true;
+}
+
+// write the sector and the bitmap on SD card
+bool sdqueuecommit()
+{
+  bool status=true;
+  if (!dataFile.isOpen()) return false;
+
+  if (sdsectordirty) {
+    dataFile.seekSet(sdsectorpos);
+    if (dataFile.write(sdsector,sdsectorcount*sizeof(Record)) == -1)
+      {
+	IF_SDEBUG(DBGSERIAL.println(F("#WRITE ERROR")));
+	status=false;
+      }
+    dataFile.flush();
+    sdsectordirty=false;
+    IF_SDEBUG(DBGSERIAL.print(F("#written records: ")));
+    IF_SDEBUG(DBGSERIAL.println(sdsectorcount));
+  }
+  // the cursor is moved here only over the records of the sector, the
+  // others are checked by mgrsdcard(); it is saved when the file is closed
+  if (sentcursor >= sdsectorpos) sdsentadvance(pos);
+  if (sdsectorcount == SDSECTOR_RECORDS) {
+    sdsectorpos+=SDSECTOR_SIZE;
+    sdsectorcount=0;
+  }
+  // the bits are set only for the records already written
+  if (sentFile.isOpen()) sentFile.flush();
+  wdt_reset();
+  return status;
+}
+
+// append record to the data file opened by sdqueueopen()
+bool sdqueueappend()
+{
+  sdsector[sdsectorcount++]=record;
+  sdsectordirty=true;
+  pos+= sizeof(record);
+  if (sdsectorcount < SDSECTOR_RECORDS) return true;
+  return sdqueuecommit();
+}
+
+// write the data file and close it with its bitmap
+void sdqueueclose()
+{
+  if (dataFile.isOpen()){
+    sdqueuecommit();
+    dataFile.close();
+  }
+  if (sentFile.isOpen()){
+    sdsentsave();
+    sentFile.close();
+  }
+  sdsectorpos=0;
+  sdsectorcount=0;
+  sdsectordirty=false;
+  sentbyteindex=-1;
+}
+
+// read from QUEUE_INDEX_NAME in fileName the first data file with records
+// to send: the files before it are not checked again
+void sdindexread()
+{
+  char name[sizeof(fileName)];
+
+  strcpy(fileName,FILE_BASE_NAME);
+  strcat (fileName,"000");
+
+  File indexFile = SD.open(QUEUE_INDEX_NAME, O_READ);
+  if (! indexFile) return;
+  if (indexFile.read(name,sizeof(name)) == sizeof(name) &&
+      name[sizeof(name)-1] == '\0' &&
+      strncmp(name,FILE_BASE_NAME,BASE_NAME_SIZE) == 0 &&
+      isdigit(name[BASE_NAME_SIZE]) && isdigit(name[BASE_NAME_SIZE+1]) && isdigit(name[BASE_NAME_SIZE+2])){
+    strcpy(fileName,name);
+  }
+  indexFile.close();
+  IF_SDEBUG(DBGSERIAL.print(F("#first file: ")));
+  IF_SDEBUG(DBGSERIAL.println(fileName));
+}
+
+// write name in QUEUE_INDEX_NAME
+void sdindexwrite(const char* name)
+{
+  File indexFile = SD.open(QUEUE_INDEX_NAME, O_WRITE | O_CREAT | O_TRUNC);
+  if (! indexFile) {
+    IF_SDEBUG(DBGSERIAL.print(F("#error opening: ")));
+    IF_SDEBUG(DBGSERIAL.println(QUEUE_INDEX_NAME));
+    return;
+  }
+  if (indexFile.write(name,sizeof(fileName)) == -1)
+    {
+      IF_SDEBUG(DBGSERIAL.println(F("#WRITE ERROR")));
+    }
+  indexFile.close();
+}
+
+// send the record i of sdsector, read at pos of the data file;
+// return false if the connection is lost
+bool sdrecover(uint8_t i)
+{
+  record=sdsector[i];
+
+#if defined(ETHERNETMQTT) || defined(GSMGPRSMQTT)
+
+  IF_SDEBUG(DBGSERIAL.println(F("#recover mqtt publish"))); 
+  uint16_t msgid=0;
+  wdt_reset();
+  if (mqttwindow()) msgid=mqttclient.publishQos1(record.topic, record.payload);
+  wdt_reset();
+  if (msgid == 0)
+    {
+      IF_SDEBUG(DBGSERIAL.println(F("#error mqtt publish")));
+      return false;
+    }
+  // the record is marked as sent by mqttack when the broker acknowledges it
+  record.done=mqttpendingadd(msgid, pos);
+
+#endif
+#ifdef GSMGPRSHTTP
+  IF_SDEBUG(DBGSERIAL.println(F("#recover http publish"))); 
+  // compose URL
+  strcpy (mainbuf, "/http2mqtt/?topic=");
+  strcat (mainbuf,record.topic);
+  strcat (mainbuf,"&payload=");
+  strcat (mainbuf,record.payload);
+  strcat (mainbuf,"&user=");
+  strcat (mainbuf,configuration.mqttuser);
+  strcat (mainbuf,"&password=");
+  strcat (mainbuf,configuration.mqttpassword);
+
+  IF_SDEBUG(DBGSERIAL.print(F("#GSM send get:")));
+  IF_SDEBUG(DBGSERIAL.println(mainbuf));
+
+  //reattach gsm if needed
+  //if (!gsm.IsRegistered()) gsmgprsstart();
+
+  wdt_reset();
+  //TCP Client GET, send a GET request to the server and save the reply.
+  if (s800.httpGET(configuration.mqttserver, 80,mainbuf, mainbuf, sizeof(mainbuf))){
+    //Print the results.
+    IF_SDEBUG(DBGSERIAL.println(F("#GSM Data received:")));
+    IF_SDEBUG(DBGSERIAL.print("#"));
+    IF_SDEBUG(DBGSERIAL.println(mainbuf));
+
+    if (strstr(mainbuf,"OK") != NULL){
+      record.done=true;
+    }else{
+      record.done=false;
+      IF_SDEBUG(DBGSERIAL.println(F("#GSM ERROR in httpget response")));
+      IF_LOGDATEFILE("GSM ERROR recovery from SD in httpget response\n");
+    }
+
+  }else{
+    IF_SDEBUG(DBGSERIAL.println(F("#error http publish")));
+    return false;
+  }
+
+#endif
+		      
+  wdt_reset();
+  if (record.done==true)
+    {
+      IF_SDEBUG(DBGSERIAL.print(F("#sent:"))); 
+      IF_SDEBUG(DBGSERIAL.print(record.topic)); 
+      IF_SDEBUG(DBGSERIAL.println(record.payload)); 
+
+      sdqueuemark(pos);
+      IF_SDEBUG(DBGSERIAL.println(F("#done"))); 
+    }
+  return true;
+}
+
+#ifdef MQTTAGGREGATE
+// the records recovered from SD card sent together in a message, as
+// mqttaggregate() does: topic is the path of the sensor without the
+// variable, payload the values collected so far and tail the time
+struct SdAggregate {
+  char topic[TOPICLEN];
+  char payload[MQTT_MAX_PACKET_SIZE];
+  char tail[PAYLOADLEN];
+  uint32_t pos[MAX_VALUES_FOR_SENSOR];
+  uint8_t count;
+};
+
+// the IDE would generate these prototypes on top, before SdAggregate
+bool sdaggregateadd(SdAggregate& aggregate, uint8_t i, uint32_t recordpos);
+bool sdaggregatesend(SdAggregate& aggregate);
+
+// add the record i of sdsector, read at recordpos of the data file, to
+// aggregate; return false if the record goes in another message: it is of
+// another sensor or time, there is no room or its value is not a number
+bool sdaggregateadd(SdAggregate& aggregate, uint8_t i, uint32_t recordpos)
+{
+  const char* code=strrchr(sdsector[i].topic,'/');
+  const char* value=sdsector[i].payload+5;
+  const char* tail;
+  size_t len;
+  size_t room;
+
+  // the payload is {"v":VALUE,"t":"TIME"} or {"v":VALUE}
+  if (code == NULL || strncmp(sdsector[i].payload,"{\"v\":",5) != 0) return false;
+  for (tail=value; *tail == '-' || isdigit(*tail); tail++);
+  if (tail == value || (*tail != ',' && *tail != '}')) return false;
+
+  len=code-sdsector[i].topic;
+  code++;
+
+  if (aggregate.count > 0) {
+    if (aggregate.count >= MAX_VALUES_FOR_SENSOR) return false;
+    if (strncmp(aggregate.topic,sdsector[i].topic,len) != 0 || aggregate.topic[len] != '\0') return false;
+    if (strcmp(aggregate.tail,tail) != 0) return false;
+  }
+
+  // fixed header, remaining length and topic length come before the topic
+  if (len + 7 >= sizeof(aggregate.payload)) return false;
+  room = sizeof(aggregate.payload) - 7 - len;
+  if ((aggregate.count > 0 ? strlen(aggregate.payload)+1 : 6) + strlen(code) + 3 + (tail-value)
+      + 1 + strlen(tail) > room) return false;
+
+  if (aggregate.count == 0) {
+    memcpy(aggregate.topic,sdsector[i].topic,len);
+    aggregate.topic[len]='\0';
+    strcpy(aggregate.tail,tail);
+    strcpy(aggregate.payload,"{\"v\":{");
+  } else {
+    strcat(aggregate.payload,",");
+  }
+  strcat(aggregate.payload,"\"");
+  strcat(aggregate.payload,code);
+  strcat(aggregate.payload,"\":");
+  strncat(aggregate.payload,value,tail-value);
+  aggregate.pos[aggregate.count++]=recordpos;
+  return true;
+}
+
+// publish the records collected in aggregate;
+// return false if the connection is lost
+bool sdaggregatesend(SdAggregate& aggregate)
+{
+  uint16_t msgid=0;
+
+  if (aggregate.count == 0) return true;
+  strcat(aggregate.payload,"}");
+  strcat(aggregate.payload,aggregate.tail);
+
+  IF_SDEBUG(DBGSERIAL.println(F("#recover mqtt publish"))); 
+  IF_SDEBUG(DBGSERIAL.print(F("#topic:")));
+  IF_SDEBUG(DBGSERIAL.println(aggregate.topic));
+  IF_SDEBUG(DBGSERIAL.print(F("#payload:")));
+  IF_SDEBUG(DBGSERIAL.println(aggregate.payload));
+  wdt_reset();
+  if (mqttwindow()) msgid=mqttclient.publishQos1(aggregate.topic, aggregate.payload);
+  wdt_reset();
+
+  if (msgid == 0) {
+    IF_SDEBUG(DBGSERIAL.println(F("#error mqtt publish")));
+  } else {
+    for (uint8_t n = 0; n < aggregate.count; n++) {
+      // the records are marked as sent by mqttack when the broker acknowledges them
+      if (mqttpendingadd(msgid, aggregate.pos[n])) sdqueuemark(aggregate.pos[n]);
+    }
+  }
+  aggregate.count=0;
+  return msgid != 0;
+}
+#endif
+
 			   // recovery data from SD card
                            // exit before maxtime elapsed time
 			   // set write pointer to the end of last file
@@ -2639,6 +3381,16 @@ void mgrsdcard(time_t maxtime)
   wdt_reset();
 
   unsigned long int starttime=max(millis() - 10000,1);  // 10 sec tollerance
+  // false when the time is terminated or the connection is lost
+  bool sending=true;
+  // the files checked so far are all sent
+  bool indexed=true;
+  bool indexchanged=false;
+  char indexname[sizeof(fileName)];
+#ifdef MQTTAGGREGATE
+  SdAggregate aggregate;
+  aggregate.count=0;
+#endif
 
   #if defined(REPORTMODE)
 
@@ -2664,8 +3416,18 @@ void mgrsdcard(time_t maxtime)
   #endif
   #endif
 
-  strcpy(fileName,FILE_BASE_NAME);
-  strcat (fileName,"000");
+#if defined(ETHERNETMQTT) || defined(GSMGPRSMQTT)
+  // the data file is going to be closed
+  if (!mqttpendingdrain()){
+    #ifdef REPORTMODE
+    newqueued=true;
+    #endif
+  }
+#endif
+  sdqueueclose();
+
+  sdindexread();
+  strcpy(indexname,fileName);
 
   // find exixting file name
   while (exists(fileName))
@@ -2692,7 +3454,8 @@ void mgrsdcard(time_t maxtime)
 	  IF_SDEBUG(DBGSERIAL.print(F("#found que file; open: ")));
 	  IF_SDEBUG(DBGSERIAL.println(fullfileName));
 	  
-	  dataFile = SD.open(fullfileName, FILE_WRITE);
+	  // the records are not rewritten: the sent ones are marked in the bitmap
+	  dataFile = SD.open(fullfileName, O_READ);
 	  if (! dataFile) {
 	    IF_SDEBUG(DBGSERIAL.print(F("error opening: ")));
 	    IF_SDEBUG(DBGSERIAL.println(fullfileName));
@@ -2700,139 +3463,82 @@ void mgrsdcard(time_t maxtime)
 	    //while (1) ;
 	    continue;       // skip the file
 	  }
+	  sdsentopen();
 	  
-	  dataFile.seekSet(0);
-	  uint32_t size=dataFile.fileSize();
-	  bool success = true;
+	  uint32_t filesize=dataFile.fileSize();
+	  uint32_t size=filesize - (filesize % sizeof(Record));
 
-	  pos=0;
-	  while (pos < size)
+	  // the records before the cursor are sent: a file all sent is
+	  // skipped without reading it
+	  pos=sentcursor;
+	  IF_SDEBUG(DBGSERIAL.print(F("#first record not sent: ")));
+	  IF_SDEBUG(DBGSERIAL.println(pos));
+
+	  while (pos < size && sending)
 	    {
 		
 	      wdt_reset();
-#if defined(ETHERNETMQTT) || defined(GSMGPRSMQTT)
-	      // poll mqtt connection if required
-	      mqttclient.loop();
-	      wdt_reset();
-#endif
 		
 	      if ((millis()-starttime) > (maxtime*1000)){ 
-		if (starttime != 0){
-		  IF_SDEBUG(DBGSERIAL.println(F("#the time for recovery data from SD is terminated")));
-		  starttime=0;
-		}
+		IF_SDEBUG(DBGSERIAL.println(F("#the time for recovery data from SD is terminated")));
 		// skip reading file
-		success = false;
-		pos+= sizeof(record);
-		continue; 
+		sending=false;
+		break;
 	      }
 
-	      if (dataFile.read(&record,sizeof(record)) != sizeof(record) )
+	      // read a sector at a time, in sdsector that is empty
+	      // as the data file to append is closed
+	      uint32_t sectorpos=pos - (pos % SDSECTOR_SIZE);
+	      uint8_t count=min((uint32_t)SDSECTOR_RECORDS,(size-sectorpos)/sizeof(Record));
+	      dataFile.seekSet(sectorpos);
+	      if (dataFile.read(sdsector,count*sizeof(Record)) != (int)(count*sizeof(Record)) )
 		{
 		  IF_SDEBUG(DBGSERIAL.println(F("#READ ERROR")));
 		  break;
 		}
-	      else
+
+	      // the records not sent are published one after the other,
+	      // waiting only for a place in the window of the PUBACK
+	      for (uint8_t i=(pos-sectorpos)/sizeof(Record); i < count; i++, pos+= sizeof(Record))
 		{
 		  //IF_SDEBUG(DBGSERIAL.print(F("#read:"))); 
-		  //IF_SDEBUG(DBGSERIAL.print(record.done)); 
-		  //IF_SDEBUG(DBGSERIAL.print(record.separator)); 
-		  //IF_SDEBUG(DBGSERIAL.print(record.topic));
-		  //IF_SDEBUG(DBGSERIAL.println(record.payload)); 
-
-		  if (record.done == false)
-		    {
+		  //IF_SDEBUG(DBGSERIAL.print(sdsector[i].done)); 
+		  //IF_SDEBUG(DBGSERIAL.print(sdsector[i].separator)); 
+		  //IF_SDEBUG(DBGSERIAL.print(sdsector[i].topic));
+		  //IF_SDEBUG(DBGSERIAL.println(sdsector[i].payload)); 
+
+		  if (sdsector[i].done || sdsent(pos)) continue;
+
+#ifdef MQTTAGGREGATE
+		  if (sdaggregateadd(aggregate, i, pos)) continue;
+		  // send the values collected before and start a new message
+		  if (!sdaggregatesend(aggregate)) {
+		    sending=false;
+		    break;
+		  }
+		  if (sdaggregateadd(aggregate, i, pos)) continue;
+#endif
+		  if (!sdrecover(i)) {
+		    sending=false;
+		    break;
+		  }
+		}
+	    }
 
+#ifdef MQTTAGGREGATE
+	  // the messages do not span files
+	  if (!sdaggregatesend(aggregate)) sending=false;
+#endif
 #if defined(ETHERNETMQTT) || defined(GSMGPRSMQTT)
-
-		      wdt_reset();
-		      mgrmqtt();
-		      wdt_reset();
-		      IF_SDEBUG(DBGSERIAL.println(F("#recover mqtt publish"))); 
-		      if (!mqttclient.publish(record.topic, record.payload))
-			{
-			  IF_SDEBUG(DBGSERIAL.println(F("#error mqtt publish")));
-			}
-		      else
-			{
-			  record.done=true;
-			}
-
-		      // we cannot put data too fast
-		      // we have to develop ack for qos=1
-		      delay(1000);
-
-		      mgrmqtt();
-
+	  // wait for the last PUBACK, before closing the file
+	  mqttpendingdrain();
 #endif
-#ifdef GSMGPRSHTTP
-		      IF_SDEBUG(DBGSERIAL.println(F("#recover http publish"))); 
-		      // compose URL
-		      strcpy (mainbuf, "/http2mqtt/?topic=");
-		      strcat (mainbuf,record.topic);
-		      strcat (mainbuf,"&payload=");
-		      strcat (mainbuf,record.payload);
-		      strcat (mainbuf,"&user=");
-		      strcat (mainbuf,configuration.mqttuser);
-		      strcat (mainbuf,"&password=");
-		      strcat (mainbuf,configuration.mqttpassword);
-
-		      IF_SDEBUG(DBGSERIAL.print(F("#GSM send get:")));
-		      IF_SDEBUG(DBGSERIAL.println(mainbuf));
-
-		      //reattach gsm if needed
-		      //if (!gsm.IsRegistered()) gsmgprsstart();
-
-		      wdt_reset();
-		      //TCP Client GET, send a GET request to the server and save the reply.
-		      if (s800.httpGET(configuration.mqttserver, 80,mainbuf, mainbuf, sizeof(mainbuf))){
-			//Print the results.
-			IF_SDEBUG(DBGSERIAL.println(F("#GSM Data received:")));
-			IF_SDEBUG(DBGSERIAL.print("#"));
-			IF_SDEBUG(DBGSERIAL.println(mainbuf));
-
-			if (strstr(mainbuf,"OK") != NULL){
-			  record.done=true;
-			}else{
-			  record.done=false;
-			  IF_SDEBUG(DBGSERIAL.println(F("#GSM ERROR in httpget response")));
-			  IF_LOGDATEFILE("GSM ERROR recovery from SD in httpget response\n");
-			}
-
-		      }else{
-			IF_SDEBUG(DBGSERIAL.println(F("#error http publish")));
-		      }
 
-#endif
-		      
-		      wdt_reset();
-		      if (record.done==true)
-			{
-			  dataFile.seekSet(pos);
-
-			  IF_SDEBUG(DBGSERIAL.print(F("#write:"))); 
-			  IF_SDEBUG(DBGSERIAL.print(record.done)); 
-			  IF_SDEBUG(DBGSERIAL.print(record.separator)); 
-			  IF_SDEBUG(DBGSERIAL.print(record.topic)); 
-			  IF_SDEBUG(DBGSERIAL.println(record.payload)); 
-
-			  if (dataFile.write(&record,sizeof(record)) == -1)
-			    {
-			      IF_SDEBUG(DBGSERIAL.println(F("#WRITE ERROR")));
-			      success=false;
-			    }
-			  IF_SDEBUG(DBGSERIAL.println(F("#done"))); 
-			  wdt_reset();
-			}
-		      else
-			{
-			  success=false;
-			}
-		    }
-		}
-	      pos+= sizeof(record);
-	    }
-	  
+	  // the file is dequeued if all the records up to the end are sent
+	  sdsentadvance(pos);
+	  bool success = (sentcursor >= size);
+	  sdsentsave();
+	  sentFile.close();
 	  dataFile.close();
 
 	  wdt_reset();
@@ -2841,16 +3547,10 @@ void mgrsdcard(time_t maxtime)
 	  newqueued=newqueued || (!success);
 	  #endif
 
-	  // check file size
-	  dataFile = SD.open(fullfileName, O_READ);
-	  size = dataFile.fileSize();
-	  dataFile.close();
-	  wdt_reset();
-	  
 	  IF_SDEBUG(DBGSERIAL.print(F("#filesize: ")));
-	  IF_SDEBUG(DBGSERIAL.println(size));
+	  IF_SDEBUG(DBGSERIAL.println(filesize));
 	  
-	  if (size >= MAX_FILESIZE)
+	  if (filesize >= MAX_FILESIZE)
 	    {
 	      // if dequeued move to archive
 	      if (success)
@@ -2863,7 +3563,13 @@ void mgrsdcard(time_t maxtime)
 		  IF_SDEBUG(DBGSERIAL.println(newfileName));
 		  dataFile.rename(SD.vwd(),newfileName);
 		  dataFile.close();
-		  }
+		  // all the records are sent
+		  SD.remove(sentfileName);
+		}
+	      else
+		{
+		  indexed=false;
+		}
 	    }
 	  else
 	    {
@@ -2875,8 +3581,14 @@ void mgrsdcard(time_t maxtime)
 	}
       // check new file
       nextName(fileName);
+      if (indexed){
+	strcpy(indexname,fileName);
+	indexchanged=true;
+      }
     }
   // Found an unused file name.
+
+  if (indexchanged) sdindexwrite(indexname);
   
   wdt_reset();
 #if defined(ETHERNETMQTT) || defined(GSMGPRSMQTT)
@@ -2900,31 +3612,7 @@ void mgrsdcard(time_t maxtime)
 #endif
 
   wdt_reset();
-  IF_SDEBUG(DBGSERIAL.print(F("#open file: ")));
-  IF_SDEBUG(DBGSERIAL.println(fullfileName));
-  
-  dataFile = SD.open(fullfileName, FILE_WRITE);
-  if (! dataFile) {
-    IF_SDEBUG(DBGSERIAL.print(F("#error opening: ")));
-    IF_SDEBUG(DBGSERIAL.println(fullfileName));
-    // Wait forever since we cant write data
-    //while (1) ;
-  }
-
-  wdt_reset();
-  dataFile.seekEnd(0);
-  pos = dataFile.curPosition();
-  // check if position is phased
-  int phase=pos % sizeof(record);
-  if (phase != 0 ){
-
-    IF_LOGDATEFILE("datafile trunkated\n");
-    IF_SDEBUG(DBGSERIAL.print(F("#ERROR datafile trunkated: ")));
-    IF_SDEBUG(DBGSERIAL.print(phase));
-
-    pos-=phase;
-    dataFile.seekSet(pos);
-  }
+  sdqueueopen();
 }
 
 int sdrecoveryrpc(aJsonObject* params)
@@ -3542,6 +4230,11 @@ void setup()
 
   wdt_reset();
 
+#if (defined(ETHERNETMQTT) || defined(GSMGPRSMQTT)) && defined(SDCARD)
+  // the records on SD card are done only when the broker acknowledges them
+  mqttclient.setAckCallback(mqttack);
+#endif
+
 #ifndef REPORTMODE
   // connect to mqtt server
   #if defined(GSMGPRSMQTT)
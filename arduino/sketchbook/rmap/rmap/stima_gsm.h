@@ -36,6 +36,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define LCD
 // activate if you have relays connected to some pins
 #define ATTUATORE
+// activate to send all the values of a sensor in a single MQTT message
+// (mqtt2bufr on the server side is required to understand it)
+//#define MQTTAGGREGATE
 ///////////////////////////////////////////////////////////////////////
 
 #include "common.h"
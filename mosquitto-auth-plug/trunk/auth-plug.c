@@ -53,6 +53,9 @@
 
 #include "userdata.h"
 #include "cache.h"
+#include "pbkdf2-check.h"
+#include "pool.h"
+#include "stats.h"
 
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
@@ -71,16 +74,48 @@
 # define PSKSETUP
 #endif
 
-struct backend_p {
-	void *conf;			/* Handle to backend */
-	char *name;
-	f_kill *kill;
-	f_getuser *getuser;
-	f_superuser *superuser;
-	f_aclcheck *aclcheck;
-};
+/*
+ * Look at the superusers glob once: most are a name, or a prefix or a
+ * suffix with a single "*", which are compared without fnmatch(). As
+ * fnmatch() is called without flags, "*" matches "/" and "." too.
+ */
+static void glob_compile(struct userdata *ud)
+{
+	char *g = ud->superusers;
+	size_t len = strlen(g);
+
+	ud->superglob = GLOB_FNMATCH;
+	ud->superlen = len;
+	if (strpbrk(g, "*?[\\") == NULL) {
+		ud->superglob = GLOB_LITERAL;
+	} else if (len > 0 && g[len - 1] == '*' && strpbrk(g, "?[\\") == NULL &&
+	    strchr(g, '*') == g + len - 1) {
+		ud->superglob = GLOB_PREFIX;
+		ud->superlen = len - 1;
+	} else if (len > 0 && g[0] == '*' && strpbrk(g, "?[\\") == NULL &&
+	    strchr(g + 1, '*') == NULL) {
+		ud->superglob = GLOB_SUFFIX;
+		ud->superlen = len - 1;
+	}
+}
 
-int pbkdf2_check(char *password, char *hash);
+static int glob_match(struct userdata *ud, const char *username)
+{
+	size_t len;
+
+	switch (ud->superglob) {
+		case GLOB_LITERAL:
+			return (strcmp(ud->superusers, username) == 0);
+		case GLOB_PREFIX:
+			return (strncmp(ud->superusers, username, ud->superlen) == 0);
+		case GLOB_SUFFIX:
+			len = strlen(username);
+			return (len >= ud->superlen &&
+				memcmp(ud->superusers + 1, username + len - ud->superlen, ud->superlen) == 0);
+		default:
+			return (fnmatch(ud->superusers, username, 0) == 0);
+	}
+}
 
 int mosquitto_auth_plugin_version(void)
 {
@@ -98,6 +133,14 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 	int ret = MOSQ_ERR_SUCCESS;
 	int nord;
 	struct backend_p **bep;
+	unsigned int cacheentries = ACLCACHE_ENTRIES;
+	unsigned int authcacheentries = AUTHCACHE_ENTRIES;
+	time_t authcacheseconds = 0;
+	time_t supercacheseconds = -1, negcacheseconds = -1;
+	unsigned int supercacheentries = SUPERCACHE_ENTRIES;
+	char *stats_file = NULL, *stats_prefix = "$SYS/broker/auth";
+	time_t stats_seconds = 60;
+	int poolworkers = 0, pooltimeout_ms = 2000, poolfailopen = FALSE;
 #ifdef BE_PSK
 	struct backend_p **pskbep;
 	char *psk_database = NULL;
@@ -119,6 +162,10 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 	ud->anonusername = strdup("anonymous");
 	ud->cacheseconds = 300;
 	ud->aclcache = NULL;
+	ud->authcache = NULL;
+	ud->supercache = NULL;
+	ud->pool = NULL;
+	ud->stats = NULL;
 
 	/*
 	 * Shove all options Mosquitto gives the plugin into a hash,
@@ -139,12 +186,71 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 		}
 		if (!strcmp(o->key, "cacheseconds"))
 			ud->cacheseconds = atol(o->value);
+		if (!strcmp(o->key, "cacheentries"))
+			cacheentries = atol(o->value);
+		if (!strcmp(o->key, "authcacheseconds"))
+			authcacheseconds = atol(o->value);
+		if (!strcmp(o->key, "authcacheentries"))
+			authcacheentries = atol(o->value);
+		if (!strcmp(o->key, "supercacheseconds"))
+			supercacheseconds = atol(o->value);
+		if (!strcmp(o->key, "negcacheseconds"))
+			negcacheseconds = atol(o->value);
+		if (!strcmp(o->key, "supercacheentries"))
+			supercacheentries = atol(o->value);
+		if (!strcmp(o->key, "stats_file"))
+			stats_file = o->value;
+		if (!strcmp(o->key, "stats_prefix"))
+			stats_prefix = o->value;
+		if (!strcmp(o->key, "stats_seconds"))
+			stats_seconds = atol(o->value);
+		if (!strcmp(o->key, "poolworkers"))
+			poolworkers = atoi(o->value);
+		if (!strcmp(o->key, "pooltimeout_ms"))
+			pooltimeout_ms = atoi(o->value);
+		if (!strcmp(o->key, "poolfailopen"))
+			poolfailopen = !strcmp(o->value, "true");
 #if 0
 		if (!strcmp(o->key, "topic_prefix"))
 			ud->topicprefix = strdup(o->value);
 #endif
 	}
 
+	/*
+	 * Denied checks, those of users unknown to the back-ends included,
+	 * are kept by default a tenth of the granted ones: long enough to
+	 * spare the back-ends a client retrying, short enough that a new
+	 * user or ACL is seen soon. So are the users who aren't superusers.
+	 */
+	if (negcacheseconds < 0)
+		negcacheseconds = ud->cacheseconds / 10;
+
+	if (ud->cacheseconds > 0 || negcacheseconds > 0) {
+		ud->aclcache = acl_cache_new(cacheentries, ud->cacheseconds, negcacheseconds);
+		if (ud->aclcache == NULL) {
+			_log(LOG_NOTICE, "ACL cache of %u entries not allocated: caching disabled", cacheentries);
+		}
+	}
+	if (authcacheseconds > 0) {
+		ud->authcache = auth_cache_new(authcacheentries, authcacheseconds);
+		if (ud->authcache == NULL) {
+			_log(LOG_NOTICE, "Credential cache of %u entries not allocated: caching disabled", authcacheentries);
+		}
+	}
+
+	if (ud->superusers)
+		glob_compile(ud);
+
+	/* Superuser verdicts are kept, by default, as long as the ACLs */
+	if (supercacheseconds < 0)
+		supercacheseconds = ud->cacheseconds;
+	if (supercacheseconds > 0 || negcacheseconds > 0) {
+		ud->supercache = super_cache_new(supercacheentries, supercacheseconds, negcacheseconds);
+		if (ud->supercache == NULL) {
+			_log(LOG_NOTICE, "Superuser cache not allocated: caching disabled");
+		}
+	}
+
 	/*
 	 * Set up back-ends, and tell them to initialize themselves.
 	 */
@@ -197,10 +303,14 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			if ((*bep)->conf == NULL) {
 				_fatal("%s init returns NULL", q);
 			}
+			(*bep)->init =  be_mysql_init;
 			(*bep)->kill =  be_mysql_destroy;
 			(*bep)->getuser =  be_mysql_getuser;
 			(*bep)->superuser =  be_mysql_superuser;
 			(*bep)->aclcheck =  be_mysql_aclcheck;
+			(*bep)->aclfetch =  be_mysql_aclfetch;
+			(*bep)->thread_start =  be_mysql_thread_start;
+			(*bep)->thread_stop =  be_mysql_thread_stop;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -216,10 +326,12 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			if ((*bep)->conf == NULL) {
 				_fatal("%s init returns NULL", q);
 			}
+			(*bep)->init = be_pg_init;
 			(*bep)->kill = be_pg_destroy;
 			(*bep)->getuser = be_pg_getuser;
 			(*bep)->superuser = be_pg_superuser;
 			(*bep)->aclcheck = be_pg_aclcheck;
+			(*bep)->aclfetch = be_pg_aclfetch;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -235,6 +347,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			if ((*bep)->conf == NULL) {
 				_fatal("%s init returns NULL", q);
 			}
+			(*bep)->init =  be_ldap_init;
 			(*bep)->kill =  be_ldap_destroy;
 			(*bep)->getuser =  be_ldap_getuser;
 			(*bep)->superuser =  be_ldap_superuser;
@@ -254,10 +367,13 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			if ((*bep)->conf == NULL) {
 				_fatal("%s init returns NULL", q);
 			}
+			(*bep)->init =  be_cdb_init;
 			(*bep)->kill =  be_cdb_destroy;
 			(*bep)->getuser =  be_cdb_getuser;
 			(*bep)->superuser =  be_cdb_superuser;
 			(*bep)->aclcheck =  be_cdb_aclcheck;
+			(*bep)->aclfetch =  be_cdb_aclfetch;
+			(*bep)->reload =  be_cdb_reload;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -273,6 +389,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			if ((*bep)->conf == NULL) {
 				_fatal("%s init returns NULL", q);
 			}
+			(*bep)->init =  be_sqlite_init;
 			(*bep)->kill =  be_sqlite_destroy;
 			(*bep)->getuser =  be_sqlite_getuser;
 			(*bep)->superuser =  be_sqlite_superuser;
@@ -292,10 +409,12 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			if ((*bep)->conf == NULL) {
 				_fatal("%s init returns NULL", q);
 			}
+			(*bep)->init =  be_redis_init;
 			(*bep)->kill =  be_redis_destroy;
 			(*bep)->getuser =  be_redis_getuser;
 			(*bep)->superuser =  be_redis_superuser;
 			(*bep)->aclcheck =  be_redis_aclcheck;
+			(*bep)->aclfetch =  be_redis_aclfetch;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -311,10 +430,13 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			if ((*bep)->conf == NULL) {
 				_fatal("%s init returns NULL", q);
 			}
+			(*bep)->init =  be_http_init;
 			(*bep)->kill =  be_http_destroy;
 			(*bep)->getuser =  be_http_getuser;
 			(*bep)->superuser =  be_http_superuser;
 			(*bep)->aclcheck =  be_http_aclcheck;
+			(*bep)->aclfetch =  be_http_aclfetch;
+			(*bep)->netstats =  be_http_netstats;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -330,6 +452,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			if ((*bep)->conf == NULL) {
 				_fatal("%s init returns NULL", q);
 			}
+			(*bep)->init =  be_mongo_init;
 			(*bep)->kill =  be_mongo_destroy;
 			(*bep)->getuser =  be_mongo_getuser;
 			(*bep)->superuser =  be_mongo_superuser;
@@ -348,24 +471,66 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 
         free(p);
 
+	/*
+	 * Optionally, call the back-ends from a pool of workers, so that a
+	 * slow one can't block the broker for more than pooltimeout_ms.
+	 */
+	if (poolworkers > 0) {
+		ud->pool = authpool_new(ud->be_list, poolworkers, pooltimeout_ms, poolfailopen);
+		if (ud->pool == NULL) {
+			_fatal("Cannot start %d auth workers", poolworkers);
+		}
+	}
+
+	ud->stats = stats_new(ud->be_list, stats_file, stats_prefix, stats_seconds);
+	if (ud->stats == NULL) {
+		_log(LOG_NOTICE, "Stats not allocated: disabled");
+	}
+
 	return (ret);
 }
 
 int mosquitto_auth_plugin_cleanup(void *userdata, struct mosquitto_auth_opt *auth_opts, int auth_opt_count)
 {
 	struct userdata *ud = (struct userdata *)userdata;
+	struct backend_p **bep;
+
+	for (bep = ud->be_list; bep && *bep; bep++) {
+		useracl_free_all(&(*bep)->useracls);
+	}
+	if (ud->stats != NULL) {
+		stats_write(ud->stats, ud);
+		stats_free(ud->stats);
+	}
+
+	/*
+	 * Close the handles of the back-ends; with the workers, ->kill()
+	 * stops them and closes theirs too.
+	 */
+	for (bep = ud->be_list; bep && *bep; bep++) {
+		if ((*bep)->kill)
+			(*bep)->kill((*bep)->conf);
+	}
+	if (ud->pool != NULL) {
+		authpool_stats(ud->pool);
+		authpool_free(ud->pool);
+	}
 
 	if (ud->superusers)
 		free(ud->superusers);
 	if (ud->anonusername)
 		free(ud->anonusername);
 	if (ud->aclcache != NULL) {
-		struct aclcache *a, *tmp;
-
-		HASH_ITER(hh, ud->aclcache, a, tmp) {
-			HASH_DEL(ud->aclcache, a);
-			free(a);
-		}
+		acl_cache_stats(ud->aclcache);
+		acl_cache_free(ud->aclcache);
+	}
+	if (ud->authcache != NULL) {
+		auth_cache_stats(ud->authcache);
+		auth_cache_free(ud->authcache);
+	}
+	if (ud->supercache != NULL) {
+		super_cache_stats(ud->supercache);
+		super_cache_free(ud->supercache);
 	}
 
 	free(ud);
@@ -375,6 +540,25 @@ int mosquitto_auth_plugin_cleanup(void *userdata, struct mosquitto_auth_opt *aut
 
 int mosquitto_auth_security_init(void *userdata, struct mosquitto_auth_opt *auth_opts, int auth_opt_count, bool reload)
 {
+	struct userdata *ud = (struct userdata *)userdata;
+	struct backend_p **bep;
+
+	if (!reload)
+		return MOSQ_ERR_SUCCESS;
+
+	/*
+	 * On SIGHUP the back-ends reopen their data, and what was cached
+	 * from the old data is dropped.
+	 */
+	for (bep = ud->be_list; bep && *bep; bep++) {
+		if ((*bep)->reload)
+			(*bep)->reload((*bep)->conf);
+		useracl_free_all(&(*bep)->useracls);
+	}
+	acl_cache_clear(ud->aclcache);
+	auth_cache_clear(ud->authcache);
+	super_cache_clear(ud->supercache);
+
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -390,6 +574,8 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 	struct backend_p **bep;
 	char *phash = NULL, *backend_name = NULL;
 	int match, authenticated = FALSE, nord;
+	unsigned long failures, hits;
+	double start = stats_now(), t;
 
 	if (!username || !*username || !password || !*password)
 		return MOSQ_ERR_AUTH;
@@ -403,19 +589,37 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 
 		_log(LOG_DEBUG, "** checking backend %s", b->name);
 
+		/* Back-ends which authenticate by themselves aren't asked again */
+		if (auth_cache_q(ud->authcache, username, password, nord)) {
+			authenticated = TRUE;
+			ud->authentication_be = nord;
+			break;
+		}
+
 		/*
 		 * The ->getuser() routine can decide to authenticate by setting
 		 * either `authenticated = TRUE' or by returning a pointer to
 		 * the user's PBKDF2 password hash
 		 */
 
+		failures = authpool_failures(ud->pool);
+		t = stats_now();
 		phash = b->getuser(b->conf, username, password, &authenticated);
+		stats_call(ud->stats, nord, STATS_GETUSER, t, authpool_failures(ud->pool) != failures);
 		if (authenticated == TRUE) {
+			auth_cache_add(ud->authcache, username, password, nord);
 			ud->authentication_be = nord;
 			break;
 		}
 		if (phash != NULL) {
-			match = pbkdf2_check((char *)password, phash);
+			/* Without a cache hit the key has been derived */
+			hits = (ud->authcache) ? ud->authcache->hits : 0;
+			t = stats_now();
+			match = auth_cache_check(ud->authcache, username, password, nord, phash);
+			if (ud->stats && (ud->authcache == NULL || ud->authcache->hits == hits))
+				stats_add(&ud->stats->pbkdf2, stats_now() - t);
+			free(phash);
+			phash = NULL;
 			if (match == 1) {
 				authenticated = TRUE;
 				/* Mark backend index in userdata so we can check
@@ -437,6 +641,15 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 		free(phash);
 	}
 
+	if (ud->stats) {
+		if (authenticated)
+			ud->stats->auth_ok++;
+		else
+			ud->stats->auth_fail++;
+		stats_add(&ud->stats->auth, stats_now() - start);
+		stats_tick(ud->stats, ud);
+	}
+
 	return (authenticated) ? MOSQ_ERR_SUCCESS : MOSQ_ERR_AUTH;
 }
 
@@ -444,9 +657,12 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 {
 	struct userdata *ud = (struct userdata *)userdata;
 	struct backend_p **bep;
+	struct useracl *u;
 	char *backend_name = NULL;
-	int match = 0, authorized = FALSE, nord;
+	int match = 0, authorized = FALSE, nord, cached;
 	int granted = MOSQ_ERR_ACL_DENIED;
+	unsigned long failures = authpool_failures(ud->pool), f;
+	double start = stats_now(), t;
 
 	if (!username || !*username) { 	// anonymous users
 		username = ud->anonusername;
@@ -463,7 +679,7 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 	if (granted != MOSQ_ERR_UNKNOWN) {
 		_log(DEBUG, "aclcheck(%s, %s, %d) CACHEDAUTH: %d",
 			username, topic, access, granted);
-		return (granted);
+		goto done;
 	}
 
 	if (!username || !*username || !topic || !*topic) {
@@ -475,7 +691,7 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 	/* Check for usernames exempt from ACL checking, first */
 
 	if (ud->superusers) {
-		if (fnmatch(ud->superusers, username, 0) == 0) {
+		if (glob_match(ud, username)) {
 			_log(DEBUG, "aclcheck(%s, %s, %d) GLOBAL SUPERUSER=Y",
 				username, topic, access);
 			granted = MOSQ_ERR_SUCCESS;
@@ -483,17 +699,46 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 		}
 	}
 
-	for (bep = ud->be_list; bep && *bep; bep++) {
+	/*
+	 * The superuser verdict doesn't depend on the topic: it is cached
+	 * per user, so that a bridge publishing on many topics doesn't ask
+	 * the back-ends for each of them.
+	 */
+	cached = super_cache_q(ud->supercache, username);
+	if (cached == TRUE) {
+		_log(DEBUG, "aclcheck(%s, %s, %d) CACHED SUPERUSER=Y",
+			username, topic, access);
+		granted = MOSQ_ERR_SUCCESS;
+		goto outout;
+	}
+
+	for (bep = ud->be_list; cached == -1 && bep && *bep; bep++) {
 		struct backend_p *b = *bep;
 
-		match = b->superuser(b->conf, username);
+		/*
+		 * Back-ends which can give all the ACLs of a user in one
+		 * request are asked once per cacheseconds.
+		 */
+		f = authpool_failures(ud->pool);
+		t = stats_now();
+		if (b->aclfetch && ud->cacheseconds > 0 &&
+		    (u = useracl_get(&b->useracls, username, ud->cacheseconds, b->aclfetch, b->conf)) != NULL) {
+			match = u->superuser;
+		} else {
+			match = b->superuser(b->conf, username);
+		}
+		stats_call(ud->stats, bep - ud->be_list, STATS_SUPERUSER, t, authpool_failures(ud->pool) != f);
 		if (match == 1) {
 			_log(DEBUG, "aclcheck(%s, %s, %d) SUPERUSER=Y by %s",
 				username, topic, access, b->name);
+			if (authpool_failures(ud->pool) == failures)
+				super_cache_add(ud->supercache, username, TRUE);
 			granted = MOSQ_ERR_SUCCESS;
 			goto outout;
 		}
 	}
+	if (cached == -1 && authpool_failures(ud->pool) == failures)
+		super_cache_add(ud->supercache, username, FALSE);
 
 	/*
 	 * Check authorization in the back-end used to authenticate the user.
@@ -512,7 +757,7 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 	}
 
 	/* FIXME: |-- user bridge was authenticated in back-end 16 (<nil>)  */
-	_log(LOG_NOTICE, "user %s was authenticated in back-end %d (%s)",
+	_log(DEBUG, "user %s was authenticated in back-end %d (%s)",
 		username, nord, (backend_name) ? backend_name : "<nil>");
 
 
@@ -523,7 +768,15 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 	}
 
 
-	match = (*bep)->aclcheck((*bep)->conf, clientid, username, topic, access);
+	f = authpool_failures(ud->pool);
+	t = stats_now();
+	if ((*bep)->aclfetch && ud->cacheseconds > 0 &&
+	    (u = useracl_get(&(*bep)->useracls, username, ud->cacheseconds, (*bep)->aclfetch, (*bep)->conf)) != NULL) {
+		match = useracl_check(u, clientid, username, topic, access);
+	} else {
+		match = (*bep)->aclcheck((*bep)->conf, clientid, username, topic, access);
+	}
+	stats_call(ud->stats, nord, STATS_ACLCHECK, t, authpool_failures(ud->pool) != f);
 	if (match == 1) {
 		authorized = TRUE;
 	}
@@ -535,7 +788,19 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 
    outout:	/* goto fail goto fail */
 
-	acl_cache(clientid, username, topic, access, granted, userdata);
+	/* Don't cache what was decided without an answer from the back-ends */
+	if (authpool_failures(ud->pool) == failures)
+		acl_cache(clientid, username, topic, access, granted, userdata);
+
+   done:
+	if (ud->stats) {
+		if (granted == MOSQ_ERR_SUCCESS)
+			ud->stats->acl_granted++;
+		else
+			ud->stats->acl_denied++;
+		stats_add(&ud->stats->acl, stats_now() - start);
+		stats_tick(ud->stats, ud);
+	}
 	return (granted);
 	
 }
@@ -80,3 +80,43 @@ void t_expand(const char *clientid, const char *username, char *in, char **res)
 
         *res = work;
 }
+
+/*
+ * Append `topic' with access `acc' to the malloc'd array `*patterns' of
+ * `*npatterns' patterns, growing it as needed; the access of a topic
+ * which is already there is merged. Return FALSE if out of memory.
+ */
+
+int aclpattern_add(struct aclpattern **patterns, int *npatterns, const char *topic, int acc)
+{
+        struct aclpattern *p;
+        int i, n = *npatterns;
+
+        for (i = 0; i < n; i++) {
+                if (!strcmp((*patterns)[i].topic, topic)) {
+                        (*patterns)[i].acc |= acc;
+                        return (TRUE);
+                }
+        }
+
+        /* Grow to 8, 16, 32, ... */
+        if (n == 0 || (n >= 8 && (n & (n - 1)) == 0)) {
+                p = realloc(*patterns, sizeof(struct aclpattern) * (n ? n * 2 : 8));
+                if (p == NULL)
+                        return (FALSE);
+                *patterns = p;
+        }
+
+        if (((*patterns)[n].topic = strdup(topic)) == NULL)
+                return (FALSE);
+        (*patterns)[n].acc = acc;
+        *npatterns = n + 1;
+        return (TRUE);
+}
+
+void aclpattern_free(struct aclpattern *patterns, int npatterns)
+{
+        while (npatterns > 0)
+                free(patterns[--npatterns].topic);
+        free(patterns);
+}
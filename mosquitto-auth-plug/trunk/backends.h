@@ -37,11 +37,68 @@
 #ifndef __BACKENDS_H
 # define __BACKENDS_H
 
+typedef void *(f_init)(void);
 typedef void (f_kill)(void *conf);
 typedef char *(f_getuser)(void *conf, const char *username, const char *password, int *authenticated);
 typedef int (f_superuser)(void *conf, const char *username);
 typedef int (f_aclcheck)(void *conf, const char *clientid, const char *username, const char *topic, int acc);
+typedef int (f_reload)(void *conf);
+
+/*
+ * An ACL pattern of a user, as returned by ->aclfetch(): `topic' is a
+ * subscription pattern which may contain %c and %u, `acc' is a bitmask
+ * of MOSQ_ACL_READ and MOSQ_ACL_WRITE.
+ */
+struct aclpattern {
+	char *topic;
+	int acc;
+};
+
+/*
+ * Optional: fetch all the ACL patterns of a user and the superuser flag in
+ * one request. On success, returns TRUE and sets `*patterns' to a malloc'd
+ * array of `*npatterns' malloc'd patterns, owned by the caller; returns
+ * FALSE if the patterns are not available, and the plugin falls back to
+ * ->superuser() and ->aclcheck().
+ */
+typedef int (f_aclfetch)(void *conf, const char *username, int *superuser, struct aclpattern **patterns, int *npatterns);
+
+struct netstats;
+
+/*
+ * Optional: add the counters of the requests made by a handle to its
+ * server to `ns', and reset them. It is called by the thread which uses
+ * the handle.
+ */
+typedef void (f_netstats)(void *conf, struct netstats *ns);
+
+/*
+ * Optional: called by each worker of the pool with its handle, when the
+ * worker starts and before it stops, e.g. for the per-thread state of a
+ * client library.
+ */
+typedef void (f_thread)(void *conf);
+
+struct useracl;
+
+struct backend_p {
+	void *conf;			/* Handle to backend */
+	char *name;
+	f_init *init;			/* creates more handles, for the workers */
+	f_kill *kill;
+	f_getuser *getuser;
+	f_superuser *superuser;
+	f_aclcheck *aclcheck;
+	f_aclfetch *aclfetch;		/* optional */
+	f_reload *reload;		/* optional: reopen the data on SIGHUP */
+	f_netstats *netstats;		/* optional */
+	f_thread *thread_start;		/* optional */
+	f_thread *thread_stop;		/* optional */
+	struct useracl *useracls;	/* users' ACLs fetched by aclfetch */
+};
 
 void t_expand(const char *clientid, const char *username, char *in, char **res);
+int aclpattern_add(struct aclpattern **patterns, int *npatterns, const char *topic, int acc);
+void aclpattern_free(struct aclpattern *patterns, int npatterns);
 
 #endif
@@ -39,20 +39,55 @@
 #include "be-cdb.h"
 #include "log.h"
 #include "hash.h"
+#include "backends.h"
 
-void *be_cdb_init()
+/* Longest "super:username" or "acl:username" key */
+#define CDB_KEYLEN	(256)
+
+/*
+ * Map the whole of `cdbname'. The mapping outlives the descriptor, and
+ * it keeps the data of the file even if the file is replaced.
+ */
+static struct cdb *cdb_open(const char *cdbname)
 {
-	struct cdb_backend *conf;
-	char *cdbname;
+	struct cdb *cdb;
 	int fd;
 
-	if ((cdbname = p_stab("cdbname")) == NULL)
-		_fatal("Mandatory parameter `cdbname' missing");
-
 	if ((fd = open(cdbname, O_RDONLY)) == -1) {
 		perror(cdbname);
 		return (NULL);
 	}
+	if ((cdb = (struct cdb *)malloc(sizeof(struct cdb))) == NULL) {
+		close(fd);
+		return (NULL);
+	}
+	if (cdb_init(cdb, fd) != 0) {
+		perror(cdbname);
+		free(cdb);
+		close(fd);
+		return (NULL);
+	}
+	close(fd);
+	cdb->cdb_fd = -1;
+
+	return (cdb);
+}
+
+static void cdb_close(struct cdb *cdb)
+{
+	if (cdb) {
+		cdb_free(cdb);
+		free(cdb);
+	}
+}
+
+void *be_cdb_init()
+{
+	struct cdb_backend *conf;
+	char *cdbname;
+
+	if ((cdbname = p_stab("cdbname")) == NULL)
+		_fatal("Mandatory parameter `cdbname' missing");
 
 	conf = malloc(sizeof(struct cdb_backend));
 	if (conf == NULL) {
@@ -60,7 +95,7 @@ void *be_cdb_init()
 	}
 
 	conf->cdbname	= strdup(cdbname);
-	conf->cdb	= (struct cdb *)malloc(sizeof(struct cdb));
+	conf->cdb	= cdb_open(cdbname);
 
 	if (conf->cdb == NULL) {
 		free(conf->cdbname);
@@ -68,8 +103,6 @@ void *be_cdb_init()
 		return (NULL);
 	}
 
-	cdb_init(conf->cdb, fd);
-
 	return (conf);
 }
 
@@ -78,87 +111,237 @@ void be_cdb_destroy(void *handle)
 	struct cdb_backend *conf = (struct cdb_backend *)handle;
 
 	if (conf) {
-		cdb_free(conf->cdb);
+		cdb_close(conf->cdb);
 		free(conf->cdbname);
+		free(conf);
 	}
 }
 
+/*
+ * Map the file again: a new database is installed by renaming it over
+ * the old one, then mosquitto is sent a SIGHUP. If the new file can't be
+ * used, the old mapping stays.
+ */
+int be_cdb_reload(void *handle)
+{
+	struct cdb_backend *conf = (struct cdb_backend *)handle;
+	struct cdb *cdb;
+
+	if ((cdb = cdb_open(conf->cdbname)) == NULL) {
+		_log(LOG_NOTICE, "cdb: can't reload %s, keeping the old data", conf->cdbname);
+		return (FALSE);
+	}
+	cdb_close(conf->cdb);
+	conf->cdb = cdb;
+	_log(LOG_NOTICE, "cdb: reloaded %s", conf->cdbname);
+
+	return (TRUE);
+}
+
 char *be_cdb_getuser(void *handle, const char *username, const char *password, int *authenticated)
 {
 	struct cdb_backend *conf = (struct cdb_backend *)handle;
-	char *k, *v = NULL;
-	unsigned klen;
+	const char *d;
+	char *v = NULL;
+	unsigned vlen;
 
 	if (!conf || !username || !*username)
 		return (NULL);
 
-	k = (char *)username;
-	klen = strlen(k);
+	if (cdb_find(conf->cdb, username, strlen(username)) > 0) {
+		vlen = cdb_datalen(conf->cdb);
+		if ((d = cdb_getdata(conf->cdb)) != NULL && (v = malloc(vlen + 1)) != NULL) {
+			memcpy(v, d, vlen);
+			v[vlen] = 0;
+		}
+	}
 
-	if (cdb_find(conf->cdb, k, klen) > 0) {
-		int vpos = cdb_datapos(conf->cdb);
-		int vlen = cdb_datalen(conf->cdb);
+	return (v);
+}
 
-		if ((v = malloc(vlen + 1)) != NULL) {
-			cdb_read(conf->cdb, v, vlen, vpos);
-			v[vlen] = 0;
+static int make_key(const char *prefix, const char *username, char *key)
+{
+	if (strlen(prefix) + strlen(username) >= CDB_KEYLEN)
+		return (-1);
+	return sprintf(key, "%s%s", prefix, username);
+}
+
+/*
+ * Compare the topic level `level' with the pattern level `p', in which
+ * %c and %u stand for the client id and the username.
+ */
+static int level_matches(const char *p, size_t plen, const char *level, size_t llen, const char *clientid, const char *username)
+{
+	const char *pe = p + plen, *le = level + llen;
+
+	while (p < pe) {
+		if (*p == '%' && p + 1 < pe && (p[1] == 'c' || p[1] == 'u')) {
+			const char *sub = (p[1] == 'c') ? clientid : username;
+			size_t slen = strlen(sub);
+
+			if ((size_t)(le - level) < slen || memcmp(level, sub, slen) != 0)
+				return (FALSE);
+			level += slen;
+			p += 2;
+		} else {
+			if (level == le || *level != *p)
+				return (FALSE);
+			level++;
+			p++;
 		}
 	}
+	return (level == le);
+}
+
+/*
+ * Match `topic' against the pattern at `p', which is not NUL terminated:
+ * it is a value in the mapping.
+ */
+static int pattern_matches(const char *p, size_t plen, const char *topic, const char *clientid, const char *username)
+{
+	const char *pe = p + plen;
+
+	/* Topics starting with $ are not matched by wildcards */
+	if (*topic == '$' && (plen == 0 || *p == '+' || *p == '#'))
+		return (FALSE);
 
+	for (;;) {
+		const char *pend = memchr(p, '/', pe - p);
+		const char *tend = strchr(topic, '/');
+		size_t llen = (pend ? pend : pe) - p;
+		size_t tlen = tend ? (size_t)(tend - topic) : strlen(topic);
+
+		if (llen == 1 && *p == '#')
+			return (pend == NULL);
+		if (!(llen == 1 && *p == '+') &&
+		    !level_matches(p, llen, topic, tlen, clientid, username))
+			return (FALSE);
+
+		if (pend == NULL)
+			return (tend == NULL);
+		p = pend + 1;
+		if (tend == NULL)	/* "a/#" matches "a" */
+			return (pe - p == 1 && *p == '#');
+		topic = tend + 1;
+	}
+}
+
+/*
+ * Split a value "<acc> <topic>" of an "acl:" key, or a bare topic, which
+ * is for both reading and writing.
+ */
+static const char *acl_value(const char *v, unsigned vlen, int *acc, size_t *tlen)
+{
+	if (vlen > 2 && v[0] >= '0' && v[0] <= '9' && v[1] == ' ') {
+		*acc = v[0] - '0';
+		*tlen = vlen - 2;
+		return (v + 2);
+	}
+	*acc = MOSQ_ACL_READ | MOSQ_ACL_WRITE;
+	*tlen = vlen;
 	return (v);
 }
 
 /*
  * Check access to topic for username. Look values for a key "acl:username"
- * and use mosquitto_topic_matches_sub() to validate the topic.
+ * and match the topic against them, in place in the mapping. With `acc'
+ * 0, the access is not checked.
  */
-
-int be_cdb_access(void *handle, const char *username, char *topic)
+static int acl_match(struct cdb_backend *conf, const char *clientid, const char *username, const char *topic, int acc)
 {
-	struct cdb_backend *conf = (struct cdb_backend *)handle;
-	char *k;
-	unsigned klen;
-	int found = 0;
+	char key[CDB_KEYLEN];
+	int klen, found = 0;
 	struct cdb_find cdbf;
-	bool bf;
 
-	if (!conf || !username || !topic)
+	if ((klen = make_key("acl:", username, key)) < 0)
 		return (0);
 
-	if ((k = malloc(strlen(username) + strlen("acl:") + 2)) == NULL)
-		return (0);
-	sprintf(k, "acl:%s", username);
-	klen = strlen(k);
-
-	cdb_findinit(&cdbf, conf->cdb, k, klen);
-	while ((cdb_findnext(&cdbf) > 0) && (!found)) {
-		unsigned vpos = cdb_datapos(conf->cdb);
-		unsigned vlen = cdb_datalen(conf->cdb);
-		char *val;
+	cdb_findinit(&cdbf, conf->cdb, key, klen);
+	while (!found && cdb_findnext(&cdbf) > 0) {
+		const char *v = cdb_getdata(conf->cdb), *t;
+		size_t tlen;
+		int vacc;
 
-		val = malloc(vlen);
-		cdb_read(conf->cdb, val, vlen, vpos);
+		if (v == NULL)
+			continue;
+		t = acl_value(v, cdb_datalen(conf->cdb), &vacc, &tlen);
+		if (acc && !(vacc & acc))
+			continue;
+		found = pattern_matches(t, tlen, topic, clientid ? clientid : "", username);
+	}
 
-		mosquitto_topic_matches_sub(val, topic, &bf);
-		found |= bf;
+	return (found);
+}
 
-		free(val);
-	}
+int be_cdb_access(void *handle, const char *username, char *topic)
+{
+	struct cdb_backend *conf = (struct cdb_backend *)handle;
 
-	free(k);
+	if (!conf || !username || !topic)
+		return (0);
 
-	return (found > 0);
+	return acl_match(conf, NULL, username, topic, 0);
 }
 
+/*
+ * A user is a superuser if the key "super:username" exists.
+ */
 int be_cdb_superuser(void *handle, const char *username)
 {
-	return 0;
+	struct cdb_backend *conf = (struct cdb_backend *)handle;
+	char key[CDB_KEYLEN];
+	int klen;
+
+	if (!conf || !username || (klen = make_key("super:", username, key)) < 0)
+		return (FALSE);
+
+	return (cdb_find(conf->cdb, key, klen) > 0);
 }
 
 int be_cdb_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
-	/* FIXME: implement. Currently TRUE */
+	struct cdb_backend *conf = (struct cdb_backend *)handle;
+
+	if (!conf || !username || !topic)
+		return (FALSE);
+
+	return acl_match(conf, clientid, username, topic, acc);
+}
+
+int be_cdb_aclfetch(void *handle, const char *username, int *superuser, struct aclpattern **patterns, int *npatterns)
+{
+	struct cdb_backend *conf = (struct cdb_backend *)handle;
+	char key[CDB_KEYLEN], *topic;
+	int klen, acc, ok = TRUE;
+	struct cdb_find cdbf;
+	size_t tlen;
+
+	if (!conf || !username || (klen = make_key("acl:", username, key)) < 0)
+		return (FALSE);
+
+	*superuser = be_cdb_superuser(conf, username);
+	*patterns = NULL;
+	*npatterns = 0;
+
+	cdb_findinit(&cdbf, conf->cdb, key, klen);
+	while (ok && cdb_findnext(&cdbf) > 0) {
+		const char *v = cdb_getdata(conf->cdb), *t;
+
+		if (v == NULL)
+			continue;
+		t = acl_value(v, cdb_datalen(conf->cdb), &acc, &tlen);
+		if ((topic = strndup(t, tlen)) == NULL) {
+			ok = FALSE;
+			break;
+		}
+		ok = aclpattern_add(patterns, npatterns, topic, acc);
+		free(topic);
+	}
+	if (!ok) {
+		aclpattern_free(*patterns, *npatterns);
+		return (FALSE);
+	}
 
-	return 1;
+	return (TRUE);
 }
 #endif /* BE_CDB */
@@ -29,6 +29,8 @@
 
 #ifdef BE_CDB
 
+#include "backends.h"
+
 struct cdb_backend {
 	char *cdbname;
 	struct cdb *cdb;
@@ -40,4 +42,6 @@ char *be_cdb_getuser(void *handle, const char *username, const char *password, i
 int be_cdb_access(void *handle, const char *username, char *topic);
 int be_cdb_superuser(void *handle, const char *username);
 int be_cdb_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc);
+int be_cdb_aclfetch(void *handle, const char *username, int *superuser, struct aclpattern **patterns, int *npatterns);
+int be_cdb_reload(void *handle);
 #endif /* BE_CDB */
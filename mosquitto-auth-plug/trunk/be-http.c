@@ -40,7 +40,6 @@
 
 static int get_string_envs(CURL *curl, const char *required_env, char *querystring)
 {
-	char *data;
 	char *escaped_key;
 	char *escaped_val;
 	char *env_string;
@@ -52,17 +51,16 @@ static int get_string_envs(CURL *curl, const char *required_env, char *querystri
 
 	//_log(LOG_DEBUG, "sys_envs=%s", sys_envs);
 
-	env_string = (char *)malloc( strlen(required_env) + 20);
+	env_string = strdup(required_env);
 	if (env_string == NULL) {
 		_fatal("ENOMEM");
 		return (-1);
 	}
-	sprintf(env_string, "%s", required_env);
 
 	//_log(LOG_DEBUG, "env_string=%s", env_string);
 
 	num = get_sys_envs(env_string, ",", "=", params_key, env_names, env_value);
-	//sprintf(querystring, "");
+	*querystring = 0;
 	for( i = 0; i < num; i++ ){
 		escaped_key = curl_easy_escape(curl, params_key[i], 0);
 		escaped_val = curl_easy_escape(curl, env_value[i], 0);
@@ -71,124 +69,192 @@ static int get_string_envs(CURL *curl, const char *required_env, char *querystri
 		//_log(LOG_DEBUG, "escaped_key=%s", escaped_key);
 		//_log(LOG_DEBUG, "escaped_val=%s", escaped_envvalue);
 
-		data = (char *)malloc(strlen(escaped_key) + strlen(escaped_val) + 1);
-		if ( data == NULL ) {
-			_fatal("ENOMEM");
+		if (strlen(querystring) + strlen(escaped_key) + strlen(escaped_val) + 2 >= MAXPARAMSLEN) {
+			_fatal("http params too long");
 			return (-1);
 		}
-		sprintf(data, "%s=%s&", escaped_key, escaped_val);
-		if ( i == 0 ) {
-			sprintf(querystring, "%s", data);
-		} else {
-			strcat(querystring, data);
-		}
+		strcat(querystring, escaped_key);
+		strcat(querystring, "=");
+		strcat(querystring, escaped_val);
+		strcat(querystring, "&");
+
+		curl_free(escaped_key);
+		curl_free(escaped_val);
 	}
 
-	free(data);
-	free(escaped_key);
-	free(escaped_val);
 	free(env_string);
-	//free(params_key);
-	//free(env_names);
-	//free(env_value);
 	return (num);
 }
 
-static int http_post(void *handle, char *uri, const char *clientid, const char *username, const char *password, const char *topic, int acc, int method)
+/*
+ * Discard the response body, which would otherwise go to stdout.
+ */
+static size_t discard_body(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-	struct http_backend *conf = (struct http_backend *)handle;
-	CURL *curl;
-	struct curl_slist *headerlist=NULL;
-	int re;
-	int respCode = 0;
-	int ok = FALSE;
-	char *url;
-	char *data;
+	return size * nmemb;
+}
 
-	if (username == NULL) {
-		return (FALSE);
+/*
+ * Collect the response body of aclfetch.
+ */
+static size_t collect_body(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct http_backend *conf = (struct http_backend *)userdata;
+	size_t len = size * nmemb;
+
+	if (conf->body_len + len + 1 > conf->body_size) {
+		size_t body_size = (conf->body_len + len + 1) * 2;
+		char *body = (char *)realloc(conf->body, body_size);
+		if (body == NULL)
+			return 0;
+		conf->body = body;
+		conf->body_size = body_size;
 	}
+	memcpy(conf->body + conf->body_len, ptr, len);
+	conf->body_len += len;
+	conf->body[conf->body_len] = 0;
+	return len;
+}
 
-	clientid = (clientid && *clientid) ? clientid : "";
-	password = (password && *password) ? password : "";
-	topic    = (topic && *topic) ? topic : "";
+/*
+ * The requests, connections and their latencies go to the stats of the
+ * plugin (see stats.c).
+ */
+void be_http_netstats(void *handle, struct netstats *ns)
+{
+	struct http_backend *conf = (struct http_backend *)handle;
+
+	stats_netmove(ns, &conf->net);
+}
+
+/*
+ * Set up the persistent handle of an endpoint: the URL, the headers and
+ * the parameters from the environment are built once, and the handle
+ * keeps its connection open between requests.
+ */
+static int http_endpoint_init(struct http_backend *conf, struct http_endpoint *ep, const char *uri, const char *envs)
+{
+	const char *scheme = (strcmp(conf->with_tls, "true") == 0) ? "https" : "http";
 
-	if ((curl = curl_easy_init()) == NULL) {
+	if ((ep->curl = curl_easy_init()) == NULL) {
 		_fatal("create curl_easy_handle fails");
 		return (FALSE);
 	}
-	if (conf->hostheader != NULL)
-		curl_slist_append(headerlist, conf->hostheader);
-	curl_slist_append(headerlist, "Expect:");
-
-	//_log(LOG_NOTICE, "u=%s p=%s t=%s acc=%d", username, password, topic, acc);
 
-	url = (char *)malloc(strlen(conf->ip) + strlen(uri) + 20);
-	if (url == NULL) {
+	ep->url = (char *)malloc(strlen(conf->ip) + strlen(uri) + 20);
+	ep->envs = (char *)malloc(MAXPARAMSLEN);
+	if (ep->url == NULL || ep->envs == NULL) {
 		_fatal("ENOMEM");
 		return (FALSE);
 	}
-	
-	// enable the https
-	if (strcmp(conf->with_tls, "true") == 0){
-		sprintf(url, "https://%s:%d%s", conf->ip, conf->port, uri);
-	}else{
-		sprintf(url, "http://%s:%d%s", conf->ip, conf->port, uri);
+	sprintf(ep->url, "%s://%s:%d%s", scheme, conf->ip, conf->port, uri);
+
+	*ep->envs = 0;
+	if (envs != NULL && get_string_envs(ep->curl, envs, ep->envs) == -1) {
+		return (FALSE);
 	}
 
-	char* escaped_username = curl_easy_escape(curl, username, 0);
-	char* escaped_password = curl_easy_escape(curl, password, 0);
-	char* escaped_topic = curl_easy_escape(curl, topic, 0);
-	char* escaped_clientid = curl_easy_escape(curl, clientid, 0);
+	curl_easy_setopt(ep->curl, CURLOPT_URL, ep->url);
+	curl_easy_setopt(ep->curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(ep->curl, CURLOPT_HTTPHEADER, conf->headerlist);
+	curl_easy_setopt(ep->curl, CURLOPT_TIMEOUT_MS, conf->timeout_ms);
+	curl_easy_setopt(ep->curl, CURLOPT_CONNECTTIMEOUT_MS, conf->connect_timeout_ms);
+	curl_easy_setopt(ep->curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(ep->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(ep->curl, CURLOPT_WRITEFUNCTION, discard_body);
 
-	char string_acc[20];
-	snprintf(string_acc, 20, "%d", acc);
+	return (TRUE);
+}
 
-	char *string_envs = (char *)malloc(MAXPARAMSLEN);
-	if (string_envs == NULL) {
-		_fatal("ENOMEM");
-		return (FALSE);
+static void http_endpoint_cleanup(struct http_endpoint *ep)
+{
+	if (ep->curl)
+		curl_easy_cleanup(ep->curl);
+	free(ep->url);
+	free(ep->envs);
+}
+
+/*
+ * Make room for `extra' more bytes in the request body buffer.
+ */
+static int data_reserve(struct http_backend *conf, size_t extra)
+{
+	size_t len = conf->data_len + extra + 1;
+
+	if (len > conf->data_size) {
+		char *data = (char *)realloc(conf->data, len * 2);
+		if (data == NULL) {
+			_fatal("ENOMEM");
+			return (FALSE);
+		}
+		conf->data = data;
+		conf->data_size = len * 2;
 	}
+	return (TRUE);
+}
 
-	memset(string_envs, 0, MAXPARAMSLEN);
+/*
+ * Append an escaped parameter to the request body buffer.
+ */
+static int append_param(struct http_backend *conf, CURL *curl, const char *key, const char *value)
+{
+	char *escaped = curl_easy_escape(curl, value, 0);
+	int ok;
 
-	//get the sys_env from here
-	int env_num = 0;
-	if ( method == METHOD_GETUSER && conf->getuser_envs != NULL ){
-		env_num = get_string_envs(curl, conf->getuser_envs, string_envs);
-	}else if ( method == METHOD_SUPERUSER && conf->superuser_envs != NULL ){
-		env_num = get_string_envs(curl, conf->superuser_envs, string_envs);
-	} else if ( method == METHOD_ACLCHECK && conf->aclcheck_envs != NULL ){
-		env_num = get_string_envs(curl, conf->aclcheck_envs, string_envs);
+	if (escaped == NULL)
+		return (FALSE);
+	ok = data_reserve(conf, strlen(key) + strlen(escaped) + 2);
+	if (ok) {
+		conf->data_len += sprintf(conf->data + conf->data_len, "%s%s=%s",
+			(conf->data_len && conf->data[conf->data_len - 1] != '&') ? "&" : "",
+			key, escaped);
 	}
-	if( env_num == -1 ){
+	curl_free(escaped);
+	return (ok);
+}
+
+static int http_post(void *handle, struct http_endpoint *ep, const char *clientid, const char *username, const char *password, const char *topic, int acc)
+{
+	struct http_backend *conf = (struct http_backend *)handle;
+	CURL *curl = ep->curl;
+	int re;
+	long respCode = 0, connects = 0;
+	double seconds;
+	int ok = FALSE;
+	char string_acc[20];
+
+	if (username == NULL) {
 		return (FALSE);
 	}
-	//---- over ----
 
-	data = (char *)malloc(strlen(string_envs) + strlen(escaped_username) + strlen(escaped_password) + strlen(escaped_topic) + strlen(string_acc) + strlen(escaped_clientid) + 50);
-	if (data == NULL) {
-		_fatal("ENOMEM");
+	clientid = (clientid && *clientid) ? clientid : "";
+	password = (password && *password) ? password : "";
+	topic    = (topic && *topic) ? topic : "";
+
+	snprintf(string_acc, 20, "%d", acc);
+
+	/* The parameters from the environment come first, and end with a '&' */
+	conf->data_len = strlen(ep->envs);
+	if (!data_reserve(conf, 0)) {
 		return (FALSE);
 	}
-	sprintf(data, "%susername=%s&password=%s&topic=%s&acc=%s&clientid=%s",
-		string_envs,
-		escaped_username,
-		escaped_password,
-		escaped_topic,
-		string_acc,
-		clientid);
-
-	//_log(LOG_DEBUG, "url=%s", url);
-	//_log(LOG_DEBUG, "data=%s", data);
+	memcpy(conf->data, ep->envs, conf->data_len + 1);
+	if (!append_param(conf, curl, "username", username) ||
+	    !append_param(conf, curl, "password", password) ||
+	    !append_param(conf, curl, "topic", topic) ||
+	    !append_param(conf, curl, "acc", string_acc) ||
+	    !append_param(conf, curl, "clientid", clientid)) {
+		return (FALSE);
+	}
+
+	//_log(LOG_DEBUG, "url=%s", ep->url);
+	//_log(LOG_DEBUG, "data=%s", conf->data);
 	// curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 
-	curl_easy_setopt(curl, CURLOPT_URL, url);
-	curl_easy_setopt(curl, CURLOPT_POST, 1L);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, conf->data);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)conf->data_len);
 
+	conf->net.requests++;
 	re = curl_easy_perform(curl);
 	if (re == CURLE_OK) {
 		re = curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &respCode);
@@ -198,18 +264,19 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 			//_log(LOG_NOTICE, "http auth fail re=%d respCode=%d", re, respCode);
 		}
 	} else {
-	  //_log(LOG_DEBUG, "http req fail url=%s re=%s", url, curl_easy_strerror(re));
+		conf->net.failures++;
+		_log(LOG_DEBUG, "http req fail url=%s re=%s", ep->url, curl_easy_strerror(re));
 	}
 
-	curl_easy_cleanup(curl);
-	curl_slist_free_all (headerlist);
-	free(url);
-	free(data);
-	free(string_envs);
-	free(escaped_username);
-	free(escaped_password);
-	free(escaped_topic);
-	free(escaped_clientid);
+	/* Only requests which opened a new connection paid for the connect */
+	if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK && connects > 0) {
+		conf->net.connects++;
+		if (curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &seconds) == CURLE_OK)
+			stats_add(&conf->net.connect, seconds);
+	}
+	if (curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &seconds) == CURLE_OK)
+		stats_add(&conf->net.request, seconds);
+
 	return (ok);
 }
 
@@ -244,18 +311,26 @@ void *be_http_init()
 	}
 
 	conf = (struct http_backend *)malloc(sizeof(struct http_backend));
+	if (conf == NULL) {
+		_fatal("ENOMEM");
+		return (NULL);
+	}
+	memset(conf, 0, sizeof(struct http_backend));
 	conf->ip = ip;
 	conf->port = p_stab("http_port") == NULL ? 80 : atoi(p_stab("http_port"));
 	if (p_stab("http_hostname") != NULL) {
-		conf->hostheader = (char *)malloc(128);
+		conf->hostheader = (char *)malloc(strlen(p_stab("http_hostname")) + 10);
 		sprintf(conf->hostheader, "Host: %s", p_stab("http_hostname"));
+		conf->headerlist = curl_slist_append(conf->headerlist, conf->hostheader);
 	} else {
 		conf->hostheader = NULL;
 	}
+	conf->headerlist = curl_slist_append(conf->headerlist, "Expect:");
 	conf->getuser_uri = getuser_uri;
 	conf->superuser_uri = superuser_uri;
 	conf->aclcheck_uri = aclcheck_uri;
 
+	conf->aclfetch_uri = p_stab("http_aclfetch_uri");
 	conf->getuser_envs = p_stab("http_getuser_params");
 	conf->superuser_envs = p_stab("http_superuser_params");
 	conf->aclcheck_envs = p_stab("http_aclcheck_params");
@@ -266,6 +341,22 @@ void *be_http_init()
 		conf->with_tls = "false";
 	}
 
+	conf->timeout_ms = p_stab("http_timeout_ms") == NULL ? 2000 : atol(p_stab("http_timeout_ms"));
+	conf->connect_timeout_ms = p_stab("http_connect_timeout_ms") == NULL ? 1000 : atol(p_stab("http_connect_timeout_ms"));
+
+	if (!http_endpoint_init(conf, &conf->getuser, getuser_uri, conf->getuser_envs) ||
+	    !http_endpoint_init(conf, &conf->superuser, superuser_uri, conf->superuser_envs) ||
+	    !http_endpoint_init(conf, &conf->aclcheck, aclcheck_uri, conf->aclcheck_envs)) {
+		return (NULL);
+	}
+	if (conf->aclfetch_uri != NULL) {
+		if (!http_endpoint_init(conf, &conf->aclfetch, conf->aclfetch_uri, conf->aclcheck_envs)) {
+			return (NULL);
+		}
+		curl_easy_setopt(conf->aclfetch.curl, CURLOPT_WRITEFUNCTION, collect_body);
+		curl_easy_setopt(conf->aclfetch.curl, CURLOPT_WRITEDATA, conf);
+	}
+
 	_log(LOG_DEBUG, "with_tls=%s", conf->with_tls);
 	_log(LOG_DEBUG, "getuser_uri=%s", getuser_uri);
 	_log(LOG_DEBUG, "superuser_uri=%s", superuser_uri);
@@ -273,6 +364,7 @@ void *be_http_init()
 	_log(LOG_DEBUG, "getuser_params=%s", conf->getuser_envs);
 	_log(LOG_DEBUG, "superuser_params=%s", conf->superuser_envs);
 	_log(LOG_DEBUG, "aclcheck_paramsi=%s", conf->aclcheck_envs);
+	_log(LOG_DEBUG, "timeout_ms=%ld connect_timeout_ms=%ld", conf->timeout_ms, conf->connect_timeout_ms);
 
 	return (conf);
 };
@@ -281,6 +373,14 @@ void be_http_destroy(void *handle)
 	struct http_backend *conf = (struct http_backend *)handle;
 
 	if (conf) {
+		http_endpoint_cleanup(&conf->getuser);
+		http_endpoint_cleanup(&conf->superuser);
+		http_endpoint_cleanup(&conf->aclcheck);
+		http_endpoint_cleanup(&conf->aclfetch);
+		free(conf->body);
+		curl_slist_free_all(conf->headerlist);
+		free(conf->hostheader);
+		free(conf->data);
 		curl_global_cleanup();
 		free(conf);
 	}
@@ -292,7 +392,7 @@ char *be_http_getuser(void *handle, const char *username, const char *password,
 	if (username == NULL) {
 		return NULL;
 	}
-	re = http_post(handle, conf->getuser_uri, NULL, username, password, NULL, -1, METHOD_GETUSER);
+	re = http_post(handle, &conf->getuser, NULL, username, password, NULL, -1);
 	if (re == 1) {
 		*authenticated = 1;
 	}
@@ -303,13 +403,62 @@ int be_http_superuser(void *handle, const char *username)
 {
 	struct http_backend *conf = (struct http_backend *)handle;
 
-	return http_post(handle, conf->superuser_uri, NULL, username, NULL, NULL, -1, METHOD_SUPERUSER);
+	return http_post(handle, &conf->superuser, NULL, username, NULL, NULL, -1);
 };
 
 int be_http_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
 	struct http_backend *conf = (struct http_backend *)handle;
 
-	return http_post(conf, conf->aclcheck_uri, clientid, username, NULL, topic, acc, METHOD_ACLCHECK);
+	return http_post(conf, &conf->aclcheck, clientid, username, NULL, topic, acc);
 };
+
+/*
+ * POST the username to http_aclfetch_uri: a 200 response lists the ACL
+ * patterns of the user, one per line as "<acc> <topic>", where acc is
+ * 1 (read), 2 (write) or 3 (both); a line "superuser" marks a superuser.
+ */
+int be_http_aclfetch(void *handle, const char *username, int *superuser, struct aclpattern **patterns, int *npatterns)
+{
+	struct http_backend *conf = (struct http_backend *)handle;
+	char *line, *next;
+
+	if (conf->aclfetch_uri == NULL) {
+		return (FALSE);
+	}
+
+	conf->body_len = 0;
+	if (!http_post(handle, &conf->aclfetch, NULL, username, NULL, NULL, -1)) {
+		return (FALSE);
+	}
+
+	*superuser = FALSE;
+	*patterns = NULL;
+	*npatterns = 0;
+	for (line = conf->body; line && conf->body_len > 0 && *line; line = next) {
+		char *topic;
+		int acc;
+
+		if ((next = strchr(line, '\n')) != NULL) {
+			*next++ = 0;
+		}
+		if (*line && line[strlen(line) - 1] == '\r') {
+			line[strlen(line) - 1] = 0;
+		}
+		if (!strcmp(line, "superuser")) {
+			*superuser = TRUE;
+			continue;
+		}
+		acc = (int)strtol(line, &topic, 10);
+		if (topic == line || *topic != ' ' || !*++topic) {
+			continue;
+		}
+		if (!aclpattern_add(patterns, npatterns, topic, acc)) {
+			aclpattern_free(*patterns, *npatterns);
+			return (FALSE);
+		}
+	}
+
+	return (TRUE);
+}
 #endif /* BE_HTTP */
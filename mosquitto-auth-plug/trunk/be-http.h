@@ -28,10 +28,21 @@
  */
 #ifdef BE_HTTP
 
+#include <curl/curl.h>
+#include "backends.h"
+#include "stats.h"
+
 #define MAXPARAMSLEN  1024
-#define METHOD_GETUSER   1
-#define METHOD_SUPERUSER 2
-#define METHOD_ACLCHECK  3
+
+/*
+ * Persistent curl handle of an endpoint, which keeps the connection to the
+ * server open between requests.
+ */
+struct http_endpoint {
+	CURL *curl;
+	char *url;
+	char *envs;			/* escaped params from the environment */
+};
 
 struct http_backend {
 	char *ip;
@@ -40,10 +51,25 @@ struct http_backend {
 	char *getuser_uri;
 	char *superuser_uri;
 	char *aclcheck_uri;
+	char *aclfetch_uri;		/* optional */
 	char *getuser_envs;
 	char *superuser_envs;
 	char *aclcheck_envs;
 	char *with_tls;
+	long timeout_ms;
+	long connect_timeout_ms;
+	struct curl_slist *headerlist;
+	struct http_endpoint getuser;
+	struct http_endpoint superuser;
+	struct http_endpoint aclcheck;
+	struct http_endpoint aclfetch;
+	char *body;			/* response of aclfetch, reused */
+	size_t body_len;
+	size_t body_size;
+	char *data;			/* request body, reused */
+	size_t data_len;
+	size_t data_size;
+	struct netstats net;		/* since the last be_http_netstats() */
 };
 
 void *be_http_init();
@@ -51,4 +77,6 @@ void be_http_destroy(void *conf);
 char *be_http_getuser(void *conf, const char *username, const char *password, int *authenticated);
 int be_http_superuser(void *conf, const char *username);
 int be_http_aclcheck(void *conf, const char *clientid, const char *username, const char *topic, int acc);
+int be_http_aclfetch(void *conf, const char *username, int *superuser, struct aclpattern **patterns, int *npatterns);
+void be_http_netstats(void *conf, struct netstats *ns);
 #endif /* BE_HTTP */
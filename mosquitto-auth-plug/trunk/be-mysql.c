@@ -33,11 +33,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <mosquitto.h>
+#include <errmsg.h>
 #include "be-mysql.h"
 #include "log.h"
 #include "hash.h"
 #include "backends.h"
 
+#define MAXPARAMS	(4)
+
+/*
+ * A query of the configuration, with its '%s' and %d turned into the
+ * parameters of a statement prepared once per connection.
+ */
+struct mysql_query {
+	char *name;
+	char *sql;			/* with ? for the parameters */
+	char types[MAXPARAMS + 1];	/* 's' username, 'd' access */
+	MYSQL_STMT *stmt;		/* NULL until prepared */
+};
+
 struct mysql_backend {
         MYSQL *mysql;
 	char *host;
@@ -46,9 +60,13 @@ struct mysql_backend {
 	char *user;
 	char *pass;
         bool auto_connect;
-        char *userquery;        // MUST return 1 row, 1 column
-        char *superquery;       // MUST return 1 row, 1 column, [0, 1]
-        char *aclquery;         // MAY return n rows, 1 column, string
+        my_bool reconnect;
+        struct mysql_query *userquery;        // MUST return 1 row, 1 column
+        struct mysql_query *superquery;       // MUST return 1 row, 1 column, [0, 1]
+        struct mysql_query *aclquery;         // MAY return n rows, 1 column, string
+	char *value;			/* column of the current row */
+	unsigned long value_size;
+	struct lograte errlog;		/* query errors */
 };
 
 static char *get_bool(char *option, char *defval)
@@ -62,6 +80,206 @@ static char *get_bool(char *option, char *defval)
     return defval;
 }
 
+/*
+ * Turn the '%s' (quoted or not) and %d of `query' into placeholders.
+ */
+static struct mysql_query *query_new(const char *name, const char *query)
+{
+	struct mysql_query *q;
+	const char *p;
+	char *o;
+	int n = 0;
+
+	if (query == NULL)
+		return (NULL);
+	if ((q = calloc(1, sizeof(struct mysql_query))) == NULL ||
+	    (q->sql = malloc(strlen(query) + 1)) == NULL)
+		_fatal("Out of memory");
+	q->name = (char *)name;
+
+	for (p = query, o = q->sql; *p; ) {
+		int quoted = (*p == '\'' || *p == '"') && p[1] == '%' && p[2] == 's' && p[3] == *p;
+
+		if (quoted || (*p == '%' && (p[1] == 's' || p[1] == 'd'))) {
+			if (n == MAXPARAMS)
+				_fatal("%s: too many parameters", name);
+			q->types[n++] = quoted ? 's' : p[1];
+			*o++ = '?';
+			p += quoted ? 4 : 2;
+		} else {
+			*o++ = *p++;
+		}
+	}
+	*o = 0;
+	q->types[n] = 0;
+
+	return (q);
+}
+
+static void query_close(struct mysql_query *q)
+{
+	if (q && q->stmt) {
+		mysql_stmt_close(q->stmt);
+		q->stmt = NULL;
+	}
+}
+
+static void query_free(struct mysql_query *q)
+{
+	if (q) {
+		query_close(q);
+		free(q->sql);
+		free(q);
+	}
+}
+
+/*
+ * Prepare `q' if it isn't yet. Returns 0, or the error number.
+ */
+static unsigned int query_prepare(struct mysql_backend *conf, struct mysql_query *q)
+{
+	unsigned int err;
+
+	if (q->stmt)
+		return (0);
+	if ((q->stmt = mysql_stmt_init(conf->mysql)) == NULL)
+		return (mysql_errno(conf->mysql));
+	if (mysql_stmt_prepare(q->stmt, q->sql, strlen(q->sql))) {
+		_log_rate(&conf->errlog, LOG_NOTICE, "%s: %s", q->name, mysql_stmt_error(q->stmt));
+		err = mysql_stmt_errno(q->stmt);
+		query_close(q);
+		return (err);
+	}
+	if (mysql_stmt_param_count(q->stmt) != strlen(q->types) ||
+	    mysql_stmt_field_count(q->stmt) != 1) {
+		_log_rate(&conf->errlog, LOG_NOTICE, "%s: unexpected parameters or columns", q->name);
+		query_close(q);
+		return ((unsigned int)-1);
+	}
+	return (0);
+}
+
+static void prepare_all(struct mysql_backend *conf)
+{
+	if (conf->userquery)
+		query_prepare(conf, conf->userquery);
+	if (conf->superquery)
+		query_prepare(conf, conf->superquery);
+	if (conf->aclquery)
+		query_prepare(conf, conf->aclquery);
+}
+
+/*
+ * The statements belong to the connection: they are closed with it, and
+ * prepared again when they are used.
+ */
+static bool reconnect(struct mysql_backend *conf)
+{
+	query_close(conf->userquery);
+	query_close(conf->superquery);
+	query_close(conf->aclquery);
+
+	if (!conf->auto_connect)
+		return false;
+
+	mysql_close(conf->mysql);
+	conf->mysql = mysql_init(NULL);
+	if (conf->reconnect)
+		mysql_options(conf->mysql, MYSQL_OPT_RECONNECT, &conf->reconnect);
+	if (!mysql_real_connect(conf->mysql, conf->host, conf->user, conf->pass, conf->dbname, conf->port, NULL, 0)) {
+		fprintf(stderr, "do auto_connect but %s\n", mysql_error(conf->mysql));
+		return false;
+	}
+	prepare_all(conf);
+	return true;
+}
+
+static int connection_lost(unsigned int err)
+{
+	return (err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST ||
+		err == CR_COMMANDS_OUT_OF_SYNC);
+}
+
+/*
+ * Run `q' with `username' and `acc' as its parameters and call `row' with
+ * the column of each row, until it returns FALSE. If the connection is
+ * found broken, reconnect and try once more. Returns the number of rows,
+ * or -1 on errors.
+ */
+static long run_query(struct mysql_backend *conf, struct mysql_query *q, const char *username, int acc, int (*row)(const char *value, void *arg), void *arg)
+{
+	MYSQL_BIND param[MAXPARAMS], result;
+	unsigned long ulen = strlen(username), length = 0;
+	my_bool is_null = 0;
+	long nrows = 0;
+	int i, rc, attempt, more = TRUE;
+
+	memset(param, 0, sizeof(param));
+	for (i = 0; q->types[i]; i++) {
+		if (q->types[i] == 's') {
+			param[i].buffer_type = MYSQL_TYPE_STRING;
+			param[i].buffer = (char *)username;
+			param[i].buffer_length = ulen;
+			param[i].length = &ulen;
+		} else {
+			param[i].buffer_type = MYSQL_TYPE_LONG;
+			param[i].buffer = &acc;
+		}
+	}
+
+	for (attempt = 0; ; attempt++) {
+		unsigned int err = query_prepare(conf, q);
+
+		if (err == 0) {
+			if (!mysql_stmt_bind_param(q->stmt, param) &&
+			    !mysql_stmt_execute(q->stmt))
+				break;
+			err = mysql_stmt_errno(q->stmt);
+			_log_rate(&conf->errlog, LOG_NOTICE, "%s: %s", q->name, mysql_stmt_error(q->stmt));
+		}
+		if (attempt > 0 || !connection_lost(err) || !reconnect(conf))
+			return (-1);
+	}
+
+	memset(&result, 0, sizeof(result));
+	result.buffer_type = MYSQL_TYPE_STRING;
+	result.buffer = conf->value;
+	result.buffer_length = conf->value_size - 1;
+	result.length = &length;
+	result.is_null = &is_null;
+	if (mysql_stmt_bind_result(q->stmt, &result)) {
+		mysql_stmt_free_result(q->stmt);
+		return (-1);
+	}
+
+	while ((rc = mysql_stmt_fetch(q->stmt)) == 0 || rc == MYSQL_DATA_TRUNCATED) {
+		if (rc == MYSQL_DATA_TRUNCATED) {
+			char *v = realloc(conf->value, length + 1);
+
+			if (v == NULL)
+				break;
+			conf->value = v;
+			conf->value_size = length + 1;
+			result.buffer = conf->value;
+			result.buffer_length = conf->value_size - 1;
+			mysql_stmt_fetch_column(q->stmt, &result, 0, 0);
+			mysql_stmt_bind_result(q->stmt, &result);
+		}
+		nrows++;
+		if (more) {
+			conf->value[length] = 0;
+			more = row(is_null ? NULL : conf->value, arg);
+		}
+	}
+	mysql_stmt_free_result(q->stmt);
+	if (rc != MYSQL_NO_DATA) {
+		_log_rate(&conf->errlog, LOG_NOTICE, "%s: %s", q->name, mysql_stmt_error(q->stmt));
+		return (-1);
+	}
+
+	return (nrows);
+}
+
 void *be_mysql_init()
 {
 	struct mysql_backend *conf;
@@ -99,9 +317,13 @@ void *be_mysql_init()
 	conf->pass		= pass;
     conf->auto_connect  = false;
 	conf->dbname		= dbname;
-	conf->userquery		= userquery;
-	conf->superquery	= p_stab("superquery");
-	conf->aclquery		= p_stab("aclquery");
+	conf->userquery		= query_new("userquery", userquery);
+	conf->superquery	= query_new("superquery", p_stab("superquery"));
+	conf->aclquery		= query_new("aclquery", p_stab("aclquery"));
+	conf->value_size	= 256;
+	if ((conf->value = malloc(conf->value_size)) == NULL)
+		_fatal("Out of memory");
+	memset(&conf->errlog, 0, sizeof(conf->errlog));
 
     opt_flag = get_bool("mysql_auto_connect", "true");
     if (!strcmp("true", opt_flag)) {
@@ -113,14 +335,21 @@ void *be_mysql_init()
         reconnect = true;
         mysql_options(conf->mysql, MYSQL_OPT_RECONNECT, &reconnect);
     }
+    conf->reconnect = reconnect;
 
 	if (!mysql_real_connect(conf->mysql, host, user, pass, dbname, port, NULL, 0)) {
 		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
         if (!conf->auto_connect && !reconnect) {
-            free(conf);
             mysql_close(conf->mysql);
+            query_free(conf->userquery);
+            query_free(conf->superquery);
+            query_free(conf->aclquery);
+            free(conf->value);
+            free(conf);
             return (NULL);
         }
+	} else {
+		prepare_all(conf);
 	}
 
 	return ((void *)conf);
@@ -131,100 +360,53 @@ void be_mysql_destroy(void *handle)
 	struct mysql_backend *conf = (struct mysql_backend *)handle;
 
 	if (conf) {
+		query_free(conf->userquery);
+		query_free(conf->superquery);
+		query_free(conf->aclquery);
 		mysql_close(conf->mysql);
-		if (conf->userquery)
-			free(conf->userquery);
-		if (conf->superquery)
-			free(conf->superquery);
-		if (conf->aclquery)
-			free(conf->aclquery);
+		free(conf->value);
 		free(conf);
 	}
 }
 
-static char *escape(void *handle, const char *value, long *vlen)
+/*
+ * The workers of the pool use the client library from their own threads,
+ * which need its per-thread state: the handles are created and closed by
+ * the broker thread, which has it from mysql_init().
+ */
+void be_mysql_thread_start(void *handle)
 {
-	struct mysql_backend *conf = (struct mysql_backend *)handle;
-	char *v;
+	if (mysql_thread_init() != 0)
+		_fatal("mysql_thread_init fails");
+}
 
-	*vlen = strlen(value) * 2 + 1;
-	if ((v = malloc(*vlen)) == NULL)
-		return (NULL);
-	mysql_real_escape_string(conf->mysql, v, value, strlen(value));
-	return (v);
+void be_mysql_thread_stop(void *handle)
+{
+	mysql_thread_end();
 }
 
-static bool auto_connect(struct mysql_backend *conf)
+static int first_row(const char *value, void *arg)
 {
-    if (conf->auto_connect) {
-        if (!mysql_real_connect(conf->mysql, conf->host, conf->user, conf->pass, conf->dbname, conf->port, NULL, 0)) {
-            fprintf(stderr, "do auto_connect but %s\n", mysql_error(conf->mysql));
-            return false;
-        }
-        return true;
-	}
-    return false;
+	char **first = (char **)arg;
+
+	*first = (value) ? strdup(value) : NULL;
+	return (FALSE);
 }
 
 char *be_mysql_getuser(void *handle, const char *username, const char *password, int *authenticated)
 {
 	struct mysql_backend *conf = (struct mysql_backend *)handle;
-	char *query = NULL, *u = NULL, *value = NULL, *v;
-	long nrows, ulen;
-	MYSQL_RES *res = NULL;
-	MYSQL_ROW rowdata;
+	char *value = NULL;
 
 	if (!conf || !conf->userquery || !username || !*username)
 		return (NULL);
 
-    if (mysql_ping(conf->mysql)) {
-        fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-        if (!auto_connect(conf)) {
-            return (NULL);
-        }
-    }
-
-	if ((u = escape(conf, username, &ulen)) == NULL)
+	/* Exactly one row */
+	if (run_query(conf, conf->userquery, username, 0, first_row, &value) != 1) {
+		free(value);
 		return (NULL);
-
-	if ((query = malloc(strlen(conf->userquery) + ulen + 128)) == NULL) {
-		free(u);
-		return (NULL);
-	}
-	sprintf(query, conf->userquery, u);
-	free(u);
-
-	// DEBUG puts(query);
-
-	if (mysql_query(conf->mysql, query)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		goto out;
 	}
 
-	res = mysql_store_result(conf->mysql);
-	if ((nrows = mysql_num_rows(res)) != 1) {
-		// DEBUG fprintf(stderr, "rowcount = %ld; not ok\n", nrows);
-		goto out;
-	}
-
-	if (mysql_num_fields(res) != 1) {
-		// DEBUG fprintf(stderr, "numfields not ok\n");
-		goto out;
-	}
-
-	if ((rowdata = mysql_fetch_row(res)) == NULL) {
-		goto out;
-	}
-
-	v = rowdata[0];
-	value = (v) ? strdup(v) : NULL;
-
-
-   out:
-
-	mysql_free_result(res);
-	free(query);
-
 	return (value);
 }
 
@@ -235,62 +417,48 @@ char *be_mysql_getuser(void *handle, const char *username, const char *password,
 int be_mysql_superuser(void *handle, const char *username)
 {
 	struct mysql_backend *conf = (struct mysql_backend *)handle;
-	char *query = NULL, *u = NULL;
-	long nrows, ulen;
+	char *value = NULL;
 	int issuper = FALSE;
-	MYSQL_RES *res = NULL;
-	MYSQL_ROW rowdata;
-
 
 	if (!conf || !conf->superquery)
 		return (FALSE);
 
-    if (mysql_ping(conf->mysql)) {
-        fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-        if (!auto_connect(conf)) {
-            return (FALSE);
-        }
-    }
+	if (run_query(conf, conf->superquery, username, 0, first_row, &value) == 1 && value)
+		issuper = atoi(value);
+	free(value);
 
-	if ((u = escape(conf, username, &ulen)) == NULL)
-		return (FALSE);
+	return (issuper);
+}
 
-	if ((query = malloc(strlen(conf->superquery) + ulen + 128)) == NULL) {
-		free(u);
-		return (FALSE);
-	}
-	sprintf(query, conf->superquery, u);
-	free(u);
+struct acl_match {
+	const char *clientid;
+	const char *username;
+	const char *topic;
+	int match;
+};
 
-	// puts(query);
+static int topic_row(const char *v, void *arg)
+{
+	struct acl_match *m = (struct acl_match *)arg;
+	char *expanded;
+	bool bf;
 
-	if (mysql_query(conf->mysql, query)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		goto out;
-	}
+	if (v == NULL)
+		return (TRUE);
 
-	res = mysql_store_result(conf->mysql);
-	if ((nrows = mysql_num_rows(res)) != 1) {
-		goto out;
-	}
+	/* Check mosquitto_match_topic. If true,
+	 * if true, set match and break out of loop. */
 
-	if (mysql_num_fields(res) != 1) {
-		// DEBUG fprintf(stderr, "numfields not ok\n");
-		goto out;
-	}
+	t_expand(m->clientid, m->username, (char *)v, &expanded);
+	if (expanded && *expanded) {
+		mosquitto_topic_matches_sub(expanded, m->topic, &bf);
+		m->match |= bf;
+		_log(LOG_DEBUG, "  mysql: topic_matches(%s, %s) == %d",
+			expanded, v, bf);
 
-	if ((rowdata = mysql_fetch_row(res)) == NULL) {
-		goto out;
+		free(expanded);
 	}
-
-	issuper = atoi(rowdata[0]);
-
-   out:
-
-	mysql_free_result(res);
-	free(query);
-
-	return (issuper);
+	return (m->match == 0);
 }
 
 /*
@@ -310,71 +478,67 @@ int be_mysql_superuser(void *handle, const char *username)
 int be_mysql_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
 	struct mysql_backend *conf = (struct mysql_backend *)handle;
-	char *query = NULL, *u = NULL, *v;
-	long ulen;
-	int match = 0;
-	bool bf;
-	MYSQL_RES *res = NULL;
-	MYSQL_ROW rowdata;
+	struct acl_match m = { clientid, username, topic, 0 };
 
 	if (!conf || !conf->aclquery)
 		return (FALSE);
 
-	if (mysql_ping(conf->mysql)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		if (!auto_connect(conf)) {
-			return (FALSE);
-		}
-	}
-
-	if ((u = escape(conf, username, &ulen)) == NULL)
-		return (FALSE);
-
-	if ((query = malloc(strlen(conf->aclquery) + ulen + 128)) == NULL) {
-		free(u);
+	if (run_query(conf, conf->aclquery, username, acc, topic_row, &m) < 0)
 		return (FALSE);
-	}
-	sprintf(query, conf->aclquery, u, acc);
-	free(u);
 
-	//_log(LOG_DEBUG, "SQL: %s", query);
+	return (m.match);
+}
 
-	if (mysql_query(conf->mysql, query)) {
-		_log(LOG_NOTICE, "%s", mysql_error(conf->mysql));
-		goto out;
-	}
+struct acl_rows {
+	struct aclpattern **patterns;
+	int *npatterns;
+	int acc;
+	int ok;
+};
 
-	res = mysql_store_result(conf->mysql);
-	if (mysql_num_fields(res) != 1) {
-		fprintf(stderr, "numfields not ok\n");
-		goto out;
-	}
+static int pattern_row(const char *v, void *arg)
+{
+	struct acl_rows *r = (struct acl_rows *)arg;
 
-	while (match == 0 && (rowdata = mysql_fetch_row(res)) != NULL) {
-		if ((v = rowdata[0]) != NULL) {
+	if (v != NULL)
+		r->ok = aclpattern_add(r->patterns, r->npatterns, v, r->acc);
+	return (r->ok);
+}
 
-			/* Check mosquitto_match_topic. If true,
-			 * if true, set match and break out of loop. */
+/*
+ * Add to `patterns' the topics returned by the ACL query for `username'
+ * and access `acc'. Return FALSE on errors.
+ */
+static int acl_rows(struct mysql_backend *conf, const char *username, int acc, struct aclpattern **patterns, int *npatterns)
+{
+	struct acl_rows r = { patterns, npatterns, acc, TRUE };
 
-			char *expanded;
+	if (run_query(conf, conf->aclquery, username, acc, pattern_row, &r) < 0)
+		return (FALSE);
 
-			t_expand(clientid, username, v, &expanded);
-			if (expanded && *expanded) {
-				mosquitto_topic_matches_sub(expanded, topic, &bf);
-				match |= bf;
-				_log(LOG_DEBUG, "  mysql: topic_matches(%s, %s) == %d",
-					expanded, v, bf);
+	return (r.ok);
+}
 
-				free(expanded);
-			}
-		}
-	}
+/*
+ * All the ACL patterns of a user: the ACL query is run once for reading
+ * and once for writing.
+ */
+int be_mysql_aclfetch(void *handle, const char *username, int *superuser, struct aclpattern **patterns, int *npatterns)
+{
+	struct mysql_backend *conf = (struct mysql_backend *)handle;
 
-   out:
+	if (!conf || !conf->aclquery)
+		return (FALSE);
 
-	mysql_free_result(res);
-	free(query);
+	*patterns = NULL;
+	*npatterns = 0;
+	if (!acl_rows(conf, username, MOSQ_ACL_READ, patterns, npatterns) ||
+	    !acl_rows(conf, username, MOSQ_ACL_WRITE, patterns, npatterns)) {
+		aclpattern_free(*patterns, *npatterns);
+		return (FALSE);
+	}
+	*superuser = be_mysql_superuser(conf, username);
 
-	return (match);
+	return (TRUE);
 }
 #endif /* BE_MYSQL */
@@ -30,10 +30,14 @@
 #ifdef BE_MYSQL
 
 #include <mysql.h>
+#include "backends.h"
 
 void *be_mysql_init();
 void be_mysql_destroy(void *conf);
 char *be_mysql_getuser(void *conf, const char *username, const char *password, int *authenticated);
 int be_mysql_superuser(void *conf, const char *username);
 int be_mysql_aclcheck(void *conf, const char *clientid, const char *username, const char *topic, int acc);
+int be_mysql_aclfetch(void *conf, const char *username, int *superuser, struct aclpattern **patterns, int *npatterns);
+void be_mysql_thread_start(void *conf);
+void be_mysql_thread_stop(void *conf);
 #endif /* BE_MYSQL */
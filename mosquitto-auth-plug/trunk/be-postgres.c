@@ -37,7 +37,6 @@
 #include "log.h"
 #include "hash.h"
 #include "backends.h"
-#include <arpa/inet.h>
 
 struct pg_backend {
 	PGconn *conn;
@@ -49,8 +48,70 @@ struct pg_backend {
 	char *userquery;        // MUST return 1 row, 1 column
 	char *superquery;       // MUST return 1 row, 1 column, [0, 1]
 	char *aclquery;         // MAY return n rows, 1 column, string
+	int prepared;		/* statements existing in this session */
+	struct lograte errlog;	/* query and connection errors */
 };
 
+#define Q_USER		(0)
+#define Q_SUPER		(1)
+#define Q_ACL		(2)
+
+static const char *query_names[3] = { "userquery", "superquery", "aclquery" };
+
+/*
+ * The queries are prepared once per session, with their names as
+ * statement names; `prepared' has a bit for each one.
+ */
+static void prepare_all(struct pg_backend *conf)
+{
+	const char *queries[3];
+	PGresult *res;
+	int i;
+
+	queries[Q_USER] = conf->userquery;
+	queries[Q_SUPER] = conf->superquery;
+	queries[Q_ACL] = conf->aclquery;
+
+	for (i = 0; i < 3; i++) {
+		if (queries[i] == NULL || (conf->prepared & (1 << i)))
+			continue;
+		res = PQprepare(conf->conn, query_names[i], queries[i], 0, NULL);
+		if (PQresultStatus(res) == PGRES_COMMAND_OK)
+			conf->prepared |= 1 << i;
+		else
+			_log_rate(&conf->errlog, LOG_NOTICE, "%s: %s", query_names[i], PQresultErrorMessage(res));
+		PQclear(res);
+	}
+}
+
+/*
+ * Run the prepared query `q'; if the connection turns out to be broken,
+ * reset it and try once more.
+ */
+static PGresult *exec_prepared(struct pg_backend *conf, int q, int nparams, const char **values)
+{
+	PGresult *res = NULL;
+	int attempt;
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		if (!(conf->prepared & (1 << q)))
+			prepare_all(conf);
+		if (conf->prepared & (1 << q)) {
+			res = PQexecPrepared(conf->conn, query_names[q], nparams, values, NULL, NULL, 0);
+			if (PQresultStatus(res) == PGRES_TUPLES_OK || PQstatus(conf->conn) != CONNECTION_BAD)
+				return (res);
+			PQclear(res);
+			res = NULL;
+		}
+		if (PQstatus(conf->conn) != CONNECTION_BAD)
+			break;
+		_log_rate(&conf->errlog, LOG_NOTICE, "Reconnecting to PostgreSQL");
+		conf->prepared = 0;
+		PQreset(conf->conn);
+	}
+	return (res);
+}
+
 void *be_pg_init()
 {
 	struct pg_backend *conf;
@@ -87,6 +148,8 @@ void *be_pg_init()
 	conf->userquery  = userquery;
 	conf->superquery = p_stab("superquery");
 	conf->aclquery   = p_stab("aclquery");
+	conf->prepared   = 0;
+	memset(&conf->errlog, 0, sizeof(conf->errlog));
 
 	_log( LOG_DEBUG, "HERE: %s", conf->superquery );
 	_log( LOG_DEBUG, "HERE: %s", conf->aclquery );
@@ -105,6 +168,8 @@ void *be_pg_init()
 
 	free(connect_string);
 
+	prepare_all(conf);
+
 	return ((void *)conf);
 }
 
@@ -137,10 +202,8 @@ char *be_pg_getuser(void *handle, const char *username, const char *password, in
 		return (NULL);
 
 	const char *values[1] = {username};
-	int lengths[1] = {strlen(username)};
-	int binary[1] = {0};
 
-	res = PQexecParams(conf->conn, conf->userquery, 1, NULL, values, lengths, binary, 0);
+	res = exec_prepared(conf, Q_USER, 1, values);
 
 	if ( PQresultStatus(res) != PGRES_TUPLES_OK )
 	{
@@ -192,10 +255,8 @@ int be_pg_superuser(void *handle, const char *username)
 
 	// query for postgres $1 instead of %s
 	const char *values[1] = {username};
-	int lengths[1] = {strlen(username)};
-	int binary[1] = {0};
 
-	res = PQexecParams(conf->conn, conf->superquery, 1, NULL, values, lengths, binary, 0);
+	res = exec_prepared(conf, Q_SUPER, 1, values);
 
 	if ( PQresultStatus(res) != PGRES_TUPLES_OK )
 	{
@@ -255,13 +316,12 @@ int be_pg_aclcheck(void *handle, const char *clientid, const char *username, con
 	if (!conf || !conf->aclquery)
 		return (FALSE);
 
-	int localacc = htonl(acc);
+	char accstr[16];
 
-	const char *values[2] = {username,(char*)&localacc};
-	int lengths[2] = {strlen(username),sizeof(localacc)};
-	int binary[2] = {0,1};
+	snprintf(accstr, sizeof(accstr), "%d", acc);
+	const char *values[2] = {username,accstr};
 
-	res = PQexecParams(conf->conn, conf->aclquery, 2, NULL, values, lengths, binary, 0);
+	res = exec_prepared(conf, Q_ACL, 2, values);
 
 	if ( PQresultStatus(res) != PGRES_TUPLES_OK )
 	{
@@ -307,4 +367,68 @@ out:
 
 	return (match);
 }
+
+/*
+ * Add to `patterns' the topics returned by the ACL query for `username'
+ * and access `acc'. Return FALSE on errors.
+ */
+static int acl_rows(struct pg_backend *conf, const char *username, int acc, struct aclpattern **patterns, int *npatterns)
+{
+	PGresult *res = NULL;
+	char accstr[16];
+	const char *values[2] = {username,accstr};
+	int ok = FALSE, row, rec_count;
+	char *v;
+
+	snprintf(accstr, sizeof(accstr), "%d", acc);
+	res = exec_prepared(conf, Q_ACL, 2, values);
+
+	if ( PQresultStatus(res) != PGRES_TUPLES_OK )
+	{
+		fprintf(stderr, "%s\n", PQresultErrorMessage(res));
+		goto out;
+	}
+
+	if (PQnfields(res) != 1) {
+		fprintf(stderr, "numfields not ok\n");
+		goto out;
+	}
+
+	ok = TRUE;
+	rec_count = PQntuples(res);
+	for ( row = 0; ok && row < rec_count; row++ ) {
+		if ( (v = PQgetvalue(res,row,0) ) != NULL) {
+			ok = aclpattern_add(patterns, npatterns, v, acc);
+		}
+	}
+
+out:
+
+	PQclear(res);
+
+	return (ok);
+}
+
+/*
+ * All the ACL patterns of a user: the ACL query is run once for reading
+ * and once for writing.
+ */
+int be_pg_aclfetch(void *handle, const char *username, int *superuser, struct aclpattern **patterns, int *npatterns)
+{
+	struct pg_backend *conf = (struct pg_backend *)handle;
+
+	if (!conf || !conf->aclquery)
+		return (FALSE);
+
+	*patterns = NULL;
+	*npatterns = 0;
+	if (!acl_rows(conf, username, MOSQ_ACL_READ, patterns, npatterns) ||
+	    !acl_rows(conf, username, MOSQ_ACL_WRITE, patterns, npatterns)) {
+		aclpattern_free(*patterns, *npatterns);
+		return (FALSE);
+	}
+	*superuser = be_pg_superuser(conf, username);
+
+	return (TRUE);
+}
 #endif /* BE_POSTGRES */
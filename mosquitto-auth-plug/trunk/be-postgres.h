@@ -30,10 +30,12 @@
 #ifdef BE_POSTGRES
 
 #include <libpq-fe.h>
+#include "backends.h"
 
 void *be_pg_init();
 void be_pg_destroy(void *conf);
 char *be_pg_getuser(void *conf, const char *username, const char *password, int *authenticated);
 int be_pg_superuser(void *conf, const char *username);
 int be_pg_aclcheck(void *conf, const char *clientid, const char *username, const char *topic, int acc);
+int be_pg_aclfetch(void *conf, const char *username, int *superuser, struct aclpattern **patterns, int *npatterns);
 #endif /* BE_POSTGRES */
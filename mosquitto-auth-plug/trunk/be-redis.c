@@ -29,51 +29,202 @@
 
 #ifdef BE_REDIS
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "log.h"
 #include "hash.h"
+#include "backends.h"
+#include "be-redis.h"
 #include <hiredis/hiredis.h>
 
-struct redis_backend {
+#define REDIS_SLOTS	(2)
+
+/*
+ * A connection of the pool: NULL while it is down, until the reconnector
+ * thread opens it again.
+ */
+struct redis_slot {
 	redisContext *redis;
+	int busy;
+};
+
+struct redis_backend {
 	char *host;
 	char *userquery;
 	char *aclquery;
+	char *userfmt;			/* HMGET <redis_userhash> password */
+	char *superfmt;			/* HMGET <redis_userhash> superuser */
+	char *aclfmt;			/* SMEMBERS <redis_aclset> */
 	int port;
 	int db;
+	struct timeval connect_timeout;
+	struct timeval timeout;
+	int retry_ms;
+	struct redis_slot *slots;
+	int nslots;
+	int next;			/* round robin */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;		/* a slot is down, or stopping */
+	pthread_t reconnector;
+	int started;
+	int stop;
+	struct lograte errlog;		/* connection errors, in the reconnector */
 };
 
-
-static int be_redis_reconnect(struct redis_backend *conf)
+/*
+ * The queries are hiredis formats; check that they contain `nargs' %s and
+ * no other conversion, as they are given exactly those arguments.
+ */
+static void check_format(const char *name, const char *fmt, int nargs)
 {
-	if (conf->redis != NULL) {
-		redisFree(conf->redis);
-		conf->redis = NULL;
+	const char *p;
+	int n = 0;
+
+	for (p = fmt; (p = strchr(p, '%')) != NULL; p += 2) {
+		if (p[1] == '\0')
+			_fatal("redis_%s: invalid format `%s', it ends with a lone %%", name, fmt);
+		if (p[1] == 's')
+			n++;
+		else if (p[1] != '%')
+			_fatal("redis_%s: only %%s is allowed in `%s'", name, fmt);
 	}
+	if (n != nargs)
+		_fatal("redis_%s: `%s' needs %d %%s", name, fmt, nargs);
+}
 
-	struct timeval timeout = { 2, 500000 }; // 2.5 seconds
-	conf->redis = redisConnectWithTimeout(conf->host, conf->port, timeout);
-	if (conf->redis->err) {
-		_log(LOG_NOTICE, "Redis connection error: %s for %s:%d\n",
-		    conf->redis->errstr, conf->host, conf->port);
-		return 1;
+static char *make_format(const char *prefix, const char *key, const char *suffix)
+{
+	char *fmt = malloc(strlen(prefix) + strlen(key) + strlen(suffix) + 1);
+
+	if (fmt == NULL)
+		_fatal("Out of memory");
+	sprintf(fmt, "%s%s%s", prefix, key, suffix);
+	return (fmt);
+}
+
+static redisContext *be_redis_connect(struct redis_backend *conf)
+{
+	redisContext *redis;
+	redisReply *r;
+
+	redis = redisConnectWithTimeout(conf->host, conf->port, conf->connect_timeout);
+	if (redis == NULL || redis->err) {
+		_log_rate(&conf->errlog, LOG_NOTICE, "Redis connection error: %s for %s:%d",
+		    redis ? redis->errstr : "out of memory", conf->host, conf->port);
+		if (redis)
+			redisFree(redis);
+		return (NULL);
 	}
+	redisSetTimeout(redis, conf->timeout);
 
-	redisReply *r =  redisCommand(conf->redis, "SELECT %i", conf->db);
-	if (r == NULL || conf->redis->err != REDIS_OK) {
-		return 2;
+	r = redisCommand(redis, "SELECT %i", conf->db);
+	if (r == NULL || redis->err != REDIS_OK) {
+		if (r)
+			freeReplyObject(r);
+		redisFree(redis);
+		return (NULL);
 	}
 	freeReplyObject(r);
 
-	return 0;
+	return (redis);
+}
+
+/*
+ * Reopen the connections which are down, every retry_ms, so that the
+ * callers never wait for a connection.
+ */
+static void *be_redis_reconnector(void *arg)
+{
+	struct redis_backend *conf = (struct redis_backend *)arg;
+	redisContext *redis;
+	struct timespec ts;
+	int n, down;
+
+	pthread_mutex_lock(&conf->mutex);
+	while (!conf->stop) {
+		for (down = -1, n = 0; n < conf->nslots; n++) {
+			if (conf->slots[n].redis == NULL && !conf->slots[n].busy)
+				down = n;
+		}
+		if (down >= 0) {
+			conf->slots[down].busy = TRUE;
+			pthread_mutex_unlock(&conf->mutex);
+			redis = be_redis_connect(conf);
+			pthread_mutex_lock(&conf->mutex);
+			conf->slots[down].redis = redis;
+			conf->slots[down].busy = FALSE;
+			if (redis != NULL)
+				continue;
+		} else {
+			pthread_cond_wait(&conf->cond, &conf->mutex);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += conf->retry_ms / 1000;
+		ts.tv_nsec += (long)(conf->retry_ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while (!conf->stop && pthread_cond_timedwait(&conf->cond, &conf->mutex, &ts) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&conf->mutex);
+
+	return (NULL);
+}
+
+/*
+ * Take a connection which is up, or return NULL at once if all of them
+ * are down or busy.
+ */
+static redisContext *slot_get(struct redis_backend *conf, int *slot)
+{
+	redisContext *redis = NULL;
+	int i, n;
+
+	pthread_mutex_lock(&conf->mutex);
+	for (i = 0; i < conf->nslots; i++) {
+		n = (conf->next + i) % conf->nslots;
+		if (conf->slots[n].redis != NULL && !conf->slots[n].busy) {
+			conf->slots[n].busy = TRUE;
+			conf->next = (n + 1) % conf->nslots;
+			redis = conf->slots[n].redis;
+			*slot = n;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&conf->mutex);
+
+	if (redis == NULL)
+		_log(LOG_DEBUG, "Redis: no connection to %s:%d", conf->host, conf->port);
+	return (redis);
+}
+
+/* Give back a connection; a failed one goes to the reconnector */
+static void slot_put(struct redis_backend *conf, int slot, int failed)
+{
+	pthread_mutex_lock(&conf->mutex);
+	if (failed || conf->slots[slot].redis->err != REDIS_OK) {
+		redisFree(conf->slots[slot].redis);
+		conf->slots[slot].redis = NULL;
+		pthread_cond_signal(&conf->cond);
+	}
+	conf->slots[slot].busy = FALSE;
+	pthread_mutex_unlock(&conf->mutex);
 }
 
 void *be_redis_init()
 {
 	struct redis_backend *conf;
-	char *host, *p, *db, *userquery, *aclquery;
+	char *host, *p, *db, *userquery, *aclquery, *userhash, *aclset, *opt;
+	pthread_condattr_t attr;
+	int n, up = 0;
 
 	_log(LOG_DEBUG, "}}}} Redis");
 
@@ -83,16 +234,17 @@ void *be_redis_init()
 		p = "6379";
 	if ((db = p_stab("redis_db")) == NULL)
 		db = "0";
-	if ((userquery = p_stab("redis_userquery")) == NULL) {
-	  userquery = "";
-	}
-	if ((aclquery = p_stab("redis_aclquery")) == NULL) {
-    aclquery = "";
-	}
+	if ((userquery = p_stab("redis_userquery")) == NULL || !*userquery)
+		userquery = "GET %s";
+	if ((aclquery = p_stab("redis_aclquery")) == NULL)
+		aclquery = "";
+	userhash = p_stab("redis_userhash");
+	aclset = p_stab("redis_aclset");
 
 	conf = (struct redis_backend *)malloc(sizeof(struct redis_backend));
 	if (conf == NULL)
 		_fatal("Out of memory");
+	memset(conf, 0, sizeof(struct redis_backend));
 
 	conf->host = strdup(host);
 	conf->port = atoi(p);
@@ -100,93 +252,184 @@ void *be_redis_init()
 	conf->userquery = strdup(userquery);
 	conf->aclquery  = strdup(aclquery);
 
-	conf->redis = NULL;
+	check_format("userquery", conf->userquery, 1);
+	if (*conf->aclquery)
+		check_format("aclquery", conf->aclquery, 2);
+	if (userhash && *userhash) {
+		check_format("userhash", userhash, 1);
+		conf->userfmt = make_format("HMGET ", userhash, " password");
+		conf->superfmt = make_format("HMGET ", userhash, " superuser");
+	}
+	if (aclset && *aclset) {
+		check_format("aclset", aclset, 1);
+		conf->aclfmt = make_format("SMEMBERS ", aclset, "");
+	}
+
+	n = (opt = p_stab("redis_connect_timeout_ms")) ? atoi(opt) : 2500;
+	conf->connect_timeout.tv_sec = n / 1000;
+	conf->connect_timeout.tv_usec = (n % 1000) * 1000;
+	n = (opt = p_stab("redis_timeout_ms")) ? atoi(opt) : 1000;
+	conf->timeout.tv_sec = n / 1000;
+	conf->timeout.tv_usec = (n % 1000) * 1000;
+	conf->retry_ms = (opt = p_stab("redis_retry_ms")) ? atoi(opt) : 1000;
+	if (conf->retry_ms < 1)
+		conf->retry_ms = 1;
+	conf->nslots = (opt = p_stab("redis_connections")) ? atoi(opt) : REDIS_SLOTS;
+	if (conf->nslots < 1)
+		conf->nslots = 1;
+
+	if ((conf->slots = calloc(conf->nslots, sizeof(struct redis_slot))) == NULL)
+		_fatal("Out of memory");
+	for (n = 0; n < conf->nslots; n++) {
+		if ((conf->slots[n].redis = be_redis_connect(conf)) != NULL)
+			up++;
+	}
 
-	if (be_redis_reconnect(conf)) {
-		free(conf->host);
-		free(conf->userquery);
-		free(conf->aclquery);
-		free(conf);
+	/* As before, the back-end doesn't start without Redis */
+	if (up == 0) {
+		be_redis_destroy(conf);
 		return (NULL);
 	}
 
+	pthread_mutex_init(&conf->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&conf->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&conf->reconnector, NULL, be_redis_reconnector, conf) != 0)
+		_fatal("Cannot start the Redis reconnector");
+	conf->started = TRUE;
+
 	return (conf);
 }
 
 void be_redis_destroy(void *handle)
 {
 	struct redis_backend *conf = (struct redis_backend *)handle;
+	int n;
+
+	if (conf == NULL)
+		return;
+
+	if (conf->started) {
+		pthread_mutex_lock(&conf->mutex);
+		conf->stop = TRUE;
+		pthread_cond_signal(&conf->cond);
+		pthread_mutex_unlock(&conf->mutex);
+		pthread_join(conf->reconnector, NULL);
+		pthread_cond_destroy(&conf->cond);
+		pthread_mutex_destroy(&conf->mutex);
+	}
 
-	if (conf != NULL) {
-		redisFree(conf->redis);
-		conf->redis = NULL;
+	for (n = 0; conf->slots && n < conf->nslots; n++) {
+		if (conf->slots[n].redis)
+			redisFree(conf->slots[n].redis);
 	}
+	free(conf->slots);
+	free(conf->host);
+	free(conf->userquery);
+	free(conf->aclquery);
+	free(conf->userfmt);
+	free(conf->superfmt);
+	free(conf->aclfmt);
+	free(conf);
+}
+
+/* Return a copy of the first string of a (HMGET) reply */
+static char *reply_string(redisReply *r)
+{
+	if (r->type == REDIS_REPLY_ARRAY && r->elements > 0)
+		r = r->element[0];
+	if (r->type == REDIS_REPLY_STRING)
+		return strdup(r->str);
+	return (NULL);
+}
+
+static int reply_true(redisReply *r)
+{
+	char *s = reply_string(r);
+	int yes;
+
+	yes = s && (!strcmp(s, "1") || !strcmp(s, "true"));
+	free(s);
+	return (yes);
 }
 
 char *be_redis_getuser(void *handle, const char *username, const char *password, int *authenticated)
 {
 	struct redis_backend *conf = (struct redis_backend *)handle;
-
+	redisContext *redis;
 	redisReply *r;
 	char *pwhash = NULL;
+	int slot;
 
-	if (conf == NULL || conf->redis == NULL || username == NULL)
+	if (conf == NULL || username == NULL)
+		return (NULL);
+	if ((redis = slot_get(conf, &slot)) == NULL)
 		return (NULL);
-  
-  if (strlen(conf->userquery) == 0) {
-    conf->userquery = "GET %s";
-  }
-
-	char *query = malloc(strlen(conf->userquery) + strlen(username) + 128);
-	sprintf(query, conf->userquery, username);
 
-	r = redisCommand(conf->redis, query);
-	if (r == NULL || conf->redis->err != REDIS_OK) {
-		be_redis_reconnect(conf);
+	/* The username is an argument of its own, never part of the query */
+	if (conf->userfmt)
+		r = redisCommand(redis, conf->userfmt, username);
+	else
+		r = redisCommand(redis, conf->userquery, username);
+	if (r == NULL) {
+		slot_put(conf, slot, TRUE);
 		return (NULL);
 	}
+	slot_put(conf, slot, FALSE);
 
-	free(query);
-
-	if (r->type == REDIS_REPLY_STRING) {
-		pwhash = strdup(r->str);
-	}
+	pwhash = reply_string(r);
 	freeReplyObject(r);
 
 	return (pwhash);
 }
 
-int be_redis_superuser(void *conf, const char *username)
+int be_redis_superuser(void *handle, const char *username)
 {
-	return 0;
+	struct redis_backend *conf = (struct redis_backend *)handle;
+	redisContext *redis;
+	redisReply *r;
+	int slot, answer;
+
+	if (conf == NULL || conf->superfmt == NULL || username == NULL)
+		return 0;
+	if ((redis = slot_get(conf, &slot)) == NULL)
+		return 0;
+
+	if ((r = redisCommand(redis, conf->superfmt, username)) == NULL) {
+		slot_put(conf, slot, TRUE);
+		return 0;
+	}
+	slot_put(conf, slot, FALSE);
+
+	answer = reply_true(r);
+	freeReplyObject(r);
+	return answer;
 }
 
 int be_redis_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
 	struct redis_backend *conf = (struct redis_backend *)handle;
-
+	redisContext *redis;
 	redisReply *r;
+	int slot, answer = 0;
 
-	if (conf == NULL || conf->redis == NULL || username == NULL)
+	if (conf == NULL || username == NULL)
 		return 0;
 
-  if (strlen(conf->aclquery) == 0) {
-    return 1;
-  }
-
-	char *query = malloc(strlen(conf->aclquery) + strlen(username) + strlen(topic) + 128);
-	sprintf(query, conf->aclquery, username, topic);
-
+	if (strlen(conf->aclquery) == 0) {
+		return 1;
+	}
 
-	r = redisCommand(conf->redis, query, username, acc);
-	if (r == NULL || conf->redis->err != REDIS_OK) {
-		be_redis_reconnect(conf);
+	if ((redis = slot_get(conf, &slot)) == NULL)
+		return 0;
+	if ((r = redisCommand(redis, conf->aclquery, username, topic)) == NULL) {
+		slot_put(conf, slot, TRUE);
 		return 0;
 	}
+	slot_put(conf, slot, FALSE);
 
-	free(query);
-
-	int answer = 0;
 	if (r->type == REDIS_REPLY_STRING) {
 		int x = atoi(r->str);
 		if (x >= acc)
@@ -196,4 +439,57 @@ int be_redis_aclcheck(void *handle, const char *clientid, const char *username,
 	freeReplyObject(r);
 	return answer;
 }
-#endif /* BE_REDIS */
\ No newline at end of file
+
+/*
+ * Fetch the superuser flag and the ACL patterns, members "<acc> <topic>"
+ * of the set redis_aclset, pipelining the two commands in one round trip.
+ */
+int be_redis_aclfetch(void *handle, const char *username, int *superuser, struct aclpattern **patterns, int *npatterns)
+{
+	struct redis_backend *conf = (struct redis_backend *)handle;
+	redisContext *redis;
+	redisReply *su = NULL, *acls = NULL;
+	int slot, ok;
+	size_t i;
+
+	if (conf == NULL || conf->aclfmt == NULL || username == NULL)
+		return (FALSE);
+	if ((redis = slot_get(conf, &slot)) == NULL)
+		return (FALSE);
+
+	if (conf->superfmt)
+		redisAppendCommand(redis, conf->superfmt, username);
+	redisAppendCommand(redis, conf->aclfmt, username);
+	ok = (conf->superfmt == NULL || redisGetReply(redis, (void **)&su) == REDIS_OK) &&
+	     redisGetReply(redis, (void **)&acls) == REDIS_OK &&
+	     acls->type == REDIS_REPLY_ARRAY;
+	slot_put(conf, slot, FALSE);
+
+	*superuser = (ok && su) ? reply_true(su) : FALSE;
+	*patterns = NULL;
+	*npatterns = 0;
+	for (i = 0; ok && i < acls->elements; i++) {
+		redisReply *e = acls->element[i];
+		char *topic;
+		int acc;
+
+		if (e->type != REDIS_REPLY_STRING)
+			continue;
+		acc = (int)strtol(e->str, &topic, 10);
+		if (topic == e->str || *topic != ' ' || !*++topic)
+			continue;
+		if (!aclpattern_add(patterns, npatterns, topic, acc)) {
+			aclpattern_free(*patterns, *npatterns);
+			*patterns = NULL;
+			*npatterns = 0;
+			ok = FALSE;
+		}
+	}
+
+	if (su)
+		freeReplyObject(su);
+	if (acls)
+		freeReplyObject(acls);
+	return (ok);
+}
+#endif /* BE_REDIS */
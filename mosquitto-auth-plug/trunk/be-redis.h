@@ -29,9 +29,12 @@
 
 #ifdef BE_REDIS
 
+#include "backends.h"
+
 void *be_redis_init();
 void be_redis_destroy(void *conf);
 char *be_redis_getuser(void *conf, const char *username, const char *password, int *authenticated);
 int be_redis_superuser(void *conf, const char *username);
 int be_redis_aclcheck(void *conf, const char *clientid, const char *username, const char *topic, int acc);
+int be_redis_aclfetch(void *conf, const char *username, int *superuser, struct aclpattern **patterns, int *npatterns);
 #endif /* BE_REDIS */
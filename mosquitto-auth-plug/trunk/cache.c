@@ -31,53 +31,202 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <mosquitto.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 #include "userdata.h"
 #include "cache.h"
-#include <openssl/evp.h>
-#include <openssl/sha.h>
-#include "uthash.h"
+#include "backends.h"
 #include "log.h"
 
-static unsigned int sha_hash(const char *data, size_t size, unsigned char *out)
+/* Entries expired at each operation, so that the work is spread out */
+#define EXPIRE_PER_OP	(4)
+
+/*
+ * 32-bit FNV-1a, seeded at startup so that the bucket of a key can't be
+ * guessed from outside.
+ */
+static uint32_t fnv1a(uint32_t h, const char *data, size_t size)
 {
-	unsigned int md_len = -1;
-	const EVP_MD *md = EVP_get_digestbyname("SHA1");
+	const unsigned char *p = (const unsigned char *)data;
 
-	if (md != NULL) {
-		EVP_MD_CTX mdctx;
-		EVP_MD_CTX_init(&mdctx);
-		EVP_DigestInit_ex(&mdctx, md, NULL);
-		EVP_DigestUpdate(&mdctx, data, size);
-		EVP_DigestFinal_ex(&mdctx, out, &md_len);
-		EVP_MD_CTX_cleanup(&mdctx);
+	while (size--) {
+		h ^= *p++;
+		h *= 16777619U;
 	}
-	return md_len;
+	return h;
 }
 
-static void hexify(const char *clientid, const char *username, const char *topic, int access, char *hex)
+/*
+ * Build the key "clientid\0username\0topic" in `key'.
+ * Returns the key length, or 0 if the key is too long to be cached.
+ */
+static unsigned int make_key(const char *clientid, const char *username, const char *topic, char *key)
 {
-	char *data;
-	unsigned char hashdata[SHA_DIGEST_LENGTH];
-	int mdlen, i;
+	size_t clen = strlen(clientid) + 1;
+	size_t ulen = strlen(username) + 1;
+	size_t tlen = strlen(topic);
 
-	data = malloc(strlen(clientid) + strlen(username) + strlen(topic) + 20);
-	sprintf(data, "%s:%s:%s:%d", clientid, username, topic, access);
+	if (clen + ulen + tlen > ACLCACHE_KEYLEN)
+		return 0;
 
-	mdlen = sha_hash(data, strlen(data), hashdata);
-	if (mdlen != SHA_DIGEST_LENGTH) {
-		free(data);
-		return;
+	memcpy(key, clientid, clen);
+	memcpy(key + clen, username, ulen);
+	memcpy(key + clen + ulen, topic, tlen);
+	return (unsigned int)(clen + ulen + tlen);
+}
+
+static uint32_t key_hash(struct aclcache *cache, const char *key, unsigned int keylen, int access)
+{
+	uint32_t h = fnv1a(2166136261U ^ cache->seed, key, keylen);
+
+	return fnv1a(h, (const char *)&access, sizeof(access));
+}
+
+struct aclcache *acl_cache_new(unsigned int capacity, time_t cacheseconds, time_t negcacheseconds)
+{
+	struct aclcache *cache;
+	unsigned int i;
+
+	if (capacity == 0)
+		return NULL;
+
+	if ((cache = (struct aclcache *)malloc(sizeof(struct aclcache))) == NULL)
+		return NULL;
+	memset(cache, 0, sizeof(struct aclcache));
+
+	for (cache->nbuckets = 1; cache->nbuckets < capacity; cache->nbuckets <<= 1)
+		;
+	cache->capacity = capacity;
+	cache->slab = (struct aclcache_entry *)malloc(sizeof(struct aclcache_entry) * capacity);
+	cache->buckets = (int32_t *)malloc(sizeof(int32_t) * cache->nbuckets);
+	if (cache->slab == NULL || cache->buckets == NULL) {
+		acl_cache_free(cache);
+		return NULL;
 	}
 
-	// printf("mdlen=%d, string=%s\n\thash=", mdlen, data);
-	for (i = 0, *hex = 0; i < sizeof(hashdata) / sizeof(hashdata[0]); i++) {
-		sprintf(hex + (i*2), "%02X", hashdata[i]);
+	for (i = 0; i < cache->nbuckets; i++)
+		cache->buckets[i] = -1;
+	for (i = 0; i < capacity; i++)
+		cache->slab[i].next = (i + 1 < capacity) ? (int32_t)(i + 1) : -1;
+	cache->free = 0;
+	cache->oldest[ACLCACHE_DENIED] = cache->newest[ACLCACHE_DENIED] = -1;
+	cache->oldest[ACLCACHE_GRANTED] = cache->newest[ACLCACHE_GRANTED] = -1;
+	cache->seconds[ACLCACHE_DENIED] = negcacheseconds;
+	cache->seconds[ACLCACHE_GRANTED] = cacheseconds;
+	cache->seed = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+
+	return cache;
+}
+
+void acl_cache_free(struct aclcache *cache)
+{
+	if (cache == NULL)
+		return;
+	free(cache->slab);
+	free(cache->buckets);
+	free(cache);
+}
+
+void acl_cache_stats(struct aclcache *cache)
+{
+	if (cache == NULL)
+		return;
+	_log(LOG_NOTICE, "aclcache: %u/%u entries, %lu hits, %lu misses, %lu expired, %lu evicted",
+		cache->used, cache->capacity, cache->hits, cache->misses,
+		cache->expirations, cache->evictions);
+}
+
+#define ENTRY_LIST(e)	(((e)->granted == MOSQ_ERR_SUCCESS) ? ACLCACHE_GRANTED : ACLCACHE_DENIED)
+
+/*
+ * Unlink entry `n' from its bucket and from its expiry list, and put it
+ * in the free list.
+ */
+static void entry_del(struct aclcache *cache, int32_t n)
+{
+	struct aclcache_entry *e = &cache->slab[n];
+	int32_t *pp = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+	int l = ENTRY_LIST(e);
+
+	while (*pp != n)
+		pp = &cache->slab[*pp].next;
+	*pp = e->next;
+
+	if (e->older != -1)
+		cache->slab[e->older].newer = e->newer;
+	else
+		cache->oldest[l] = e->newer;
+	if (e->newer != -1)
+		cache->slab[e->newer].older = e->older;
+	else
+		cache->newest[l] = e->older;
+
+	e->next = cache->free;
+	cache->free = n;
+	cache->used--;
+}
+
+void acl_cache_clear(struct aclcache *cache)
+{
+	if (cache == NULL)
+		return;
+	while (cache->oldest[ACLCACHE_DENIED] != -1)
+		entry_del(cache, cache->oldest[ACLCACHE_DENIED]);
+	while (cache->oldest[ACLCACHE_GRANTED] != -1)
+		entry_del(cache, cache->oldest[ACLCACHE_GRANTED]);
+}
+
+/*
+ * Drop a few expired entries from the head of each expiry list.
+ */
+static void expire(struct aclcache *cache, time_t now)
+{
+	int i, l;
+
+	for (l = ACLCACHE_DENIED; l <= ACLCACHE_GRANTED; l++) {
+		for (i = 0; i < EXPIRE_PER_OP && cache->oldest[l] != -1; i++) {
+			if (now <= cache->slab[cache->oldest[l]].seconds + cache->seconds[l])
+				break;
+			_log(DEBUG, " Cleanup [%08X]", cache->slab[cache->oldest[l]].hash);
+			entry_del(cache, cache->oldest[l]);
+			cache->expirations++;
+		}
 	}
-	// printf("%s\n", hex);
+}
+
+/*
+ * The entry to evict from a full cache: of the oldest of each list, the
+ * one which expires first.
+ */
+static int32_t evictee(struct aclcache *cache)
+{
+	int32_t d = cache->oldest[ACLCACHE_DENIED];
+	int32_t g = cache->oldest[ACLCACHE_GRANTED];
+
+	if (d == -1)
+		return g;
+	if (g == -1)
+		return d;
+	if (cache->slab[d].seconds + cache->seconds[ACLCACHE_DENIED] <=
+	    cache->slab[g].seconds + cache->seconds[ACLCACHE_GRANTED])
+		return d;
+	return g;
+}
+
+static int32_t entry_find(struct aclcache *cache, uint32_t hash, const char *key, unsigned int keylen, int access)
+{
+	int32_t n;
 
+	for (n = cache->buckets[hash & (cache->nbuckets - 1)]; n != -1; n = cache->slab[n].next) {
+		struct aclcache_entry *e = &cache->slab[n];
 
-	free(data);
+		if (e->hash == hash && e->access == access && e->keylen == keylen &&
+		    memcmp(e->key, key, keylen) == 0)
+			return n;
+	}
+	return -1;
 }
 
 /* access is desired read/write access
@@ -86,13 +235,22 @@ static void hexify(const char *clientid, const char *username, const char *topic
 
 void acl_cache(const char *clientid, const char *username, const char *topic, int access, int granted, void *userdata)
 {
-	char hex[SHA_DIGEST_LENGTH * 2 + 1];
-	struct aclcache *a, *tmp;
+	char key[ACLCACHE_KEYLEN];
 	struct userdata *ud = (struct userdata *)userdata;
-	time_t cacheseconds = ud->cacheseconds;
+	struct aclcache *cache = ud->aclcache;
+	struct aclcache_entry *e;
+	unsigned int keylen;
+	uint32_t hash;
+	int32_t n;
+	int l;
 	time_t now;
 
-	if (ud->cacheseconds <= 0) {
+	if (cache == NULL) {
+		return;
+	}
+
+	l = (granted == MOSQ_ERR_SUCCESS) ? ACLCACHE_GRANTED : ACLCACHE_DENIED;
+	if (cache->seconds[l] <= 0) {
 		return;
 	}
 
@@ -100,49 +258,61 @@ void acl_cache(const char *clientid, const char *username, const char *topic, in
 		return;
 	}
 
-	now = time(NULL);
+	if ((keylen = make_key(clientid, username, topic, key)) == 0) {
+		return;
+	}
 
-	hexify(clientid, username, topic, access, hex);
+	now = time(NULL);
+	expire(cache, now);
 
-	HASH_FIND_STR(ud->aclcache, hex, a);
-	if (a) {
-		granted = a->granted;
+	hash = key_hash(cache, key, keylen, access);
+	if ((n = entry_find(cache, hash, key, keylen, access)) != -1) {
+		entry_del(cache, n);
+	}
 
-		if (time(NULL) > (a->seconds + cacheseconds)) {
-			_log(DEBUG, " Expired [%s] for (%s,%s,%d)", hex, clientid, username, access);
-			HASH_DEL(ud->aclcache, a);
-		}
-	} else {
-		a = (struct aclcache *)malloc(sizeof(struct aclcache));
-		strcpy(a->hex, hex);
-		a->granted = granted;
-		a->seconds = now;
-		HASH_ADD_STR(ud->aclcache, hex, a);
-		_log(DEBUG, " Cached  [%s] for (%s,%s,%d)", hex, clientid, username, access);
+	if (cache->free == -1) {
+		/* Full: evict the entry closest to its expiry */
+		entry_del(cache, evictee(cache));
+		cache->evictions++;
 	}
 
-	/*
-	 * Check whole cache for items which need deleting. Important with
-	 * clients who show up once only (mosquitto_[sp]ub with variable clientIDs
-	 */
+	n = cache->free;
+	e = &cache->slab[n];
+	cache->free = e->next;
+	cache->used++;
 
-	HASH_ITER(hh, ud->aclcache, a, tmp) {
-		if (now > (a->seconds + ud->cacheseconds)) {
-			_log(DEBUG, " Cleanup [%s]", a->hex);
-			HASH_DEL(ud->aclcache, a);
-		}
-	}
+	e->hash = hash;
+	e->access = access;
+	e->granted = granted;
+	e->seconds = now;
+	e->keylen = keylen;
+	memcpy(e->key, key, keylen);
+
+	e->next = cache->buckets[hash & (cache->nbuckets - 1)];
+	cache->buckets[hash & (cache->nbuckets - 1)] = n;
+
+	e->older = cache->newest[l];
+	e->newer = -1;
+	if (cache->newest[l] != -1)
+		cache->slab[cache->newest[l]].newer = n;
+	else
+		cache->oldest[l] = n;
+	cache->newest[l] = n;
+
+	_log(DEBUG, " Cached  [%08X] for (%s,%s,%d) granted=%d", hash, clientid, username, access, granted);
 }
 
 int cache_q(const char *clientid, const char *username, const char *topic, int access, void *userdata)
 {
-	char hex[SHA_DIGEST_LENGTH * 2 + 1];
-	struct aclcache *a;
+	char key[ACLCACHE_KEYLEN];
 	struct userdata *ud = (struct userdata *)userdata;
-	time_t cacheseconds = ud->cacheseconds;
-	int granted = MOSQ_ERR_UNKNOWN;
+	struct aclcache *cache = ud->aclcache;
+	unsigned int keylen;
+	uint32_t hash;
+	int32_t n;
+	time_t now;
 
-	if (ud->cacheseconds <= 0) {
+	if (cache == NULL) {
 		return (MOSQ_ERR_UNKNOWN);
 	}
 
@@ -150,21 +320,577 @@ int cache_q(const char *clientid, const char *username, const char *topic, int a
 		return (MOSQ_ERR_UNKNOWN);
 	}
 
-	hexify(clientid, username, topic, access, hex);
+	if ((keylen = make_key(clientid, username, topic, key)) == 0) {
+		cache->misses++;
+		return (MOSQ_ERR_UNKNOWN);
+	}
 
-	HASH_FIND_STR(ud->aclcache, hex, a);
-	if (a) {
-		// printf("---> CACHED! %d\n", a->granted);
+	now = time(NULL);
+	expire(cache, now);
 
-		granted = a->granted;
+	hash = key_hash(cache, key, keylen, access);
+	if ((n = entry_find(cache, hash, key, keylen, access)) != -1) {
+		struct aclcache_entry *e = &cache->slab[n];
 
-		if (time(NULL) > (a->seconds + cacheseconds)) {
-			_log(DEBUG, " Expired [%s] for (%s,%s,%d)", hex, clientid, username, access);
-			HASH_DEL(ud->aclcache, a);
+		if (now > e->seconds + cache->seconds[ENTRY_LIST(e)]) {
+			_log(DEBUG, " Expired [%08X] for (%s,%s,%d)", hash, clientid, username, access);
+			entry_del(cache, n);
+			cache->expirations++;
+		} else {
+			cache->hits++;
+			return (e->granted);
 		}
 	}
 
-	return (granted);
+	cache->misses++;
+	return (MOSQ_ERR_UNKNOWN);
+}
+
+static void aclnode_free(struct aclnode *n)
+{
+	struct aclnode *c, *tmp;
+
+	if (n == NULL)
+		return;
+	HASH_ITER(hh, n->literals, c, tmp) {
+		HASH_DEL(n->literals, c);
+		aclnode_free(c);
+	}
+	while ((c = n->others) != NULL) {
+		n->others = c->next;
+		aclnode_free(c);
+	}
+	free(n->level);
+	free(n);
+}
+
+static struct aclnode *aclnode_new(const char *level, size_t len)
+{
+	struct aclnode *n;
+
+	if ((n = (struct aclnode *)malloc(sizeof(struct aclnode))) == NULL)
+		return (NULL);
+	memset(n, 0, sizeof(struct aclnode));
+	if (level != NULL) {
+		if ((n->level = malloc(len + 1)) == NULL) {
+			free(n);
+			return (NULL);
+		}
+		memcpy(n->level, level, len);
+		n->level[len] = 0;
+		n->wild = (len == 1 && *level == '+');
+	}
+	return (n);
 }
 
+/*
+ * Add a pattern to the trie. Return FALSE if out of memory.
+ */
+static int aclnode_add(struct aclnode *root, const char *topic, int acc)
+{
+	struct aclnode *n = root, *c;
+	const char *level = topic, *end;
+	size_t len;
+	int literal;
+
+	for (;;) {
+		end = strchr(level, '/');
+		len = end ? (size_t)(end - level) : strlen(level);
+
+		if (len == 1 && *level == '#') {
+			n->hash_acc |= acc;
+			return (TRUE);
+		}
 
+		literal = memchr(level, '%', len) == NULL && !(len == 1 && *level == '+');
+		if (literal) {
+			HASH_FIND(hh, n->literals, level, len, c);
+		} else {
+			for (c = n->others; c; c = c->next) {
+				if (strlen(c->level) == len && !memcmp(c->level, level, len))
+					break;
+			}
+		}
+		if (c == NULL) {
+			if ((c = aclnode_new(level, len)) == NULL)
+				return (FALSE);
+			if (literal) {
+				HASH_ADD_KEYPTR(hh, n->literals, c->level, len, c);
+			} else {
+				c->next = n->others;
+				n->others = c;
+			}
+		}
+		n = c;
+
+		if (end == NULL) {
+			n->acc |= acc;
+			return (TRUE);
+		}
+		level = end + 1;
+	}
+}
+
+/*
+ * Match a level against a pattern level containing %c and %u, which stand
+ * for clientid and username as in t_expand().
+ */
+static int level_matches(const char *pattern, const char *level, size_t len, const char *clientid, const char *username)
+{
+	const char *end = level + len;
+
+	for (; *pattern; pattern++) {
+		if (*pattern == '%' && (pattern[1] == 'c' || pattern[1] == 'u')) {
+			const char *s = (pattern[1] == 'c') ? clientid : username;
+			size_t slen = strlen(s);
+
+			if ((size_t)(end - level) < slen || memcmp(level, s, slen))
+				return (FALSE);
+			level += slen;
+			pattern++;
+			continue;
+		}
+		if (level == end || *level != *pattern)
+			return (FALSE);
+		level++;
+	}
+	return (level == end);
+}
+
+/*
+ * Match the levels of `topic' starting from node `n'; `topic' is NULL
+ * after the last level. As in mosquitto_topic_matches_sub(), "a/#" matches
+ * "a", and wildcards at the first level don't match topics starting
+ * with '$'.
+ */
+static int aclnode_match(struct aclnode *n, const char *topic, const char *clientid, const char *username, int access, int first)
+{
+	struct aclnode *c;
+	const char *end, *rest;
+	size_t len;
+	int dollar = first && topic && *topic == '$';
+
+	if ((n->hash_acc & access) && !dollar)
+		return (TRUE);
+	if (topic == NULL)
+		return ((n->acc & access) != 0);
+
+	end = strchr(topic, '/');
+	len = end ? (size_t)(end - topic) : strlen(topic);
+	rest = end ? end + 1 : NULL;
+
+	HASH_FIND(hh, n->literals, topic, len, c);
+	if (c && aclnode_match(c, rest, clientid, username, access, FALSE))
+		return (TRUE);
+
+	for (c = n->others; c; c = c->next) {
+		if (dollar && c->level[0] != '$')
+			continue;
+		if ((c->wild || level_matches(c->level, topic, len, clientid, username)) &&
+		    aclnode_match(c, rest, clientid, username, access, FALSE))
+			return (TRUE);
+	}
+	return (FALSE);
+}
+
+static void useracl_del(struct useracl **head, struct useracl *u)
+{
+	HASH_DEL(*head, u);
+	aclnode_free(u->acls);
+	free(u->username);
+	free(u);
+}
+
+/*
+ * Return the ACL patterns of `username', fetching them from the back-end
+ * if they are not cached or expired; NULL if the back-end can't give them.
+ */
+struct useracl *useracl_get(struct useracl **head, const char *username, time_t cacheseconds, f_aclfetch *aclfetch, void *conf)
+{
+	struct useracl *u;
+	struct aclpattern *patterns = NULL;
+	int i, npatterns = 0, ok;
+	time_t now = time(NULL);
+
+	/*
+	 * The hash iterates in insertion order: the expired users are at the
+	 * head, so the ones showing up once don't pile up.
+	 */
+	while ((u = *head) != NULL && now > u->seconds + cacheseconds) {
+		_log(DEBUG, " Cleanup ACLs of %s", u->username);
+		useracl_del(head, u);
+	}
+
+	HASH_FIND_STR(*head, username, u);
+	if (u != NULL)
+		return (u);
+
+	if ((u = (struct useracl *)malloc(sizeof(struct useracl))) == NULL)
+		return (NULL);
+	memset(u, 0, sizeof(struct useracl));
+	if (!aclfetch(conf, username, &u->superuser, &patterns, &npatterns)) {
+		free(u);
+		return (NULL);
+	}
+
+	/* Compile the patterns; as in the back-ends, empty ones are skipped */
+	ok = (u->username = strdup(username)) != NULL &&
+	     (u->acls = aclnode_new(NULL, 0)) != NULL;
+	for (i = 0; ok && i < npatterns; i++) {
+		if (*patterns[i].topic)
+			ok = aclnode_add(u->acls, patterns[i].topic, patterns[i].acc);
+	}
+	u->npatterns = npatterns;
+	aclpattern_free(patterns, npatterns);
+	if (!ok) {
+		aclnode_free(u->acls);
+		free(u->username);
+		free(u);
+		return (NULL);
+	}
+	u->seconds = now;
+	HASH_ADD_KEYPTR(hh, *head, u->username, strlen(u->username), u);
+	_log(DEBUG, " Fetched %d ACLs of %s (superuser=%d)", u->npatterns, username, u->superuser);
+
+	return (u);
+}
+
+/*
+ * Return TRUE if one of the patterns of `u' grants `access' to `topic'.
+ */
+int useracl_check(struct useracl *u, const char *clientid, const char *username, const char *topic, int access)
+{
+	return aclnode_match(u->acls, topic, clientid ? clientid : "", username ? username : "", access, TRUE);
+}
+
+void useracl_free_all(struct useracl **head)
+{
+	while (*head != NULL)
+		useracl_del(head, *head);
+}
+
+/*
+ * Credential cache.
+ */
+
+struct authcache *auth_cache_new(unsigned int capacity, time_t cacheseconds)
+{
+	struct authcache *cache;
+
+	if (capacity < 1 || (cache = calloc(1, sizeof(struct authcache))) == NULL)
+		return (NULL);
+	if (RAND_bytes(cache->key, sizeof(cache->key)) != 1) {
+		free(cache);
+		return (NULL);
+	}
+	cache->capacity = capacity;
+	cache->cacheseconds = cacheseconds;
+	return (cache);
+}
+
+static void auth_entry_del(struct authcache *cache, struct authcache_entry *e)
+{
+	HASH_DEL(cache->entries, e);
+	pbkdf2_hash_free(e->hash);
+	free(e->username);
+	memset(e, 0, sizeof(struct authcache_entry));
+	free(e);
+}
+
+void auth_cache_free(struct authcache *cache)
+{
+	if (cache == NULL)
+		return;
+	auth_cache_clear(cache);
+	memset(cache->key, 0, sizeof(cache->key));
+	free(cache);
+}
+
+void auth_cache_clear(struct authcache *cache)
+{
+	if (cache == NULL)
+		return;
+	while (cache->entries != NULL)
+		auth_entry_del(cache, cache->entries);
+}
+
+void auth_cache_stats(struct authcache *cache)
+{
+	if (cache == NULL)
+		return;
+	_log(LOG_NOTICE, "Credential cache: %u/%u entries, %lu hits, %lu misses, %lu evictions",
+		HASH_COUNT(cache->entries), cache->capacity,
+		cache->hits, cache->misses, cache->evictions);
+}
+
+static void auth_mac(struct authcache *cache, const char *data, unsigned char *mac)
+{
+	unsigned int maclen = AUTHCACHE_MACLEN;
+
+	if (HMAC(EVP_sha256(), cache->key, sizeof(cache->key),
+		 (const unsigned char *)data, strlen(data), mac, &maclen) == NULL)
+		memset(mac, 0, AUTHCACHE_MACLEN);
+}
+
+/* Compare two MACs in constant time */
+static int mac_equal(const unsigned char *a, const unsigned char *b)
+{
+	int i, diff = 0;
+
+	for (i = 0; i < AUTHCACHE_MACLEN; i++)
+		diff |= a[i] ^ b[i];
+	return (diff == 0);
+}
+
+/*
+ * Return the fresh entry of `username' for back-end `nord', or NULL. As
+ * for the ACLs, the hash iterates in insertion order and the expired
+ * entries are removed from its head.
+ */
+static struct authcache_entry *auth_entry_find(struct authcache *cache, const char *username, int nord)
+{
+	struct authcache_entry *e;
+	time_t now = time(NULL);
+	int n;
+
+	for (n = 0; n < EXPIRE_PER_OP && (e = cache->entries) != NULL &&
+	     now > e->seconds + cache->cacheseconds; n++)
+		auth_entry_del(cache, e);
+
+	HASH_FIND_STR(cache->entries, username, e);
+	if (e != NULL && now > e->seconds + cache->cacheseconds) {
+		auth_entry_del(cache, e);
+		e = NULL;
+	}
+	return (e != NULL && e->nord == nord) ? e : NULL;
+}
+
+/*
+ * Replace the entry of `username'; `hash' is owned by the cache from now
+ * on.
+ */
+static void auth_entry_add(struct authcache *cache, const char *username, const char *password, int nord, const char *phash, struct pbkdf2_hash *hash)
+{
+	struct authcache_entry *e;
+
+	HASH_FIND_STR(cache->entries, username, e);
+	if (e != NULL)
+		auth_entry_del(cache, e);
+	if (HASH_COUNT(cache->entries) >= cache->capacity) {
+		auth_entry_del(cache, cache->entries);
+		cache->evictions++;
+	}
+
+	if ((e = calloc(1, sizeof(struct authcache_entry))) == NULL ||
+	    (e->username = strdup(username)) == NULL) {
+		free(e);
+		pbkdf2_hash_free(hash);
+		return;
+	}
+	e->seconds = time(NULL);
+	e->nord = nord;
+	auth_mac(cache, password, e->pwmac);
+	if (phash != NULL)
+		auth_mac(cache, phash, e->hashmac);
+	e->hash = hash;
+	HASH_ADD_KEYPTR(hh, cache->entries, e->username, strlen(e->username), e);
+}
+
+/*
+ * Return TRUE if back-end `nord', which authenticates by itself, has
+ * recently accepted `password' for `username'.
+ */
+int auth_cache_q(struct authcache *cache, const char *username, const char *password, int nord)
+{
+	struct authcache_entry *e;
+	unsigned char mac[AUTHCACHE_MACLEN];
+
+	if (cache == NULL)
+		return (FALSE);
+	if ((e = auth_entry_find(cache, username, nord)) == NULL || e->hash != NULL)
+		return (FALSE);
+
+	auth_mac(cache, password, mac);
+	if (!mac_equal(mac, e->pwmac))
+		return (FALSE);
+	cache->hits++;
+	_log(DEBUG, " Cached authentication of %s", username);
+	return (TRUE);
+}
+
+/*
+ * Remember that back-end `nord' has authenticated `username' by itself.
+ */
+void auth_cache_add(struct authcache *cache, const char *username, const char *password, int nord)
+{
+	if (cache == NULL)
+		return;
+	cache->misses++;
+	auth_entry_add(cache, username, password, nord, NULL, NULL);
+}
+
+/*
+ * Check `password' against the PBKDF2 hash `phash' given by back-end
+ * `nord' for `username'. The key derivation is skipped if the same
+ * password was verified against the same hash recently, and the hash is
+ * parsed only when it changes.
+ */
+int auth_cache_check(struct authcache *cache, const char *username, const char *password, int nord, const char *phash)
+{
+	struct authcache_entry *e;
+	struct pbkdf2_hash *hash;
+	unsigned char mac[AUTHCACHE_MACLEN];
+	int match;
+
+	if (cache == NULL)
+		return pbkdf2_check((char *)password, (char *)phash);
+
+	if ((e = auth_entry_find(cache, username, nord)) != NULL && e->hash != NULL) {
+		auth_mac(cache, phash, mac);
+		if (mac_equal(mac, e->hashmac)) {
+			auth_mac(cache, password, mac);
+			if (mac_equal(mac, e->pwmac)) {
+				cache->hits++;
+				_log(DEBUG, " Cached authentication of %s", username);
+				return (TRUE);
+			}
+			/* Same hash, another password: the key must be derived */
+			return pbkdf2_verify(e->hash, password);
+		}
+		auth_entry_del(cache, e);
+	}
+
+	/* No entry, or the hash has changed in the back-end */
+	cache->misses++;
+	if ((hash = pbkdf2_parse(phash)) == NULL)
+		return (FALSE);
+	match = pbkdf2_verify(hash, password);
+	if (match)
+		auth_entry_add(cache, username, password, nord, phash, hash);
+	else
+		pbkdf2_hash_free(hash);
+	return (match);
+}
+
+/*
+ * Superuser cache.
+ */
+
+struct supercache *super_cache_new(unsigned int capacity, time_t cacheseconds, time_t negcacheseconds)
+{
+	struct supercache *cache;
+
+	if ((cache = (struct supercache *)malloc(sizeof(struct supercache))) == NULL)
+		return (NULL);
+	memset(cache, 0, sizeof(struct supercache));
+	cache->capacity = (capacity > 0) ? capacity : 1;
+	cache->cacheseconds = cacheseconds;
+	cache->negcacheseconds = negcacheseconds;
+	return (cache);
+}
+
+static void super_entry_del(struct supercache_entry **head, struct supercache_entry *e)
+{
+	HASH_DEL(*head, e);
+	free(e->username);
+	free(e);
+}
+
+void super_cache_clear(struct supercache *cache)
+{
+	if (cache == NULL)
+		return;
+	while (cache->yes != NULL)
+		super_entry_del(&cache->yes, cache->yes);
+	while (cache->no != NULL)
+		super_entry_del(&cache->no, cache->no);
+}
+
+void super_cache_free(struct supercache *cache)
+{
+	if (cache == NULL)
+		return;
+	super_cache_clear(cache);
+	free(cache);
+}
+
+void super_cache_stats(struct supercache *cache)
+{
+	if (cache == NULL)
+		return;
+	_log(LOG_NOTICE, "Superuser cache: %u+%u/%u entries, %lu hits, %lu misses, %lu evictions",
+		HASH_COUNT(cache->yes), HASH_COUNT(cache->no), cache->capacity,
+		cache->hits, cache->misses, cache->evictions);
+}
+
+/*
+ * Drop the expired entries from the head of a set, which iterates in
+ * insertion order.
+ */
+static void super_expire(struct supercache_entry **head, time_t now, time_t cacheseconds)
+{
+	while (*head != NULL && now > (*head)->seconds + cacheseconds)
+		super_entry_del(head, *head);
+}
+
+/*
+ * Return TRUE or FALSE if the superuser verdict of `username' is cached,
+ * -1 if the back-ends have to be asked.
+ */
+int super_cache_q(struct supercache *cache, const char *username)
+{
+	struct supercache_entry *e;
+	time_t now;
+
+	if (cache == NULL)
+		return (-1);
+
+	now = time(NULL);
+	super_expire(&cache->yes, now, cache->cacheseconds);
+	super_expire(&cache->no, now, cache->negcacheseconds);
+
+	HASH_FIND_STR(cache->yes, username, e);
+	if (e != NULL) {
+		cache->hits++;
+		return (TRUE);
+	}
+	HASH_FIND_STR(cache->no, username, e);
+	if (e != NULL) {
+		cache->hits++;
+		return (FALSE);
+	}
+	cache->misses++;
+	return (-1);
+}
+
+void super_cache_add(struct supercache *cache, const char *username, int superuser)
+{
+	struct supercache_entry **head, *e;
+
+	if (cache == NULL)
+		return;
+	head = (superuser) ? &cache->yes : &cache->no;
+	if (((superuser) ? cache->cacheseconds : cache->negcacheseconds) <= 0)
+		return;
+
+	HASH_FIND_STR(cache->yes, username, e);
+	if (e != NULL)
+		super_entry_del(&cache->yes, e);
+	HASH_FIND_STR(cache->no, username, e);
+	if (e != NULL)
+		super_entry_del(&cache->no, e);
+	if (HASH_COUNT(*head) >= cache->capacity) {
+		super_entry_del(head, *head);
+		cache->evictions++;
+	}
+
+	if ((e = (struct supercache_entry *)malloc(sizeof(struct supercache_entry))) == NULL)
+		return;
+	if ((e->username = strdup(username)) == NULL) {
+		free(e);
+		return;
+	}
+	e->seconds = time(NULL);
+	HASH_ADD_KEYPTR(hh, *head, e->username, strlen(e->username), e);
+	_log(DEBUG, " Cached superuser=%d for %s", superuser, username);
+}
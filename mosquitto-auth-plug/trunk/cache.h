@@ -27,20 +27,167 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdint.h>
 #include <time.h>
 #include "uthash.h"
-#include <openssl/sha.h>
+#include "backends.h"
+#include "pbkdf2-check.h"
 
 #ifndef __CACHE_H
 # define __CACHE_H
 
+/*
+ * Longest "clientid\0username\0topic" key which is cached; checks with
+ * longer keys always go to the back-ends.
+ */
+#define ACLCACHE_KEYLEN		(256)
+#define ACLCACHE_ENTRIES	(16384)
+
+struct aclcache_entry {
+	uint32_t hash;
+	int32_t next;			/* next entry in the bucket */
+	int32_t older, newer;		/* expiry list, by insertion time */
+	time_t seconds;
+	int granted;
+	int access;
+	unsigned int keylen;
+	char key[ACLCACHE_KEYLEN];
+};
+
+/*
+ * Fixed capacity ACL cache: entries live in a slab allocated at startup
+ * and are linked in insertion order, so that the oldest ones can be
+ * expired (or evicted, when the cache is full) without scanning. The
+ * denied checks are kept for the shorter negcacheseconds, in a list of
+ * their own, so that each list expires in insertion order.
+ */
+#define ACLCACHE_DENIED		(0)
+#define ACLCACHE_GRANTED	(1)
+
 struct aclcache {
-        char hex[SHA_DIGEST_LENGTH * 2 + 1];    /* key within struct */
-        int granted;
-        time_t seconds;
-        UT_hash_handle hh;
+	struct aclcache_entry *slab;
+	int32_t *buckets;
+	unsigned int capacity;
+	unsigned int nbuckets;		/* power of 2 */
+	unsigned int used;
+	int32_t free;			/* list of free entries */
+	int32_t oldest[2], newest[2];	/* expiry lists: ACLCACHE_DENIED, ACLCACHE_GRANTED */
+	time_t seconds[2];		/* how long the entries of each list are kept */
+	uint32_t seed;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long expirations;
+};
+
+struct aclcache *acl_cache_new(unsigned int capacity, time_t cacheseconds, time_t negcacheseconds);
+void acl_cache_free(struct aclcache *cache);
+void acl_cache_stats(struct aclcache *cache);
+void acl_cache_clear(struct aclcache *cache);
+
+/*
+ * Node of a trie of ACL patterns: one level of a pattern for each node.
+ * The levels "+" and those with %c or %u go in the `others' list, the
+ * literal ones in the `literals' hash; a "#" level sets `hash_acc' of its
+ * parent.
+ */
+struct aclnode {
+	char *level;
+	int wild;			/* level is "+" */
+	int acc;			/* access of the patterns ending here */
+	int hash_acc;			/* access of the patterns ending with "/#" here */
+	struct aclnode *literals;
+	struct aclnode *others;
+	struct aclnode *next;		/* in others */
+	UT_hash_handle hh;		/* in literals */
+};
+
+/*
+ * ACL patterns of a user, fetched with ->aclfetch() and kept for
+ * cacheseconds as a trie, so that the topics are matched without asking
+ * the back-end again, with a walk as deep as the topic.
+ */
+struct useracl {
+	char *username;			/* key */
+	time_t seconds;
+	int superuser;
+	int npatterns;
+	struct aclnode *acls;
+	UT_hash_handle hh;
 };
 
+struct useracl *useracl_get(struct useracl **head, const char *username, time_t cacheseconds, f_aclfetch *aclfetch, void *conf);
+int useracl_check(struct useracl *u, const char *clientid, const char *username, const char *topic, int access);
+void useracl_free_all(struct useracl **head);
+
+#define AUTHCACHE_ENTRIES	(4096)
+#define AUTHCACHE_MACLEN	(32)
+
+/*
+ * A successful verification of the password of a user. The password is
+ * never kept: only its MAC, with a key drawn at startup. The entry is
+ * valid for the back-end which authenticated the user and, if that
+ * back-end gave a PBKDF2 hash, for that same hash only.
+ */
+struct authcache_entry {
+	char *username;			/* key */
+	time_t seconds;
+	int nord;			/* back-end which authenticated the user */
+	unsigned char pwmac[AUTHCACHE_MACLEN];
+	unsigned char hashmac[AUTHCACHE_MACLEN];
+	struct pbkdf2_hash *hash;	/* NULL if the back-end authenticated itself */
+	UT_hash_handle hh;
+};
+
+struct authcache {
+	struct authcache_entry *entries;
+	unsigned int capacity;
+	time_t cacheseconds;
+	unsigned char key[AUTHCACHE_MACLEN];
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+struct authcache *auth_cache_new(unsigned int capacity, time_t cacheseconds);
+void auth_cache_free(struct authcache *cache);
+void auth_cache_stats(struct authcache *cache);
+void auth_cache_clear(struct authcache *cache);
+int auth_cache_q(struct authcache *cache, const char *username, const char *password, int nord);
+void auth_cache_add(struct authcache *cache, const char *username, const char *password, int nord);
+int auth_cache_check(struct authcache *cache, const char *username, const char *password, int nord, const char *phash);
+
+#define SUPERCACHE_ENTRIES	(4096)
+
+/*
+ * Superuser verdict of a user, whatever the topic. The users who are
+ * superusers and those who are not are kept apart, each set for its own
+ * number of seconds, so that both sets expire in insertion order.
+ */
+struct supercache_entry {
+	char *username;			/* key */
+	time_t seconds;
+	UT_hash_handle hh;
+};
+
+struct supercache {
+	struct supercache_entry *yes;	/* superusers */
+	struct supercache_entry *no;	/* not superusers, or unknown */
+	unsigned int capacity;		/* of each set */
+	time_t cacheseconds;
+	time_t negcacheseconds;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+struct supercache *super_cache_new(unsigned int capacity, time_t cacheseconds, time_t negcacheseconds);
+void super_cache_free(struct supercache *cache);
+void super_cache_stats(struct supercache *cache);
+void super_cache_clear(struct supercache *cache);
+int super_cache_q(struct supercache *cache, const char *username);
+void super_cache_add(struct supercache *cache, const char *username, int superuser);
+
 void acl_cache(const char *clientid, const char *username, const char *topic, int access, int granted, void *userdata);
 int cache_q(const char *clientid, const char *username, const char *topic, int access, void *userdata);
 
@@ -34,9 +34,8 @@
 #include <time.h>
 #include "log.h"
 
-void _log(int priority, const char *fmt, ...)
+void _log_printf(int priority, const char *fmt, ...)
 {
-  return;
 	va_list va;
 	time_t now;
 
@@ -55,6 +54,30 @@ void _log(int priority, const char *fmt, ...)
 	va_end(va);
 }	
 
+void _log_rate(struct lograte *rate, int priority, const char *fmt, ...)
+{
+	char msg[512];
+	va_list va;
+	time_t now = time(NULL);
+
+	if (rate->last != 0 && now >= rate->last && now < rate->last + LOGRATE_SECONDS) {
+		rate->skipped++;
+		return;
+	}
+
+	va_start(va, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, va);
+	va_end(va);
+
+	if (rate->skipped)
+		_log_printf(priority, "%s (%lu more in the last %ld s)", msg,
+			rate->skipped, (long)(now - rate->last));
+	else
+		_log_printf(priority, "%s", msg);
+	rate->last = now;
+	rate->skipped = 0;
+}
+
 void _fatal(const char *fmt, ...)
 {
 	va_list va;
@@ -27,8 +27,44 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <time.h>
+
+#ifndef __LOG_H
+# define __LOG_H
+
 #define LOG_DEBUG (1)
 #define LOG_NOTICE (2)
 
-void _log(int priority, const char *fmt, ...);
+void _log_printf(int priority, const char *fmt, ...);
+
+/*
+ * Debug messages are compiled only with -DDEBUG_LOG=1: otherwise the calls,
+ * and their arguments, are optimized away.
+ */
+#if DEBUG_LOG
+# define _log(priority, ...)	_log_printf((priority), __VA_ARGS__)
+#else
+# define _log(priority, ...)	do { \
+		if ((priority) != LOG_DEBUG) \
+			_log_printf((priority), __VA_ARGS__); \
+	} while (0)
+#endif
+
 void _fatal(const char *fmt, ...);
+
+/*
+ * Errors met on every request while a back-end is down are logged with
+ * _log_rate(): the first one, then at most one every LOGRATE_SECONDS,
+ * with the number of those left out. A struct lograte is used by a
+ * single thread at a time, e.g. it lives in a handle of a back-end.
+ */
+#define LOGRATE_SECONDS	(60)
+
+struct lograte {
+	time_t last;
+	unsigned long skipped;
+};
+
+void _log_rate(struct lograte *rate, int priority, const char *fmt, ...);
+
+#endif
@@ -32,6 +32,7 @@
 #include <string.h>
 #include <openssl/evp.h>
 #include "base64.h"
+#include "pbkdf2-check.h"
 
 #define SEPARATOR       "$"
 #define TRUE	(1)
@@ -78,34 +79,31 @@ static int detoken(char *pbkstr, char **sha, int *iter, char **salt, char **key)
 	return rc;
 }
 
-int pbkdf2_check(char *password, char *hash)
+struct pbkdf2_hash *pbkdf2_parse(const char *hash)
 {
-        static char *sha, *salt, *h_pw;
-        int iterations, saltlen, blen;
-	char *b64, *keybuf;
-	unsigned char *out;
-	int match = FALSE;
-	const EVP_MD *evpmd;
-	int keylen, rc;
+	struct pbkdf2_hash *h;
+	char *sha = NULL, *salt = NULL, *h_pw = NULL;
+	int iterations;
 
-        if (detoken(hash, &sha, &iterations, &salt, &h_pw) != 0)
-		return match;
+	if (detoken((char *)hash, &sha, &iterations, &salt, &h_pw) != 0)
+		goto fail;
 
-	/* Determine key length by decoding base64 */
-	if ((keybuf = malloc(strlen(h_pw) + 1)) == NULL) {
+	if ((h = calloc(1, sizeof(struct pbkdf2_hash))) == NULL) {
 		fprintf(stderr, "Out of memory\n");
-		return FALSE;
-	}
-	keylen = base64_decode(h_pw, keybuf);
-	if (keylen < 1) {
-		free(keybuf);
-		return (FALSE);
+		goto fail;
 	}
-	free(keybuf);
 
-	if ((out = malloc(keylen)) == NULL) {
-		fprintf(stderr, "Cannot allocate out; out of memory\n");
-		return (FALSE);
+	/* Decode the key once; its length is the length of the derived key */
+	if ((h->key = malloc(strlen(h_pw) + 1)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		free(h);
+		goto fail;
+	}
+	h->keylen = base64_decode(h_pw, h->key);
+	if (h->keylen < 1 || iterations < 1) {
+		free(h->key);
+		free(h);
+		goto fail;
 	}
 
 #ifdef PWDEBUG
@@ -113,50 +111,76 @@ int pbkdf2_check(char *password, char *hash)
 	fprintf(stderr, "iterations =%d\n", iterations);
 	fprintf(stderr, "salt       =[%s]\n", salt);
 	fprintf(stderr, "h_pw       =[%s]\n", h_pw);
-	fprintf(stderr, "kenlen     =[%d]\n", keylen);
+	fprintf(stderr, "kenlen     =[%d]\n", h->keylen);
 #endif
 
-	saltlen = strlen((char *)salt);
-
-	evpmd = EVP_sha256();
+	h->md = EVP_sha256();
 	if (strcmp(sha, "sha1") == 0) {
-		evpmd = EVP_sha1();
+		h->md = EVP_sha1();
 	} else if (strcmp(sha, "sha512") == 0) {
-		evpmd = EVP_sha512();
+		h->md = EVP_sha512();
+	}
+	h->iterations = iterations;
+	h->salt = salt;
+	h->saltlen = strlen(salt);
+
+	free(sha);
+	free(h_pw);
+	return (h);
+
+  fail:
+	free(sha);
+	free(salt);
+	free(h_pw);
+	return (NULL);
+}
+
+void pbkdf2_hash_free(struct pbkdf2_hash *h)
+{
+	if (h == NULL)
+		return;
+	free(h->salt);
+	free(h->key);
+	free(h);
+}
+
+int pbkdf2_verify(const struct pbkdf2_hash *h, const char *password)
+{
+	unsigned char *out;
+	int i, diff = 0, rc;
+
+	if ((out = malloc(h->keylen)) == NULL) {
+		fprintf(stderr, "Cannot allocate out; out of memory\n");
+		return (FALSE);
 	}
 
 	rc = PKCS5_PBKDF2_HMAC(password, strlen(password),
-                (unsigned char *)salt, saltlen,
-		iterations,
-		evpmd, keylen, out);
+		(unsigned char *)h->salt, h->saltlen,
+		h->iterations,
+		h->md, h->keylen, out);
 	if (rc != 1) {
-		goto out;
+		free(out);
+		return (FALSE);
 	}
 
-	blen = base64_encode(out, keylen, &b64);
-	if (blen > 0) {
-		int i, diff = 0, hlen = strlen(h_pw);
-#ifdef PWDEBUG
-		fprintf(stderr, "HMAC b64   =[%s]\n", b64);
-#endif
-		
-		/* "manual" strcmp() to ensure constant time */
-		for (i = 0; (i < blen) && (i < hlen); i++) {
-			diff |= h_pw[i] ^ b64[i];
-		}
-
-		match = diff == 0;
-		if (hlen != blen)
-			match = 0;
-
-		free(b64);
+	/* "manual" memcmp() on the decoded key to ensure constant time */
+	for (i = 0; i < h->keylen; i++) {
+		diff |= h->key[i] ^ out[i];
 	}
 
-  out:
-	free(sha);
-	free(salt);
-	free(h_pw);
 	free(out);
+	return (diff == 0);
+}
+
+int pbkdf2_check(char *password, char *hash)
+{
+	struct pbkdf2_hash *h;
+	int match;
+
+	if ((h = pbkdf2_parse(hash)) == NULL)
+		return (FALSE);
+	match = pbkdf2_verify(h, password);
+	pbkdf2_hash_free(h);
 
 	return match;
 }
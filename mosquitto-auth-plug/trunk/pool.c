@@ -0,0 +1,574 @@
+/*
+ * Copyright (c) 2014 Jan-Piet Mens <jpmens()gmail.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "pool.h"
+#include "backends.h"
+#include "log.h"
+
+#define POOL_GETUSER	(1)
+#define POOL_SUPERUSER	(2)
+#define POOL_ACLCHECK	(3)
+#define POOL_ACLFETCH	(4)
+
+static char *xstrdup(const char *s)
+{
+	return (s) ? strdup(s) : NULL;
+}
+
+static void job_free(struct pooljob *job)
+{
+	if (job->password)
+		memset(job->password, 0, strlen(job->password));
+	if (job->key)
+		memset(job->key, 0, job->keylen);
+	free(job->key);
+	free(job->clientid);
+	free(job->username);
+	free(job->password);
+	free(job->topic);
+	free(job->phash);
+	aclpattern_free(job->patterns, job->npatterns);
+	pthread_cond_destroy(&job->cond);
+	free(job);
+}
+
+/*
+ * Build the key "type\0nord\0clientid\0username\0password\0topic\0acc",
+ * which identifies the calls giving the same result.
+ */
+static char *job_key(int type, int nord, const char *clientid, const char *username, const char *password, const char *topic, int acc, unsigned int *keylen)
+{
+	const char *fields[4];
+	char *key, num[64];
+	size_t len;
+	int i, n;
+
+	fields[0] = clientid ? clientid : "";
+	fields[1] = username ? username : "";
+	fields[2] = password ? password : "";
+	fields[3] = topic ? topic : "";
+
+	n = snprintf(num, sizeof(num), "%d%c%d%c%d", type, 0, nord, 0, acc);
+	for (len = n + 1, i = 0; i < 4; i++)
+		len += strlen(fields[i]) + 1;
+	if ((key = malloc(len)) == NULL)
+		return (NULL);
+
+	memcpy(key, num, n + 1);
+	for (len = n + 1, i = 0; i < 4; i++) {
+		size_t flen = strlen(fields[i]) + 1;
+
+		memcpy(key + len, fields[i], flen);
+		len += flen;
+	}
+	*keylen = len;
+	return (key);
+}
+
+/* Drop a reference to a locked job, and unlock the pool */
+static void job_release(struct authpool *pool, struct pooljob *job)
+{
+	if (--job->refs == 0)
+		job_free(job);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Queue a call to back-end `pb', or join the same call if it is already
+ * in flight, and wait for its result at most `timeout_ms'. Returns the
+ * job with its result and the pool locked (release it with
+ * job_release()), or NULL if the back-end has not answered in time.
+ */
+static struct pooljob *pool_call(struct poolbe *pb, int type, const char *clientid, const char *username, const char *password, const char *topic, int acc)
+{
+	struct authpool *pool = pb->pool;
+	struct pooljob *job;
+	struct timespec deadline;
+	unsigned int keylen;
+	char *key;
+	int rc = 0;
+
+	if ((key = job_key(type, pb->nord, clientid, username, password, topic, acc, &keylen)) == NULL)
+		return (NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += pool->timeout_ms / 1000;
+	deadline.tv_nsec += (long)(pool->timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->calls++;
+
+	/*
+	 * While a call to this back-end is stuck past its deadline, don't
+	 * make the broker wait for the next ones too.
+	 */
+	if (pb->late > 0) {
+		pool->rejected++;
+		pthread_mutex_unlock(&pool->mutex);
+		free(key);
+		return (NULL);
+	}
+
+	HASH_FIND(hh, pool->inflight, key, keylen, job);
+	if (job != NULL) {
+		pool->coalesced++;
+		memset(key, 0, keylen);
+		free(key);
+	} else {
+		if ((job = calloc(1, sizeof(struct pooljob))) == NULL) {
+			pthread_mutex_unlock(&pool->mutex);
+			free(key);
+			return (NULL);
+		}
+		job->key = key;
+		job->keylen = keylen;
+		job->type = type;
+		job->nord = pb->nord;
+		job->clientid = xstrdup(clientid);
+		job->username = xstrdup(username);
+		job->password = xstrdup(password);
+		job->topic = xstrdup(topic);
+		job->acc = acc;
+		job->refs = 1;			/* the worker's */
+		pthread_cond_init(&job->cond, &pool->condattr);
+
+		HASH_ADD_KEYPTR(hh, pool->inflight, job->key, job->keylen, job);
+		if (pool->tail)
+			pool->tail->next = job;
+		else
+			pool->head = job;
+		pool->tail = job;
+		pthread_cond_signal(&pool->cond);
+	}
+	job->refs++;
+
+	while (!job->done && rc != ETIMEDOUT)
+		rc = pthread_cond_timedwait(&job->cond, &pool->mutex, &deadline);
+	if (job->done)
+		return (job);
+
+	pool->timeouts++;
+	if (!job->late) {
+		job->late = TRUE;
+		pb->late++;
+	}
+	/* Under the mutex, as the callers may be more than one thread */
+	_log_rate(&pb->latelog, LOG_NOTICE, "back-end %s has not answered in %d ms", pb->be.name, pool->timeout_ms);
+	job_release(pool, job);
+	return (NULL);
+}
+
+static void job_run(struct poolworker *w, struct pooljob *job)
+{
+	struct backend_p *b = &w->pool->backends[job->nord].be;
+	void *conf = w->confs[job->nord];
+
+	switch (job->type) {
+		case POOL_GETUSER:
+			job->rc = FALSE;
+			job->phash = b->getuser(conf, job->username, job->password, &job->rc);
+			break;
+		case POOL_SUPERUSER:
+			job->rc = b->superuser(conf, job->username);
+			break;
+		case POOL_ACLCHECK:
+			job->rc = b->aclcheck(conf, job->clientid, job->username, job->topic, job->acc);
+			break;
+		case POOL_ACLFETCH:
+			job->rc = b->aclfetch(conf, job->username, &job->superuser, &job->patterns, &job->npatterns);
+			break;
+	}
+}
+
+/*
+ * Call the ->thread_start() or ->thread_stop() hooks of the back-ends
+ * with the handles of a worker, from its thread.
+ */
+static void worker_hooks(struct poolworker *w, int start)
+{
+	struct authpool *pool = w->pool;
+	int n;
+
+	for (n = 0; n < pool->nbackends; n++) {
+		struct backend_p *b = &pool->backends[n].be;
+		f_thread *hook = start ? b->thread_start : b->thread_stop;
+
+		if (hook && w->confs[n])
+			hook(w->confs[n]);
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct poolworker *w = (struct poolworker *)arg;
+	struct authpool *pool = w->pool;
+	struct pooljob *job;
+
+	worker_hooks(w, TRUE);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (!pool->stop) {
+		if (w->reload) {
+			unsigned int reload = w->reload;
+			int n;
+
+			w->reload = 0;
+			pthread_mutex_unlock(&pool->mutex);
+			for (n = 0; n < pool->nbackends; n++) {
+				if ((reload & (1U << n)) && w->confs[n])
+					pool->backends[n].be.reload(w->confs[n]);
+			}
+			pthread_mutex_lock(&pool->mutex);
+			continue;
+		}
+		if ((job = pool->head) == NULL) {
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+			continue;
+		}
+		if ((pool->head = job->next) == NULL)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->mutex);
+
+		job_run(w, job);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (pool->backends[job->nord].be.netstats)
+			pool->backends[job->nord].be.netstats(w->confs[job->nord], &pool->backends[job->nord].net);
+		job->done = TRUE;
+		HASH_DELETE(hh, pool->inflight, job);
+		if (job->late)
+			pool->backends[job->nord].late--;
+		pthread_cond_broadcast(&job->cond);
+		if (--job->refs == 0)
+			job_free(job);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	worker_hooks(w, FALSE);
+
+	return (NULL);
+}
+
+/*
+ * The functions which replace those of the back-ends: `conf' is the
+ * struct poolbe of the back-end. Authentication and superuser checks fail
+ * when the back-end doesn't answer in time; ACL checks fail, or succeed
+ * with `failopen'.
+ */
+
+static char *pool_getuser(void *conf, const char *username, const char *password, int *authenticated)
+{
+	struct poolbe *pb = (struct poolbe *)conf;
+	struct pooljob *job;
+	char *phash;
+
+	if ((job = pool_call(pb, POOL_GETUSER, NULL, username, password, NULL, 0)) == NULL)
+		return (NULL);
+	*authenticated = job->rc;
+	phash = xstrdup(job->phash);
+	job_release(pb->pool, job);
+	return (phash);
+}
+
+static int pool_superuser(void *conf, const char *username)
+{
+	struct poolbe *pb = (struct poolbe *)conf;
+	struct pooljob *job;
+	int rc;
+
+	if ((job = pool_call(pb, POOL_SUPERUSER, NULL, username, NULL, NULL, 0)) == NULL)
+		return (FALSE);
+	rc = job->rc;
+	job_release(pb->pool, job);
+	return (rc);
+}
+
+static int pool_aclcheck(void *conf, const char *clientid, const char *username, const char *topic, int acc)
+{
+	struct poolbe *pb = (struct poolbe *)conf;
+	struct pooljob *job;
+	int rc;
+
+	if ((job = pool_call(pb, POOL_ACLCHECK, clientid, username, NULL, topic, acc)) == NULL)
+		return (pb->pool->failopen) ? TRUE : FALSE;
+	rc = job->rc;
+	job_release(pb->pool, job);
+	return (rc);
+}
+
+static int pool_aclfetch(void *conf, const char *username, int *superuser, struct aclpattern **patterns, int *npatterns)
+{
+	struct poolbe *pb = (struct poolbe *)conf;
+	struct pooljob *job;
+	int i, rc;
+
+	if ((job = pool_call(pb, POOL_ACLFETCH, NULL, username, NULL, NULL, 0)) == NULL)
+		return (FALSE);
+
+	/* The callers of a shared job get a copy each */
+	rc = job->rc;
+	*superuser = job->superuser;
+	*patterns = NULL;
+	*npatterns = 0;
+	for (i = 0; rc && i < job->npatterns; i++) {
+		if (!aclpattern_add(patterns, npatterns, job->patterns[i].topic, job->patterns[i].acc)) {
+			aclpattern_free(*patterns, *npatterns);
+			*patterns = NULL;
+			*npatterns = 0;
+			rc = FALSE;
+		}
+	}
+	job_release(pb->pool, job);
+	return (rc);
+}
+
+/*
+ * Each worker reloads its own handle, before its next job; the original
+ * handle, still used by psk, is reloaded here.
+ */
+static int pool_reload(void *conf)
+{
+	struct poolbe *pb = (struct poolbe *)conf;
+	struct authpool *pool = pb->pool;
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (i = 0; i < pool->nworkers; i++)
+		pool->workers[i].reload |= 1U << pb->nord;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return pb->be.reload(pb->be.conf);
+}
+
+/* The counters of the workers' handles, collected after each job */
+static void pool_netstats(void *conf, struct netstats *ns)
+{
+	struct poolbe *pb = (struct poolbe *)conf;
+
+	pthread_mutex_lock(&pb->pool->mutex);
+	stats_netmove(ns, &pb->net);
+	pthread_mutex_unlock(&pb->pool->mutex);
+}
+
+/*
+ * Stop the workers, once: when this returns none of them uses its
+ * handles any more.
+ */
+static void pool_stop(struct authpool *pool)
+{
+	int i, stop;
+
+	pthread_mutex_lock(&pool->mutex);
+	stop = pool->stop;
+	pool->stop = TRUE;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (stop)
+		return;
+	for (i = 0; i < pool->nworkers; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+}
+
+/*
+ * Close the handles of the workers to this back-end, and the original
+ * one: the workers are stopped first, as they can't work without it.
+ */
+static void pool_kill(void *conf)
+{
+	struct poolbe *pb = (struct poolbe *)conf;
+	struct authpool *pool = pb->pool;
+	int i;
+
+	pool_stop(pool);
+	if (pb->be.kill == NULL)
+		return;
+	for (i = 0; i < pool->nworkers; i++) {
+		void **confp = &pool->workers[i].confs[pb->nord];
+
+		if (*confp) {
+			pb->be.kill(*confp);
+			*confp = NULL;
+		}
+	}
+	pb->be.kill(pb->be.conf);
+	pb->be.conf = NULL;
+}
+
+/*
+ * Start `nworkers' workers, each one with a new handle to every back-end,
+ * and route the calls to the back-ends in `be_list' through them. The
+ * back-ends which can't create more handles (psk) are left as they are.
+ */
+struct authpool *authpool_new(struct backend_p **be_list, int nworkers, int timeout_ms, int failopen)
+{
+	struct authpool *pool;
+	struct backend_p **bep;
+	int i, n;
+
+	if (nworkers < 1 || (pool = calloc(1, sizeof(struct authpool))) == NULL)
+		return (NULL);
+
+	for (bep = be_list; bep && *bep; bep++)
+		pool->nbackends++;
+	pool->nworkers = nworkers;
+	pool->timeout_ms = (timeout_ms > 0) ? timeout_ms : 1;
+	pool->failopen = failopen;
+	pool->backends = calloc(pool->nbackends, sizeof(struct poolbe));
+	pool->workers = calloc(nworkers, sizeof(struct poolworker));
+	if (pool->backends == NULL || pool->workers == NULL) {
+		free(pool->backends);
+		free(pool->workers);
+		free(pool);
+		return (NULL);
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_condattr_init(&pool->condattr);
+	pthread_condattr_setclock(&pool->condattr, CLOCK_MONOTONIC);
+
+	for (n = 0; n < pool->nbackends; n++) {
+		pool->backends[n].pool = pool;
+		pool->backends[n].nord = n;
+		pool->backends[n].be = *be_list[n];
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		struct poolworker *w = &pool->workers[i];
+
+		w->pool = pool;
+		if ((w->confs = calloc(pool->nbackends, sizeof(void *))) == NULL)
+			_fatal("Out of memory for the auth workers");
+		for (n = 0; n < pool->nbackends; n++) {
+			struct backend_p *b = &pool->backends[n].be;
+
+			if (b->init == NULL)
+				continue;
+			if ((w->confs[n] = b->init()) == NULL)
+				_fatal("%s init returns NULL for worker %d", b->name, i);
+		}
+		if (pthread_create(&w->thread, NULL, worker, w) != 0)
+			_fatal("Cannot start auth worker %d", i);
+	}
+
+	for (n = 0; n < pool->nbackends; n++) {
+		struct backend_p *b = be_list[n];
+
+		if (b->init == NULL)
+			continue;
+		b->conf = &pool->backends[n];
+		b->kill = pool_kill;
+		b->getuser = pool_getuser;
+		b->superuser = pool_superuser;
+		b->aclcheck = pool_aclcheck;
+		b->aclfetch = (b->aclfetch) ? pool_aclfetch : NULL;
+		b->reload = (b->reload) ? pool_reload : NULL;
+		b->netstats = (b->netstats) ? pool_netstats : NULL;
+	}
+
+	_log(LOG_NOTICE, "Started %d auth workers, deadline %d ms, %s",
+		nworkers, pool->timeout_ms, failopen ? "fail-open" : "fail-closed");
+	return (pool);
+}
+
+/*
+ * Stop the workers and close the handles not closed by ->kill() yet; the
+ * back-ends of the list given to authpool_new() can't be used any more.
+ */
+void authpool_free(struct authpool *pool)
+{
+	struct pooljob *job;
+	int i, n;
+
+	if (pool == NULL)
+		return;
+
+	pool_stop(pool);
+
+	for (i = 0; i < pool->nworkers; i++) {
+		struct poolworker *w = &pool->workers[i];
+
+		for (n = 0; n < pool->nbackends; n++) {
+			if (w->confs[n] && pool->backends[n].be.kill)
+				pool->backends[n].be.kill(w->confs[n]);
+		}
+		free(w->confs);
+	}
+
+	/* Nobody waits for the jobs left in the queue */
+	while ((job = pool->head) != NULL) {
+		pool->head = job->next;
+		HASH_DELETE(hh, pool->inflight, job);
+		job_free(job);
+	}
+
+	pthread_condattr_destroy(&pool->condattr);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->workers);
+	free(pool->backends);
+	free(pool);
+}
+
+void authpool_stats(struct authpool *pool)
+{
+	if (pool == NULL)
+		return;
+	pthread_mutex_lock(&pool->mutex);
+	_log(LOG_NOTICE, "Auth workers: %lu calls, %lu coalesced, %lu timeouts, %lu rejected",
+		pool->calls, pool->coalesced, pool->timeouts, pool->rejected);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Number of calls which have not been answered by the back-ends: the
+ * results given in their place must not be cached.
+ */
+unsigned long authpool_failures(struct authpool *pool)
+{
+	unsigned long n;
+
+	if (pool == NULL)
+		return (0);
+	pthread_mutex_lock(&pool->mutex);
+	n = pool->timeouts + pool->rejected;
+	pthread_mutex_unlock(&pool->mutex);
+	return (n);
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2014 Jan-Piet Mens <jpmens()gmail.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include "uthash.h"
+#include "backends.h"
+#include "stats.h"
+#include "log.h"
+
+#ifndef __POOL_H
+# define __POOL_H
+
+/*
+ * A call to a back-end, run by a worker. Concurrent calls with the same
+ * arguments share the same job.
+ */
+struct pooljob {
+	char *key;			/* type, back-end and arguments */
+	unsigned int keylen;
+	int type;
+	int nord;
+	char *clientid;
+	char *username;
+	char *password;
+	char *topic;
+	int acc;
+	int done;
+	int refs;			/* waiting callers, plus the worker */
+	int late;			/* a caller has given up waiting */
+	pthread_cond_t cond;
+	/* results */
+	int rc;
+	char *phash;
+	int superuser;
+	struct aclpattern *patterns;
+	int npatterns;
+	struct pooljob *next;		/* in the queue */
+	UT_hash_handle hh;		/* in the jobs in flight */
+};
+
+/* A back-end, as seen by the workers */
+struct poolbe {
+	struct authpool *pool;
+	int nord;
+	int late;			/* jobs in flight past the deadline */
+	struct netstats net;		/* collected from the workers' handles */
+	struct lograte latelog;		/* "has not answered" messages */
+	struct backend_p be;		/* the original functions */
+};
+
+struct poolworker {
+	struct authpool *pool;
+	pthread_t thread;
+	void **confs;			/* per back-end */
+	unsigned int reload;		/* back-ends to reload, a bit each */
+};
+
+/*
+ * Workers running the back-end calls, each one with its own handles to
+ * the back-ends, so that the broker waits at most `timeout_ms' for a
+ * back-end which is slow or down.
+ */
+struct authpool {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;		/* jobs queued, or stopping */
+	pthread_condattr_t condattr;	/* of the jobs: monotonic clock */
+	struct poolworker *workers;
+	int nworkers;
+	int nbackends;
+	struct poolbe *backends;
+	int timeout_ms;
+	int failopen;
+	int stop;
+	struct pooljob *head, *tail;	/* queue */
+	struct pooljob *inflight;
+	unsigned long calls;
+	unsigned long coalesced;
+	unsigned long timeouts;
+	unsigned long rejected;
+};
+
+struct authpool *authpool_new(struct backend_p **be_list, int nworkers, int timeout_ms, int failopen);
+void authpool_free(struct authpool *pool);
+void authpool_stats(struct authpool *pool);
+unsigned long authpool_failures(struct authpool *pool);
+
+#endif
@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2014 Jan-Piet Mens <jpmens()gmail.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "userdata.h"
+#include "stats.h"
+
+struct authstats *stats_new(struct backend_p **be_list, const char *file, const char *prefix, time_t seconds)
+{
+	struct authstats *stats;
+	struct backend_p **bep;
+	int n;
+
+	if ((stats = (struct authstats *)malloc(sizeof(struct authstats))) == NULL)
+		return (NULL);
+	memset(stats, 0, sizeof(struct authstats));
+
+	for (bep = be_list; bep && *bep; bep++)
+		stats->nbackends++;
+	stats->be = (struct bestats *)calloc(stats->nbackends + 1, sizeof(struct bestats));
+	stats->file = (file) ? strdup(file) : NULL;
+	stats->prefix = strdup(prefix);
+	if (stats->be == NULL || (file && stats->file == NULL) || stats->prefix == NULL) {
+		stats_free(stats);
+		return (NULL);
+	}
+	for (n = 0; n < stats->nbackends; n++)
+		stats->be[n].name = be_list[n]->name;
+
+	stats->seconds = seconds;
+	stats->started = stats->written = time(NULL);
+	return (stats);
+}
+
+void stats_free(struct authstats *stats)
+{
+	if (stats == NULL)
+		return;
+	free(stats->be);
+	free(stats->file);
+	free(stats->prefix);
+	free(stats);
+}
+
+double stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static int bucket(unsigned long us)
+{
+	int e = 0, i;
+
+	if (us < 4)
+		return (us);
+	while ((us >> e) > 1)
+		e++;
+	i = 4 * (e - 1) + ((us >> (e - 2)) & 3);
+	return (i < STATS_BUCKETS) ? i : STATS_BUCKETS - 1;
+}
+
+/* Lower bound of bucket `i', in microseconds */
+static double bucket_low(int i)
+{
+	if (i < 4)
+		return (i);
+	return (double)((4UL + i % 4) << (i / 4 - 1));
+}
+
+void stats_add(struct histogram *h, double seconds)
+{
+	unsigned long us = (seconds > 0) ? (unsigned long)(seconds * 1e6) : 0;
+
+	h->buckets[bucket(us)]++;
+	h->count++;
+	h->seconds += seconds;
+}
+
+static void merge(struct histogram *to, struct histogram *from)
+{
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+	to->count += from->count;
+	to->seconds += from->seconds;
+}
+
+/*
+ * Add the counters of `from' to `to', and reset them.
+ */
+void stats_netmove(struct netstats *to, struct netstats *from)
+{
+	to->requests += from->requests;
+	to->failures += from->failures;
+	to->connects += from->connects;
+	merge(&to->connect, &from->connect);
+	merge(&to->request, &from->request);
+	memset(from, 0, sizeof(struct netstats));
+}
+
+/*
+ * Estimate the quantile `q' of a histogram, in seconds, assuming that the
+ * values are spread evenly in their bucket.
+ */
+double stats_quantile(struct histogram *h, double q)
+{
+	double rank = q * h->count, seen = 0, lo, hi;
+	int i;
+
+	if (h->count == 0)
+		return (0);
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		if (seen + h->buckets[i] >= rank && h->buckets[i] > 0)
+			break;
+		seen += h->buckets[i];
+	}
+	if (i == STATS_BUCKETS)
+		i--;
+	lo = bucket_low(i);
+	if (i == STATS_BUCKETS - 1)
+		return (lo / 1e6);
+	hi = bucket_low(i + 1);
+	return ((lo + (hi - lo) * (rank - seen) / h->buckets[i]) / 1e6);
+}
+
+void stats_call(struct authstats *stats, int nord, int op, double start, int failed)
+{
+	struct bestats *be;
+
+	if (stats == NULL || nord < 0 || nord >= stats->nbackends)
+		return;
+	be = &stats->be[nord];
+	be->calls[op]++;
+	if (failed)
+		be->errors++;
+	stats_add(&be->latency, stats_now() - start);
+}
+
+static void write_histogram(FILE *fp, const char *prefix, const char *name, struct histogram *h)
+{
+	fprintf(fp, "%s/%s/count %lu\n", prefix, name, h->count);
+	fprintf(fp, "%s/%s/mean_ms %.3f\n", prefix, name, (h->count) ? h->seconds * 1e3 / h->count : 0.0);
+	fprintf(fp, "%s/%s/p50_ms %.3f\n", prefix, name, stats_quantile(h, 0.50) * 1e3);
+	fprintf(fp, "%s/%s/p99_ms %.3f\n", prefix, name, stats_quantile(h, 0.99) * 1e3);
+}
+
+/*
+ * Write the stats to a temporary file, renamed over the old one, so that
+ * readers never see a partial file.
+ */
+void stats_write(struct authstats *stats, struct userdata *ud)
+{
+	const char *p;
+	char *tmp, name[128];
+	FILE *fp;
+	int n;
+
+	if (stats == NULL)
+		return;
+	stats->written = time(NULL);
+	if (stats->file == NULL)
+		return;
+
+	if ((tmp = (char *)malloc(strlen(stats->file) + 5)) == NULL)
+		return;
+	sprintf(tmp, "%s.tmp", stats->file);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		_log(LOG_NOTICE, "stats: can't write %s", tmp);
+		free(tmp);
+		return;
+	}
+
+	p = stats->prefix;
+	fprintf(fp, "%s/uptime %ld\n", p, (long)(stats->written - stats->started));
+	fprintf(fp, "%s/auth/ok %lu\n", p, stats->auth_ok);
+	fprintf(fp, "%s/auth/fail %lu\n", p, stats->auth_fail);
+	write_histogram(fp, p, "auth/latency", &stats->auth);
+	write_histogram(fp, p, "auth/pbkdf2", &stats->pbkdf2);
+	fprintf(fp, "%s/acl/granted %lu\n", p, stats->acl_granted);
+	fprintf(fp, "%s/acl/denied %lu\n", p, stats->acl_denied);
+	write_histogram(fp, p, "acl/latency", &stats->acl);
+
+	if (ud->aclcache) {
+		struct aclcache *c = ud->aclcache;
+
+		fprintf(fp, "%s/cache/acl/entries %u\n", p, c->used);
+		fprintf(fp, "%s/cache/acl/hits %lu\n", p, c->hits);
+		fprintf(fp, "%s/cache/acl/misses %lu\n", p, c->misses);
+		fprintf(fp, "%s/cache/acl/expirations %lu\n", p, c->expirations);
+		fprintf(fp, "%s/cache/acl/evictions %lu\n", p, c->evictions);
+	}
+	if (ud->authcache) {
+		struct authcache *c = ud->authcache;
+
+		fprintf(fp, "%s/cache/auth/entries %u\n", p, HASH_COUNT(c->entries));
+		fprintf(fp, "%s/cache/auth/hits %lu\n", p, c->hits);
+		fprintf(fp, "%s/cache/auth/misses %lu\n", p, c->misses);
+		fprintf(fp, "%s/cache/auth/evictions %lu\n", p, c->evictions);
+	}
+	if (ud->supercache) {
+		struct supercache *c = ud->supercache;
+
+		fprintf(fp, "%s/cache/super/entries %u\n", p, HASH_COUNT(c->yes) + HASH_COUNT(c->no));
+		fprintf(fp, "%s/cache/super/hits %lu\n", p, c->hits);
+		fprintf(fp, "%s/cache/super/misses %lu\n", p, c->misses);
+		fprintf(fp, "%s/cache/super/evictions %lu\n", p, c->evictions);
+	}
+	if (ud->pool) {
+		struct authpool *pool = ud->pool;
+
+		pthread_mutex_lock(&pool->mutex);
+		fprintf(fp, "%s/pool/calls %lu\n", p, pool->calls);
+		fprintf(fp, "%s/pool/coalesced %lu\n", p, pool->coalesced);
+		fprintf(fp, "%s/pool/timeouts %lu\n", p, pool->timeouts);
+		fprintf(fp, "%s/pool/rejected %lu\n", p, pool->rejected);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	for (n = 0; n < stats->nbackends; n++) {
+		struct bestats *be = &stats->be[n];
+		struct backend_p *b = ud->be_list[n];
+
+		fprintf(fp, "%s/backend/%s/getuser %lu\n", p, be->name, be->calls[STATS_GETUSER]);
+		fprintf(fp, "%s/backend/%s/superuser %lu\n", p, be->name, be->calls[STATS_SUPERUSER]);
+		fprintf(fp, "%s/backend/%s/aclcheck %lu\n", p, be->name, be->calls[STATS_ACLCHECK]);
+		fprintf(fp, "%s/backend/%s/errors %lu\n", p, be->name, be->errors);
+		snprintf(name, sizeof(name), "backend/%s/latency", be->name);
+		write_histogram(fp, p, name, &be->latency);
+
+		if (b->netstats == NULL)
+			continue;
+		b->netstats(b->conf, &be->net);
+		fprintf(fp, "%s/backend/%s/requests %lu\n", p, be->name, be->net.requests);
+		fprintf(fp, "%s/backend/%s/failures %lu\n", p, be->name, be->net.failures);
+		fprintf(fp, "%s/backend/%s/connects %lu\n", p, be->name, be->net.connects);
+		snprintf(name, sizeof(name), "backend/%s/connect", be->name);
+		write_histogram(fp, p, name, &be->net.connect);
+		snprintf(name, sizeof(name), "backend/%s/request", be->name);
+		write_histogram(fp, p, name, &be->net.request);
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, stats->file) != 0) {
+		_log(LOG_NOTICE, "stats: can't write %s", stats->file);
+		unlink(tmp);
+	}
+	free(tmp);
+}
+
+/*
+ * Called at the end of each check: write the stats if they are due.
+ */
+void stats_tick(struct authstats *stats, struct userdata *ud)
+{
+	if (stats == NULL || stats->seconds <= 0)
+		return;
+	if (time(NULL) - stats->written >= stats->seconds)
+		stats_write(stats, ud);
+}
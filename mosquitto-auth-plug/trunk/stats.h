@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2014 Jan-Piet Mens <jpmens()gmail.com>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "backends.h"
+
+#ifndef __STATS_H
+# define __STATS_H
+
+/*
+ * Buckets of microseconds: 1us wide up to 4us, then four for each power of
+ * 2 (so the quantiles are within 25%), the last one from 7 * 2^20us (7s).
+ */
+#define STATS_BUCKETS	(88)
+
+struct histogram {
+	unsigned long count;
+	double seconds;			/* sum */
+	unsigned long buckets[STATS_BUCKETS];
+};
+
+#define STATS_GETUSER	(0)
+#define STATS_SUPERUSER	(1)
+#define STATS_ACLCHECK	(2)
+#define STATS_NOPS	(3)
+
+/* Requests of a back-end to its server, collected by ->netstats() */
+struct netstats {
+	unsigned long requests;
+	unsigned long failures;		/* no answer from the server */
+	unsigned long connects;		/* new connections */
+	struct histogram connect;	/* time to connect */
+	struct histogram request;	/* time of the requests */
+};
+
+/* Calls of the plugin to a back-end, whether by itself or in the pool */
+struct bestats {
+	const char *name;
+	unsigned long calls[STATS_NOPS];
+	unsigned long errors;		/* no answer from the pool in time */
+	struct histogram latency;
+	struct netstats net;
+};
+
+/*
+ * Counters of the plugin, updated by the broker thread only, and written
+ * every `seconds' to `file' as "<prefix>/<name> <value>" lines, one per
+ * metric, like the $SYS topics of the broker.
+ */
+struct authstats {
+	char *file;
+	char *prefix;
+	time_t seconds;
+	time_t started;
+	time_t written;
+	unsigned long auth_ok;
+	unsigned long auth_fail;
+	unsigned long acl_granted;
+	unsigned long acl_denied;
+	struct histogram auth;		/* time in unpwd_check */
+	struct histogram acl;		/* time in acl_check */
+	struct histogram pbkdf2;	/* key derivations */
+	int nbackends;
+	struct bestats *be;
+};
+
+struct userdata;
+
+struct authstats *stats_new(struct backend_p **be_list, const char *file, const char *prefix, time_t seconds);
+void stats_free(struct authstats *stats);
+double stats_now(void);
+void stats_add(struct histogram *h, double seconds);
+void stats_netmove(struct netstats *to, struct netstats *from);
+double stats_quantile(struct histogram *h, double q);
+void stats_call(struct authstats *stats, int nord, int op, double start, int failed);
+void stats_write(struct authstats *stats, struct userdata *ud);
+void stats_tick(struct authstats *stats, struct userdata *ud);
+
+#endif
@@ -30,18 +30,31 @@
 #include <time.h>
 #include "backends.h"
 #include "cache.h"
+#include "pool.h"
+#include "stats.h"
 
 #ifndef __USERDATA_H
 # define _USERDATA_H
 
+#define GLOB_FNMATCH	(0)		/* anything else */
+#define GLOB_LITERAL	(1)		/* "name" */
+#define GLOB_PREFIX	(2)		/* "name*" */
+#define GLOB_SUFFIX	(3)		/* "*name" */
+
 struct userdata {
 	struct backend_p **be_list;
 	char *superusers;		/* Static glob list */
+	int superglob;			/* how superusers is matched: GLOB_* */
+	size_t superlen;		/* length of its literal part */
 	int authentication_be;		/* Back-end number user was authenticated in */
 	int fallback_be;		/* Backend to use for anonymous connections */
 	char *anonusername;		/* Configured name of anonymous MQTT user */
 	time_t cacheseconds;		/* number of seconds to cache ACL lookups */
 	struct aclcache *aclcache;
+	struct authcache *authcache;	/* successful password verifications */
+	struct supercache *supercache;	/* superuser verdicts, per user */
+	struct authpool *pool;		/* workers calling the back-ends, or NULL */
+	struct authstats *stats;	/* counters and latencies */
 };
 
 #endif
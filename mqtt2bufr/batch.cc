@@ -0,0 +1,87 @@
+/*
+ * batch - Group messages in BUFR bulletins
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "batch.h"
+
+#include <iostream>
+
+namespace mqtt2bufr {
+
+Batch::Key Batch::key(const dballe::Msg& msg) {
+    std::string station;
+    if (const dballe::msg::Context* ctx = msg.find_station_context()) {
+        static const wreport::Varcode codes[] = {
+            WR_VAR(0, 1, 11), WR_VAR(0, 6,  1), WR_VAR(0, 5,  1), WR_VAR(0, 1,194),
+        };
+        for (const auto code: codes) {
+            if (const wreport::Var* v = ctx->find(code))
+                station += v->format("-");
+            else
+                station += "-";
+            station += "/";
+        }
+    }
+    return Key(station, msg.get_datetime());
+}
+
+void Batch::add(const dballe::Msg& msg) {
+    auto res = index.insert(std::make_pair(key(msg), msgs.size()));
+    if (res.second) {
+        msgs.push_back(msg);
+    } else {
+        // Same station and datetime: merge the contexts
+        dballe::Msg& dest = msgs[res.first->second];
+        for (const auto& ctx: msg.data)
+            for (const auto& var: ctx->data)
+                dest.set(*var, var->code(), ctx->level, ctx->trange);
+    }
+    ++count;
+}
+
+bool Batch::flush(std::ostream& out) {
+    std::string buf;
+    bool ok = flush(buf);
+    out.write(buf.data(), buf.size());
+    out.flush();
+    return ok;
+}
+
+bool Batch::flush(std::string& buf) {
+    bool ok = true;
+    for (const auto& msg: msgs) {
+        try {
+            dballe::Messages bulletin;
+            bulletin.append(msg);
+            buf += exporter.to_binary(bulletin);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            ok = false;
+        }
+    }
+    msgs.clear();
+    index.clear();
+    count = 0;
+    return ok;
+}
+
+}
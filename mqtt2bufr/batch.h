@@ -0,0 +1,80 @@
+/*
+ * batch - Group messages in BUFR bulletins
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_BATCH_H
+#define MQTT2BUFR_BATCH_H
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <dballe/msg/msg.h>
+#include <dballe/msg/wr_codec.h>
+
+namespace mqtt2bufr {
+
+/**
+ * This class collects the messages produced by mqtt2bufr::Parser and merges
+ * the ones with the same station (ident, coordinates, rep_memo) and datetime
+ * in a single message with many contexts, that is then encoded as one BUFR.
+ */
+class Batch {
+ protected:
+  typedef std::pair<std::string, dballe::Datetime> Key;
+
+  dballe::msg::BufrExporter exporter;
+  std::map<Key, std::size_t> index;
+  std::vector<dballe::Msg> msgs;
+  std::size_t count = 0;
+
+  static Key key(const dballe::Msg& msg);
+
+ public:
+  /**
+   * Add a message to the batch.
+   */
+  void add(const dballe::Msg& msg);
+  /**
+   * Number of messages added since the last flush.
+   */
+  std::size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  /**
+   * Encode the collected messages, write them to out and clear the batch.
+   *
+   * Encoding errors are reported on stderr and don't stop the flush.
+   *
+   * @return false if at least one message was not encoded
+   */
+  bool flush(std::ostream& out);
+  /**
+   * Encode the collected messages, append them to buf and clear the batch.
+   *
+   * @return false if at least one message was not encoded
+   */
+  bool flush(std::string& buf);
+};
+
+}
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * bench-payload - Benchmark of the MQTT payload decoder
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Authors: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *          Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <jansson.h>
+
+#include "payload.h"
+
+struct RAIIJson {
+    json_t* root;
+    RAIIJson(json_t* root) : root(root) {}
+    ~RAIIJson() { json_decref(root); }
+};
+
+/**
+ * Summary of a decoded payload, used to compare the decoders.
+ */
+static std::string summary_jansson(const std::string& payload) {
+    std::stringstream ss;
+    json_t* root = json_loads(payload.c_str(), 0, NULL);
+    RAIIJson raiijson(root);
+    if (!json_is_object(root))
+        throw std::runtime_error("not an object");
+    json_t* v = json_object_get(root, "v");
+    if (json_is_string(v))
+        ss << "s:" << json_string_value(v);
+    else if (json_is_integer(v))
+        ss << "i:" << (int)json_integer_value(v);
+    else if (json_is_real(v))
+        ss << "r:" << json_real_value(v);
+    else
+        ss << "-";
+    json_t* t = json_object_get(root, "t");
+    if (!t || json_is_null(t)) {
+        ss << " now";
+    } else if (json_is_string(t)) {
+        dballe::Datetime dt = dballe::Datetime::from_iso8601(json_string_value(t));
+        ss << " ";
+        dt.to_stream_iso8601(ss);
+    } else {
+        ss << " -";
+    }
+    if (json_object_iter_at(root, "a")) {
+        json_t* a = json_object_get(root, "a");
+        if (!json_is_object(a)) {
+            ss << " -";
+        } else {
+            for (void* i = json_object_iter(a); i; i = json_object_iter_next(a, i)) {
+                const char* s = json_string_value(json_object_iter_value(i));
+                ss << " " << json_object_iter_key(i) << "=" << (s ? s : "(null)");
+            }
+        }
+    }
+    return ss.str();
+}
+
+static std::string summary_decoder(mqtt2bufr::PayloadDecoder& decoder,
+                                   const std::string& payload) {
+    typedef mqtt2bufr::PayloadDecoder D;
+    std::stringstream ss;
+    decoder.decode(payload.data(), payload.size());
+    switch (decoder.value_type) {
+        case D::STRING: ss << "s:" << decoder.value_string; break;
+        case D::INTEGER: ss << "i:" << (int)decoder.value_integer; break;
+        case D::REAL: ss << "r:" << decoder.value_real; break;
+        default: ss << "-"; break;
+    }
+    switch (decoder.datetime_type) {
+        case D::MISSING:
+        case D::NUL:
+            ss << " now";
+            break;
+        case D::STRING: {
+            dballe::Datetime dt = mqtt2bufr::parse_datetime(decoder.datetime_data, decoder.datetime_size);
+            ss << " ";
+            dt.to_stream_iso8601(ss);
+            break;
+        }
+        default:
+            ss << " -";
+            break;
+    }
+    if (decoder.attributes_type == D::OBJECT) {
+        for (std::size_t i = 0; i < decoder.attributes_count; ++i) {
+            const D::Attribute& a = decoder.attributes[i];
+            ss << " " << a.code << "=" << (a.is_string ? a.value : "(null)");
+        }
+    } else if (decoder.attributes_type != D::MISSING) {
+        ss << " -";
+    }
+    return ss.str();
+}
+
+static const char* payloads[] = {
+    // valid
+    "{\"v\":123,\"t\":\"2014-09-24T12:00:00\"}",
+    "{\"v\": 12.5, \"t\": \"2014-09-24 12:00:00\", \"a\": {\"B33007\": \"70\"}}",
+    "{\"v\":\"conn\"}",
+    "{\"v\":-3,\"t\":null,\"a\":{}}",
+    "{\"x\":[1,{\"y\":[true,false,null]}],\"v\":\"caf\\u00e8\",\"t\":\"2014-09-24T12:00:00Z\"}",
+    "{\"v\":1,\"v\":2}",
+    "{\"v\":1e2}",
+    // not valid
+    "",
+    "[]",
+    "{\"v\":01}",
+    "{\"v\":1,}",
+    "{\"v\":1} x",
+    "{\"v\":\"a\\x\"}",
+    "{\"v\":99999999999999999999}",
+};
+
+static bool check() {
+    bool ok = true;
+    mqtt2bufr::PayloadDecoder decoder;
+    for (const std::string payload: payloads) {
+        std::string expected, got;
+        try {
+            expected = summary_jansson(payload);
+        } catch (const std::exception& e) {
+            expected = "error";
+        }
+        try {
+            got = summary_decoder(decoder, payload);
+        } catch (const std::exception& e) {
+            got = "error";
+        }
+        if (got != expected) {
+            std::cerr << "Mismatch for " << payload << ": " << got
+                      << " != " << expected << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+template<typename F>
+static void bench(const char* name, int iterations, F f) {
+    const char* payload = "{\"v\":2731,\"t\":\"2014-09-24T12:00:00\",\"a\":{\"B33007\":\"70\"}}";
+    std::size_t size = strlen(payload);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        f(payload, size);
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    std::cout << name << ": " << ns / iterations << " ns/payload, "
+              << (double)size * iterations / (ns / 1e9) / 1e6 << " MB/s" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+
+    if (!check())
+        return 1;
+
+    bench("jansson", iterations, [](const char* payload, std::size_t size) {
+        // As the previous parser: copy, build the DOM, read v, t and a
+        std::string s(payload, size);
+        json_t* root = json_loads(s.c_str(), 0, NULL);
+        RAIIJson raiijson(root);
+        json_t* t = json_object_get(root, "t");
+        dballe::Datetime::from_iso8601(json_string_value(t));
+        json_t* a = json_object_get(root, "a");
+        for (void* i = json_object_iter(a); i; i = json_object_iter_next(a, i))
+            json_string_value(json_object_iter_value(i));
+    });
+    mqtt2bufr::PayloadDecoder decoder;
+    bench("decoder", iterations, [&decoder](const char* payload, std::size_t size) {
+        decoder.decode(payload, size);
+        mqtt2bufr::parse_datetime(decoder.datetime_data, decoder.datetime_size);
+    });
+    return 0;
+}
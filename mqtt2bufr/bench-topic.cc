@@ -0,0 +1,169 @@
+/*
+ * bench-topic - Benchmark of the MQTT topic tokenizer
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Authors: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *          Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#include <regex.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "topic.h"
+
+// The regexp based tokenizer previously used by mqtt2bufr::Parser, kept as
+// reference for both correctness and speed.
+#define IDENT_RE "([^/]+)"
+#define LON_RE   "([0-9]+)"
+#define LAT_RE   "([0-9]+)"
+#define REP_RE   "([^/]+)"
+#define LT1_RE   "([0-9]+|-)"
+#define L1_RE    "([0-9]+|-)"
+#define LT2_RE   "([0-9]+|-)"
+#define L2_RE    "([0-9]+|-)"
+#define PIND_RE  "([0-9]+|-)"
+#define P1_RE    "([0-9]+|-)"
+#define P2_RE    "([0-9]+|-)"
+#define VAR_RE   "(B[0-9]{5})"
+
+#define TOPIC_RE "^.*/" IDENT_RE "/" LON_RE "," LAT_RE "/" REP_RE "/" PIND_RE "," P1_RE "," P2_RE "/" LT1_RE "," L1_RE "," LT2_RE "," L2_RE "/" VAR_RE "$"
+
+#define throw_regexception(errcode, preg, errbuf, prefixmsg) do { regerror(errcode, preg, errbuf, sizeof(errbuf)); throw std::runtime_error(std::string(prefixmsg) + std::string(errbuf)); } while(0);
+
+struct RAIIRegexp {
+    regex_t* re;
+    RAIIRegexp(regex_t* re) : re(re) {}
+    ~RAIIRegexp() { regfree(re); }
+};
+
+static std::vector<std::string> split_topic_regex(const std::string& topic) {
+    int r;
+    char errmsg[1024];
+    int nmatches = 13;
+    regmatch_t matches[nmatches];
+    regex_t re;
+    std::vector<std::string> items;
+
+    r = regcomp(&re, TOPIC_RE, REG_EXTENDED);
+    RAIIRegexp raiiregexp(&re);
+    if (r != 0) throw_regexception(r, &re, errmsg, "While compiling topic regexp: ");
+    r = regexec(&re, topic.c_str(), nmatches, matches, 0);
+    if (r != 0) throw_regexception(r, &re, errmsg, "While parsing topic: ");
+
+    for (int i = 1; i < nmatches; ++i) {
+        items.push_back(topic.substr(matches[i].rm_so, matches[i].rm_eo - matches[i].rm_so));
+    }
+    return items;
+}
+
+static const char* topics[] = {
+    // valid
+    "/-/1212345,4398765/rmap/254,0,0/103,2000,-,-/B12101",
+    "rmap/sample/-/1212345,4398765/rmap/254,0,0/103,2000,-,-/B12101",
+    "/prefix/with/many/levels/myident/1212345,4398765/locali/0,0,900/103,2000,-,-/B13011",
+    "/a,b/1,2/rep,memo/-,-,-/-,-,-,-/B01019",
+    "//a/1,2/r/1,2,3/1,2,3,4/B00000",
+    // invalid
+    "",
+    "/",
+    "-/1212345,4398765/rmap/254,0,0/103,2000,-,-/B12101",
+    "//1212345,4398765/rmap/254,0,0/103,2000,-,-/B12101",
+    "/-/-1212345,4398765/rmap/254,0,0/103,2000,-,-/B12101",
+    "/-/1212345/rmap/254,0,0/103,2000,-,-/B12101",
+    "/-/1212345,4398765,0/rmap/254,0,0/103,2000,-,-/B12101",
+    "/-/1212345,4398765//254,0,0/103,2000,-,-/B12101",
+    "/-/1212345,4398765/rmap/254,0/103,2000,-,-/B12101",
+    "/-/1212345,4398765/rmap/254,0,0,0/103,2000,-,-/B12101",
+    "/-/1212345,4398765/rmap/254,,0/103,2000,-,-/B12101",
+    "/-/1212345,4398765/rmap/254,0,0/103,2000,--,-/B12101",
+    "/-/1212345,4398765/rmap/254,0,0/103,2000,-/B12101",
+    "/-/1212345,4398765/rmap/254,0,0/103,2000,-,-/B1210",
+    "/-/1212345,4398765/rmap/254,0,0/103,2000,-,-/B121011",
+    "/-/1212345,4398765/rmap/254,0,0/103,2000,-,-/b12101",
+    "/-/1212345,4398765/rmap/254,0,0/103,2000,-,-/B12101/",
+};
+
+static bool check() {
+    bool ok = true;
+    for (const std::string topic: topics) {
+        std::vector<std::string> expected;
+        std::string expected_err;
+        mqtt2bufr::TopicItems items;
+        std::string err;
+        try {
+            expected = split_topic_regex(topic);
+        } catch (const std::exception& e) {
+            expected_err = e.what();
+        }
+        try {
+            mqtt2bufr::split_topic(topic, items);
+        } catch (const std::exception& e) {
+            err = e.what();
+        }
+        if (err != expected_err) {
+            std::cerr << "Mismatch for " << topic << ": \"" << err
+                      << "\" != \"" << expected_err << "\"" << std::endl;
+            ok = false;
+            continue;
+        }
+        if (!err.empty())
+            continue;
+        for (int i = 0; i < mqtt2bufr::TopicItems::SIZE; ++i) {
+            if (items[i].str() != expected[i]) {
+                std::cerr << "Mismatch for " << topic << " at item " << i
+                          << ": " << items[i].str() << " != " << expected[i]
+                          << std::endl;
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+template<typename F>
+static void bench(const char* name, int iterations, F f) {
+    const std::string topic = topics[1];
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        f(topic);
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    std::cout << name << ": " << ns / iterations << " ns/topic" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+
+    if (!check())
+        return 1;
+
+    bench("regex", iterations, [](const std::string& topic) {
+        split_topic_regex(topic);
+    });
+    bench("tokenizer", iterations, [](const std::string& topic) {
+        mqtt2bufr::TopicItems items;
+        mqtt2bufr::split_topic(topic, items);
+    });
+    return 0;
+}
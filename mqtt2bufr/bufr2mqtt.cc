@@ -25,6 +25,9 @@
 #endif
 
 #include <set>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <unistd.h>
 #include <iostream>
 #include <cerrno>
@@ -44,13 +47,27 @@
 
 #include "parser.h"
 
+enum {
+    OPT_MAX_INFLIGHT = 256,
+};
+
 struct Publisher : mosqpp::mosquittopp {
     std::vector<std::string> topics;
     bool debug;
+    // Messages waiting for the ack, shared with the network thread
     std::set<int> mids;
-    std::size_t max_mids_size = 0;
+    std::mutex mids_mutex;
+    std::condition_variable mids_cond;
+    std::size_t max_inflight;
+    bufr2mqtt::Parser parser;
+    // Buffers reused for every variable
+    std::string topic;
+    std::string payload;
+    std::string full_topic;
 
-    Publisher(const std::vector<std::string>& topics, bool debug=false) : topics(topics), debug(debug) {}
+    Publisher(const std::vector<std::string>& topics, bool debug=false,
+              std::size_t max_inflight=20)
+        : topics(topics), debug(debug), max_inflight(max_inflight) {}
 
     virtual void on_log(int level, const char *str) {
       if (debug)
@@ -58,39 +75,49 @@ struct Publisher : mosqpp::mosquittopp {
     }
 
     virtual void on_publish(int mid) {
+      std::lock_guard<std::mutex> lock(mids_mutex);
       mids.erase(mid);
+      mids_cond.notify_all();
     }
 
-    bool all_sent() const {
-      return mids.empty();
+    virtual void on_disconnect(int rc) {
+      if (rc != 0)
+        std::cerr << "Unexpected disconnection: "
+                  << mosqpp::strerror(rc) << std::endl;
     }
 
-    bool wait_dequeue() {
-        int mosqerr;
-        for (int i = 0; i < 300 && mids.size() > max_mids_size; ++i) {
-	    //std::cerr << "sleep: .1" << std::endl;
-            usleep(100000);
-            mosqerr = loop();
-            if (mosqerr != MOSQ_ERR_SUCCESS) {
-	      std::string msg;
-	      if (mosqerr == MOSQ_ERR_ERRNO)
-		msg = std::strerror(errno);
-	      else
-		msg = mosqpp::strerror(mosqerr);
+    bool all_sent() {
+      std::lock_guard<std::mutex> lock(mids_mutex);
+      return mids.empty();
+    }
 
-	      std::cerr << "Error while calling mosquitto loop: "
-			<< msg << std::endl;
-	      return false;
+    /**
+     * Wait until at most max_size messages are waiting for the ack.
+     *
+     * @return false if no ack is received for 30 seconds
+     */
+    bool wait_dequeue(std::size_t max_size=0) {
+        std::unique_lock<std::mutex> lock(mids_mutex);
+        std::size_t last_size = mids.size();
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+        while (mids.size() > max_size) {
+            if (mids_cond.wait_until(lock, deadline) == std::cv_status::timeout &&
+                mids.size() > max_size)
+                return false;
+            // Some ack received: restart the timeout
+            if (mids.size() < last_size) {
+                last_size = mids.size();
+                deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
             }
         }
-	if (mids.size() > max_mids_size) return false;
-	return true;
+        return true;
     }
 
     bool publish_msg(const dballe::Message& message) {
-        bufr2mqtt::Parser parser;
         const dballe::Msg& msg = dballe::Msg::downcast(message);
         const dballe::msg::Context* station_context = msg.find_station_context();
+        const dballe::Datetime datetime = msg.get_datetime();
+        parser.set_station(*station_context);
         for (const auto& ctx: msg.data) {
             for (const auto& var: ctx->data) {
                 // Skip date from station context
@@ -102,19 +129,19 @@ struct Publisher : mosqpp::mosquittopp {
                      var->code() == WR_VAR(0, 4,  5) ||
                      var->code() == WR_VAR(0, 4,  6)))
                     continue;
-                std::string topic;
-                std::string payload;
                 bool retain = ( ctx->is_station() ? true : false );
-                parser.parse(*var, ctx->level, ctx->trange,
-                             *station_context,
-                             msg.get_datetime(),
-                             topic, payload);
+                parser.format(*var, ctx->level, ctx->trange, datetime,
+                              topic, payload);
                 for (std::vector<std::string>::const_iterator t = topics.begin();
                      t != topics.end(); ++t) {
-                    // TODO: do something if publish() fails
+                    // Don't let the ack (on_publish) arrive before the
+                    // mid is inserted
+                    std::unique_lock<std::mutex> lock(mids_mutex);
                     int mosqerr;
                     int mid;
-                    mosqerr = publish(&mid, (*t + topic).c_str(), payload.size(), payload.c_str(), 1, retain);
+                    full_topic.assign(*t);
+                    full_topic += topic;
+                    mosqerr = publish(&mid, full_topic.c_str(), payload.size(), payload.c_str(), 1, retain);
                     if (mosqerr != MOSQ_ERR_SUCCESS) {
                         std::cerr << "Error while publishing message"
                             << ": " << mosqpp::strerror(mosqerr)
@@ -123,7 +150,9 @@ struct Publisher : mosqpp::mosquittopp {
                     } else {
                         mids.insert(mid);
                     }
-                    if (not wait_dequeue()) return false;
+                    lock.unlock();
+                    // Keep at most max_inflight messages waiting for the ack
+                    if (not wait_dequeue(max_inflight - 1)) return false;
                 }
             }
         }
@@ -145,6 +174,7 @@ void print_help(std::ostream& out)
         << " -u,--username NAME username for authenticating with the broker" << std::endl
         << " -P,--pw PASSWORD   password for authenticating with the broker" << std::endl
         << " -d,--debug         enable debug messages" << std::endl
+        << " --max-inflight N   maximum number of messages waiting for the ack (default: 20)" << std::endl
         << std::endl
         << "Report bugs to: " << PACKAGE_BUGREPORT << std::endl;
         ;
@@ -167,6 +197,7 @@ int main(int argc, char** argv)
     char* password = NULL;
     int mosqerr;
     bool debug = false;
+    int max_inflight = 20;
 
     while (1) {
         int c;
@@ -181,6 +212,7 @@ int main(int argc, char** argv)
             { "username", required_argument, 0, 'u' },
             { "pw", required_argument, 0, 'P' },
             { "debug", no_argument, 0, 'd' },
+            { "max-inflight", required_argument, 0, OPT_MAX_INFLIGHT },
             { 0, 0, 0, 0 }
         };
 
@@ -222,6 +254,13 @@ int main(int argc, char** argv)
             case 'd':
                 debug = true;
                 break;
+            case OPT_MAX_INFLIGHT:
+                max_inflight = atoi(optarg);
+                if (max_inflight < 1) {
+                    std::cerr << "Invalid max inflight " << optarg << std::endl;
+                    return 1;
+                }
+                break;
             default:
                 print_help(std::cerr);
                 return 1;
@@ -229,7 +268,7 @@ int main(int argc, char** argv)
     }
 
     mosqpp::lib_init();
-    Publisher publisher(topics, debug);
+    Publisher publisher(topics, debug, max_inflight);
 
     if ((mosqerr = publisher.username_pw_set(username, password)) != 0) {
         std::cerr << "Error while setting username and password"
@@ -243,6 +282,14 @@ int main(int argc, char** argv)
                   << std::endl;
         return 1;
     }
+    // Let the library send as many messages as we keep in flight
+    publisher.max_inflight_messages_set(max_inflight);
+    if ((mosqerr = publisher.loop_start()) != 0) {
+        std::cerr << "Error while starting the network loop"
+                  << ": " << mosqpp::strerror(mosqerr)
+                  << std::endl;
+        return 1;
+    }
 
     std::unique_ptr<dballe::File> input = dballe::File::create(dballe::File::BUFR, stdin, false, "stdin");
 
@@ -254,6 +301,8 @@ int main(int argc, char** argv)
     });
 
     if (not publisher.wait_dequeue()) {
+      publisher.disconnect();
+      publisher.loop_stop();
       std::cerr << "Ack timeout error:" << std::endl;
       for (auto mid: publisher.mids)
           std::cerr << "- " << mid << std::endl;
@@ -267,6 +316,7 @@ int main(int argc, char** argv)
                   << std::endl;
         return 1;
     }
+    publisher.loop_stop();
 
     mosqpp::lib_cleanup();
 
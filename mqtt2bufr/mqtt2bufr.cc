@@ -25,6 +25,11 @@
 #endif
 
 #include <iostream>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <csignal>
+#include <cstdint>
 
 #include <mosquittopp.h>
 
@@ -37,15 +42,151 @@
 #include <dballe/msg/wr_codec.h>
 
 #include "parser.h"
+#include "batch.h"
+#include "queue.h"
+
+enum {
+    OPT_BATCH_SIZE = 256,
+    OPT_BATCH_MS,
+    OPT_WORKERS,
+    OPT_QUEUE_SIZE,
+    OPT_QUEUE_FULL,
+};
 
 std::vector<std::string> topics;
 
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int)
+{
+    stop = 1;
+}
+
+/**
+ * Parse a MQTT message.
+ */
+static dballe::Msg parse_message(mqtt2bufr::Parser& parser,
+                                 const char* topic, std::size_t topic_size,
+                                 const char* payload, std::size_t payload_size,
+                                 bool overwrite_date)
+{
+    dballe::Msg msg = parser.parse(topic, topic_size, payload, payload_size);
+    // One context means station context only: in that case, there's no
+    // need to overwrite the datetime.
+    if (overwrite_date && msg.data.size() > 1)
+        msg.set_datetime(mqtt2bufr::datetime_now());
+    return msg;
+}
+
+/**
+ * Write the messages to stdout, grouping them in batches.
+ */
+struct Output {
+    mqtt2bufr::Batch batch;
+    std::size_t batch_size;
+    int batch_ms;
+    std::chrono::steady_clock::time_point batch_start;
+
+    Output(std::size_t batch_size=1, int batch_ms=0)
+        : batch_size(batch_size), batch_ms(batch_ms) {}
+
+    void add(const dballe::Msg& msg) {
+        if (batch.empty())
+            batch_start = std::chrono::steady_clock::now();
+        batch.add(msg);
+        if (batch.size() >= batch_size)
+            batch.flush(std::cout);
+    }
+
+    /**
+     * Flush the batch if it's older than batch_ms milliseconds.
+     */
+    void flush_expired() {
+        if (batch.empty() || batch_ms <= 0)
+            return;
+        auto age = std::chrono::steady_clock::now() - batch_start;
+        if (age >= std::chrono::milliseconds(batch_ms))
+            batch.flush(std::cout);
+    }
+
+    /**
+     * Maximum wait time, in milliseconds, so that an expired batch is
+     * flushed in time.
+     */
+    int timeout() const {
+        if (batch.empty() || batch_ms <= 0)
+            return 1000;
+        auto age = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - batch_start).count();
+        if (age >= batch_ms)
+            return 0;
+        return std::min<int>(1000, batch_ms - age);
+    }
+};
+
+/**
+ * A MQTT message waiting to be converted by a worker.
+ */
+struct Job {
+    std::uint64_t seq = 0;
+    std::string topic;
+    std::string payload;
+};
+
+/**
+ * The message converted by a worker: the BUFR is encoded by the worker only
+ * when the messages are not batched.
+ */
+struct Result {
+    bool ok = false;
+    dballe::Msg msg;
+    std::string bufr;
+    std::string error;
+};
+
+typedef mqtt2bufr::BoundedQueue<Job> JobQueue;
+typedef mqtt2bufr::OrderedResults<Result> ResultQueue;
+
+static void worker(JobQueue& jobs, ResultQueue& results,
+                   bool overwrite_date, bool encode)
+{
+    mqtt2bufr::Parser parser;
+    dballe::msg::BufrExporter exporter;
+    Job job;
+    while (jobs.pop(job)) {
+        Result res;
+        try {
+            res.msg = parse_message(parser, job.topic.data(), job.topic.size(),
+                                    job.payload.data(), job.payload.size(),
+                                    overwrite_date);
+            if (encode) {
+                dballe::Messages msgs;
+                msgs.append(res.msg);
+                res.bufr = exporter.to_binary(msgs);
+            }
+            res.ok = true;
+        } catch(const std::exception& e) {
+            res.error = e.what();
+        }
+        results.put(job.seq, std::move(res));
+    }
+}
+
 struct mosq : public mosqpp::mosquittopp {
   mqtt2bufr::Parser parser;
   bool debug;
     bool overwrite_date;
+    Output& output;
+    // When set, messages are sent to the workers instead of being converted
+    // in the network thread.
+    JobQueue* jobs = nullptr;
+    ResultQueue* results = nullptr;
+    bool drop_when_full = false;
+    std::uint64_t seq = 0;
+    std::size_t dropped = 0;
 
-    mosq(bool debug=false, bool overwrite_date=false) : debug(debug), overwrite_date(overwrite_date) {}
+    mosq(Output& output, bool debug=false, bool overwrite_date=false)
+        : debug(debug), overwrite_date(overwrite_date), output(output) {}
   void on_connect(int rc)
   {
     if(rc == 0){
@@ -62,32 +203,59 @@ struct mosq : public mosqpp::mosquittopp {
   }
 
     void on_message(const struct mosquitto_message *message) {
-        dballe::Msg msg;
+        if (jobs) {
+            enqueue(message);
+            return;
+        }
         try {
-            msg = parser.parse(message->topic,
-                               std::string((const char*)message->payload,
-                                           message->payloadlen));
-
-            // One context means station context only: in that case, there's no
-            // need to overwrite the datetime.
-            if (overwrite_date && msg.data.size() > 1)
-                msg.set_datetime(mqtt2bufr::datetime_now());
-
-            dballe::Messages msgs;
-            dballe::msg::BufrExporter exporter;
-            msgs.append(msg);
-            std::cout << exporter.to_binary(msgs) << std::flush;
+            output.add(parse_message(parser, message->topic, strlen(message->topic),
+                                     (const char*)message->payload, message->payloadlen,
+                                     overwrite_date));
         } catch(const std::exception& e) {
             std::cerr << e.what() << std::endl;
         }
     }
 
+    void enqueue(const struct mosquitto_message *message) {
+        Job job;
+        job.seq = seq;
+        job.topic = message->topic;
+        job.payload.assign((const char*)message->payload, message->payloadlen);
+        // The place in the results bounds the messages not yet written, not
+        // only the ones waiting for a worker
+        bool reserved = drop_when_full ? results->try_reserve() : results->reserve();
+        bool queued = reserved && (drop_when_full ? jobs->try_push(job) : jobs->push(job));
+        if (queued) {
+            ++seq;
+            return;
+        }
+        if (reserved)
+            results->release();
+        if (drop_when_full) {
+            if (dropped++ % 1000 == 0)
+                std::cerr << "Queue full, " << dropped << " messages dropped so far" << std::endl;
+        }
+    }
+
     void on_log(int level, const char *str) {
       if (debug)
         std::cerr << str << std::endl;
     }
 };
 
+/**
+ * Write a result converted by a worker.
+ */
+static void write_result(Output& output, const Result& res)
+{
+    if (!res.ok)
+        std::cerr << res.error << std::endl;
+    else if (output.batch_size > 1)
+        output.add(res.msg);
+    else
+        std::cout << res.bufr << std::flush;
+}
+
 void print_help(std::ostream& out)
 {
     out << "Usage: mqtt2bufr [OPTIONS]" << std::endl
@@ -103,6 +271,17 @@ void print_help(std::ostream& out)
         << " -P,--pw PASSWORD   password for authenticating with the broker" << std::endl
         << " -d,--debug         enable debug messages" << std::endl
         << " --overwrite-date   date is ignored and is overwritten with current date" << std::endl
+        << " --batch-size N     group up to N messages with the same station and date" << std::endl
+        << "                    in a BUFR (default: 1)" << std::endl
+        << " --batch-ms T       write the grouped messages at least every T milliseconds" << std::endl
+        << "                    (default: 0, wait for --batch-size messages)" << std::endl
+        << " --workers N        convert the messages in N threads, while the MQTT" << std::endl
+        << "                    connection is handled by another one (default: 0, convert" << std::endl
+        << "                    the messages in the MQTT thread)" << std::endl
+        << " --queue-size N     maximum number of messages received and not yet" << std::endl
+        << "                    written (default: 1024)" << std::endl
+        << " --queue-full MODE  when the queue is full, \"block\" the MQTT thread or" << std::endl
+        << "                    \"drop\" the message (default: block)" << std::endl
         << std::endl
         << "Report bugs to: " << PACKAGE_BUGREPORT << std::endl;
         ;
@@ -124,6 +303,11 @@ int main(int argc, char** argv)
     char* username = NULL;
     char* password = NULL;
     bool debug = false;
+    int batch_size = 1;
+    int batch_ms = 0;
+    int workers = 0;
+    int queue_size = 1024;
+    bool drop_when_full = false;
 
     while (1) {
         int c;
@@ -139,6 +323,11 @@ int main(int argc, char** argv)
             { "pw", required_argument, 0, 'P' },
             { "debug", no_argument, 0, 'd' },
             { "overwrite-date", no_argument, &overwrite_date, 1 },
+            { "batch-size", required_argument, 0, OPT_BATCH_SIZE },
+            { "batch-ms", required_argument, 0, OPT_BATCH_MS },
+            { "workers", required_argument, 0, OPT_WORKERS },
+            { "queue-size", required_argument, 0, OPT_QUEUE_SIZE },
+            { "queue-full", required_argument, 0, OPT_QUEUE_FULL },
             { 0, 0, 0, 0 }
         };
 
@@ -180,6 +369,36 @@ int main(int argc, char** argv)
             case 'd':
                 debug = true;
                 break;
+            case OPT_BATCH_SIZE:
+                batch_size = atoi(optarg);
+                if (batch_size < 1) {
+                    std::cerr << "Invalid batch size " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_BATCH_MS:
+                batch_ms = atoi(optarg);
+                break;
+            case OPT_WORKERS:
+                workers = atoi(optarg);
+                break;
+            case OPT_QUEUE_SIZE:
+                queue_size = atoi(optarg);
+                if (queue_size < 1) {
+                    std::cerr << "Invalid queue size " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_QUEUE_FULL:
+                if (strcmp(optarg, "block") == 0)
+                    drop_when_full = false;
+                else if (strcmp(optarg, "drop") == 0)
+                    drop_when_full = true;
+                else {
+                    std::cerr << "Invalid queue full policy " << optarg << std::endl;
+                    return 1;
+                }
+                break;
             default:
                 print_help(std::cerr);
                 return 1;
@@ -187,7 +406,11 @@ int main(int argc, char** argv)
     }
 
     mosqpp::lib_init();
-    mosq m(debug, overwrite_date);
+    Output output(batch_size, batch_ms);
+    mosq m(output, debug, overwrite_date);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
 
     if (m.username_pw_set(username, password) != 0) {
         std::cerr << "Error while setting username and password" << std::endl;
@@ -197,11 +420,50 @@ int main(int argc, char** argv)
         std::cerr << "Error while connecting to " << hostname << ":" << port << std::endl;
         return 1;
     }
-    while (m.loop() == 0) {}
 
-    if (m.disconnect() != 0) {
-        std::cerr << "Error while disconnetting from " << hostname << ":" << port << std::endl;
-        return 1;
+    if (workers <= 0) {
+        while (!stop && m.loop(output.timeout()) == 0) {
+            output.flush_expired();
+        }
+        output.batch.flush(std::cout);
+
+        if (m.disconnect() != 0) {
+            std::cerr << "Error while disconnetting from " << hostname << ":" << port << std::endl;
+            return 1;
+        }
+    } else {
+        JobQueue jobs(queue_size);
+        ResultQueue results(queue_size);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < workers; ++i)
+            threads.emplace_back(worker, std::ref(jobs), std::ref(results),
+                                 overwrite_date, batch_size == 1);
+        m.jobs = &jobs;
+        m.results = &results;
+        m.drop_when_full = drop_when_full;
+        if (m.loop_start() != 0) {
+            std::cerr << "Error while starting the MQTT thread" << std::endl;
+            stop = 1;
+        }
+        // Ordered writer
+        Result res;
+        while (!stop) {
+            if (results.get(res, std::chrono::milliseconds(output.timeout())))
+                write_result(output, res);
+            output.flush_expired();
+        }
+        if (m.disconnect() != 0)
+            std::cerr << "Error while disconnetting from " << hostname << ":" << port << std::endl;
+        // Wake up the MQTT thread, if it waits for a place in the results
+        results.close();
+        m.loop_stop();
+        // Convert and write the messages already received
+        jobs.close();
+        for (auto& t: threads)
+            t.join();
+        while (results.get(res, std::chrono::milliseconds(0)))
+            write_result(output, res);
+        output.batch.flush(std::cout);
     }
 
     mosqpp::lib_cleanup();
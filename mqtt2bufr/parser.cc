@@ -22,42 +22,14 @@
  */
 
 #include "parser.h"
-
-#include <regex.h>
+#include "topic.h"
 
 #include <iostream>
 #include <ctime>
+#include <limits>
+#include <stdexcept>
 
-#include <jansson.h>
-
-#define IDENT_RE "([^/]+)"
-#define LON_RE   "([0-9]+)"
-#define LAT_RE   "([0-9]+)"
-#define REP_RE   "([^/]+)"
-#define LT1_RE   "([0-9]+|-)"
-#define L1_RE    "([0-9]+|-)"
-#define LT2_RE   "([0-9]+|-)"
-#define L2_RE    "([0-9]+|-)"
-#define PIND_RE  "([0-9]+|-)"
-#define P1_RE    "([0-9]+|-)"
-#define P2_RE    "([0-9]+|-)"
-#define VAR_RE   "(B[0-9]{5})"
-
-#define TOPIC_RE "^.*/" IDENT_RE "/" LON_RE "," LAT_RE "/" REP_RE "/" PIND_RE "," P1_RE "," P2_RE "/" LT1_RE "," L1_RE "," LT2_RE "," L2_RE "/" VAR_RE "$"
-
-#define throw_regexception(errcode, preg, errbuf, prefixmsg) do { regerror(errcode, preg, errbuf, sizeof(errbuf)); throw std::runtime_error(std::string(prefixmsg) + std::string(errbuf)); } while(0);
-
-struct RAIIRegexp {
-    regex_t* re;
-    RAIIRegexp(regex_t* re) : re(re) {}
-    ~RAIIRegexp() { regfree(re); }
-};
-
-struct RAIIJson {
-    json_t* root;
-    RAIIJson(json_t* root) : root(root) {}
-    ~RAIIJson() { json_decref(root); }
-};
+#include <dballe/var.h>
 
 namespace mqtt2bufr {
 
@@ -74,202 +46,325 @@ dballe::Datetime datetime_now()
                             tm->tm_sec);
 }
 
-static std::vector<std::string> split_topic(const std::string& topic) {
-    int r;
-    char errmsg[1024];
-    int nmatches = 13;
-    regmatch_t matches[nmatches];
-    regex_t re;
-    std::vector<std::string> items;
-
-    r = regcomp(&re, TOPIC_RE, REG_EXTENDED);
-    RAIIRegexp raiiregexp(&re);
-    if (r != 0) throw_regexception(r, &re, errmsg, "While compiling topic regexp: ");
-    r = regexec(&re, topic.c_str(), nmatches, matches, 0);
-    if (r != 0) throw_regexception(r, &re, errmsg, "While parsing topic: ");
-
-    for (int i = 1; i < nmatches; ++i) { 
-        items.push_back(topic.substr(matches[i].rm_so, matches[i].rm_eo - matches[i].rm_so));
+/**
+ * Convert a token of digits to int.
+ *
+ * @throw std::runtime_error if the number does not fit in an int.
+ */
+static int token_to_int(const TopicToken& token) {
+    if (token.is_missing())
+        return dballe::MISSING_INT;
+    long long res = 0;
+    for (std::size_t i = 0; i < token.size; ++i) {
+        res = res * 10 + (token.data[i] - '0');
+        if (res > std::numeric_limits<int>::max())
+            throw std::runtime_error("While parsing topic: " + token.str() + " is out of range");
     }
-    return items;
+    return res;
 }
 
-void Parser::parse_topic(const std::string& topic) {
+void Parser::parse_topic(const char* topic, std::size_t size, dballe::Msg& msg) {
     // split topic by "/" delimiter
-    std::vector<std::string> items = split_topic(topic);
+    TopicItems items;
+    split_topic(topic, size, items);
     // set station ident
-    if (items[0] != "-")
-        station_rec.set_var(dballe::var(WR_VAR(0, 1, 11), items[0].c_str()));
+    if (!items[TopicItems::IDENT].is_missing())
+        msg.set(dballe::newvar(WR_VAR(0, 1, 11), items[TopicItems::IDENT].str()),
+                dballe::Level(), dballe::Trange());
     // set station coordinates
-    station_rec.set_var(dballe::var(WR_VAR(0, 6,  1), items[1].c_str()));
-    station_rec.set_var(dballe::var(WR_VAR(0, 5,  1), items[2].c_str()));
+    msg.set(dballe::newvar(WR_VAR(0, 6,  1), token_to_int(items[TopicItems::LON])),
+            dballe::Level(), dballe::Trange());
+    msg.set(dballe::newvar(WR_VAR(0, 5,  1), token_to_int(items[TopicItems::LAT])),
+            dballe::Level(), dballe::Trange());
     // set station rep_memo
-    station_rec.set_var(dballe::var(WR_VAR(0, 1,194), items[3].c_str()));
+    msg.set(dballe::newvar(WR_VAR(0, 1,194), items[TopicItems::REP_MEMO].str()),
+            dballe::Level(), dballe::Trange());
     // set variable trange
-    variable_rec.setf("pindicator", items[4].c_str());
-    variable_rec.setf("p1", items[5].c_str());
-    variable_rec.setf("p2", items[6].c_str());
+    trange = dballe::Trange(token_to_int(items[TopicItems::PIND]),
+                            token_to_int(items[TopicItems::P1]),
+                            token_to_int(items[TopicItems::P2]));
     // set variable level
-    variable_rec.setf("leveltype1", items[7].c_str());
-    variable_rec.setf("l1", items[8].c_str());
-    variable_rec.setf("leveltype2", items[9].c_str());
-    variable_rec.setf("l2", items[10].c_str());
-    // set variable
-    variable_rec.setf("var", items[11].c_str());
+    level = dballe::Level(token_to_int(items[TopicItems::LT1]),
+                          token_to_int(items[TopicItems::L1]),
+                          token_to_int(items[TopicItems::LT2]),
+                          token_to_int(items[TopicItems::L2]));
+    // set variable ("Bxxyyy"), if the message has a single one
+    code = items.has_var() ? WR_STRING_TO_VAR(items[TopicItems::VAR].data + 1) : 0;
 }
 
-void Parser::parse_payload(const std::string& payload) {
-    wreport::Var var(dballe::varinfo(variable_rec["var"].enqs()));
-    json_t* root = json_loads(payload.c_str(), 0, NULL);
-    RAIIJson raiijson(root);
-    if (!json_is_object(root))
-        throw std::runtime_error("Payload is not a valid JSON object (document is not a JSON object)");
-    // Set the value
-    json_t* v = json_object_get(root, "v");
-    if (json_is_string(v))
-        var.set(json_string_value(v));
-    else if (json_is_integer(v))
-        var.set((int)json_integer_value(v));
-    else if (json_is_real(v))
-        var.set(json_real_value(v));
-    else
-        throw std::runtime_error("Payload is not a valid JSON object (value associated to key \"v\" is not a string, integer or real)");
-    // Parse datetime when data are not in station context
-    if (variable_rec.get_level() != dballe::Level() &&
-        variable_rec.get_trange() != dballe::Trange()) {
-        json_t* t = json_object_get(root, "t");
-        dballe::Datetime datetime;
-        // A datetime missing or null means "now"
-        if (!t || json_is_null(t))
-            datetime = datetime_now();
-        else if (json_is_string(t))
-            datetime = dballe::Datetime::from_iso8601(json_string_value(t));
-        else
-            throw std::runtime_error("Payload is not a valid JSON object (value associated to key \"t\" is not a string)");
+static void set_value(wreport::Var& var, PayloadDecoder::Type type,
+                      const std::string& s, long long i, double d) {
+    switch (type) {
+        case PayloadDecoder::STRING:
+            var.set(s.c_str());
+            break;
+        case PayloadDecoder::INTEGER:
+            var.set((int)i);
+            break;
+        case PayloadDecoder::REAL:
+            var.set(d);
+            break;
+        default:
+            throw std::runtime_error("Payload is not a valid JSON object (value associated to key \"v\" is not a string, integer or real)");
+    }
+}
 
-        variable_rec.set_datetime(datetime);
+/// B[0-9]{5}
+static bool is_varcode(const std::string& s) {
+    if (s.size() != 6 || s[0] != 'B') return false;
+    for (std::size_t i = 1; i < 6; ++i)
+        if (s[i] < '0' || s[i] > '9') return false;
+    return true;
+}
+
+void Parser::parse_payload(const char* payload, std::size_t size, dballe::Msg& msg) {
+    std::unique_ptr<wreport::Var> var;
+    dballe::Datetime datetime;
+    decoder.decode(payload, size);
+    // Set the value (a message with many variables has an object instead)
+    if (code != 0) {
+        var.reset(new wreport::Var(dballe::varinfo(code)));
+        set_value(*var, decoder.value_type, decoder.value_string,
+                  decoder.value_integer, decoder.value_real);
+    } else if (decoder.value_type != PayloadDecoder::OBJECT) {
+        throw std::runtime_error("Payload is not a valid JSON object (value associated to key \"v\" is not an object)");
+    }
+    // Parse datetime when data are not in station context
+    if (level != dballe::Level() &&
+        trange != dballe::Trange()) {
+        switch (decoder.datetime_type) {
+            // A datetime missing or null means "now"
+            case PayloadDecoder::MISSING:
+            case PayloadDecoder::NUL:
+                datetime = datetime_now();
+                break;
+            case PayloadDecoder::STRING:
+                datetime = parse_datetime(decoder.datetime_data, decoder.datetime_size);
+                break;
+            default:
+                throw std::runtime_error("Payload is not a valid JSON object (value associated to key \"t\" is not a string)");
+        }
+    }
+    // Many variables, all with the same level, time range and datetime; the
+    // attributes would be ambiguous
+    if (code == 0) {
+        if (decoder.attributes_type != PayloadDecoder::MISSING)
+            throw std::runtime_error("Payload is not a valid JSON object (key \"a\" is not allowed with many variables)");
+        for (std::size_t i = 0; i < decoder.values_count; ++i) {
+            const PayloadDecoder::Value& v = decoder.values[i];
+            if (!is_varcode(v.code))
+                throw std::runtime_error("Payload is not a valid JSON object (key \"" + v.code + "\" of \"v\" is not a variable)");
+            std::unique_ptr<wreport::Var> var(new wreport::Var(dballe::varinfo(WR_STRING_TO_VAR(v.code.c_str() + 1))));
+            set_value(*var, v.type, v.string, v.integer, v.real);
+            msg.set(std::move(var), level, trange);
+        }
+        msg.set_datetime(datetime);
+        return;
     }
     // Parse attributes (if any)
-    if (json_object_iter_at(root, "a")) {
-        json_t* a = json_object_get(root, "a");
-        if (!json_is_object(a))
+    if (decoder.attributes_type != PayloadDecoder::MISSING) {
+        if (decoder.attributes_type != PayloadDecoder::OBJECT)
             throw std::runtime_error("Payload is not a valid JSON object (value associated to key \"a\" is not an object)");
-        void* i = json_object_iter(a);
-        while (i) {
-            const char* k = json_object_iter_key(i);
-            json_t* av = json_object_iter_value(i);
-            const char* s = json_string_value(av);
-            var.seta(dballe::var(k, s));
-            i = json_object_iter_next(a, i);
+        for (std::size_t i = 0; i < decoder.attributes_count; ++i) {
+            const PayloadDecoder::Attribute& a = decoder.attributes[i];
+            const char* s = a.is_string ? a.value.c_str() : nullptr;
+            var->seta(dballe::var(a.code.c_str(), s));
         }
     }
-    variable_rec.set(var);
+    msg.set(std::move(var), level, trange);
+    msg.set_datetime(datetime);
 }
 
-dballe::Msg Parser::parse(const std::string& topic, const std::string& payload) {
-    // clear records
-    station_rec.clear();
-    variable_rec.clear();
-    attributes_rec.clear();
-
+dballe::Msg Parser::parse(const char* topic, std::size_t topic_size,
+                          const char* payload, std::size_t payload_size) {
+    dballe::Msg msg;
     // parse topic
-    parse_topic(topic);
+    parse_topic(topic, topic_size, msg);
     // parse payload
-    parse_payload(payload);
+    parse_payload(payload, payload_size, msg);
+    return msg;
+}
 
-    // create message
-    dballe::Msg msg;
-    std::vector<wreport::Var*> vars;
-    std::vector<wreport::Var*>::const_iterator it;
+}
 
-    vars = station_rec.vars();
-    for (it = vars.begin(); it != vars.end(); ++it) {
-        msg.set(**it, (*it)->code(), station_rec.get_level(), station_rec.get_trange());
-    }
+#include <cstdio>
 
-    vars = variable_rec.vars();
-    for (it = vars.begin(); it != vars.end(); ++it) {
-        msg.set(**it, (*it)->code(), variable_rec.get_level(), variable_rec.get_trange());
-    }
+namespace bufr2mqtt {
 
-    // set datetime from variable_rec
-    msg.set_datetime(variable_rec.get_datetime());
+namespace {
 
-    return msg;
+void append_int(std::string& out, int val) {
+    char buf[12];
+    char* p = buf + sizeof(buf);
+    unsigned u = val < 0 ? 0u - (unsigned)val : (unsigned)val;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (val < 0)
+        *--p = '-';
+    out.append(p, buf + sizeof(buf) - p);
 }
 
+void append_int_or_missing(std::string& out, int val) {
+    if (val == dballe::MISSING_INT)
+        out += '-';
+    else
+        append_int(out, val);
 }
 
-#include <sstream>
+/// Append n digits, zero padded
+void append_digits(std::string& out, unsigned val, int n) {
+    char buf[8];
+    for (int i = n - 1; i >= 0; --i) {
+        buf[i] = '0' + val % 10;
+        val /= 10;
+    }
+    out.append(buf, n);
+}
 
-namespace bufr2mqtt {
+inline bool is_numeric(const wreport::Var& var) {
+    return !var.info()->is_string() && !var.info()->is_binary();
+}
 
-void Parser::parse(const wreport::Var& var, const dballe::Level& level, const dballe::Trange& trange,
-                   const dballe::msg::Context& station_context,
-                   const dballe::Datetime& datetime,
-                   std::string& topic, std::string& payload) {
-    topic.clear();
-    payload.clear();
-    topic = "/";
-    if (const wreport::Var* v = station_context.find(WR_VAR(0, 1, 11)))
-        topic += v->enqc();
-    else
-        topic += "-";
-    topic += "/";
-    if (const wreport::Var* v = station_context.find(WR_VAR(0, 6,  1)))
-        topic += v->enqc();
-    else
-        topic += "-";
-    topic +=",";
-    if (const wreport::Var* v = station_context.find(WR_VAR(0, 5,  1)))
-        topic += v->enqc();
-    else
-        topic += "-";
-    topic += "/";
-    if (const wreport::Var* v = station_context.find(WR_VAR(0, 1,194)))
-        topic += v->enqc();
+/// Same as enqc(): numeric values are formatted as integers (CREX format)
+void append_value(std::string& out, const wreport::Var& var) {
+    if (is_numeric(var))
+        append_int(out, var.enqi());
     else
-        topic += "-";
-    topic += "/";
-    {
-        std::stringstream ss;
-        trange.to_stream(ss);
-        topic += ss.str();
+        out += var.enqc();
+}
+
+void append_varcode(std::string& out, wreport::Varcode code) {
+    static const char types[] = { 'B', 'R', 'C', 'D' };
+    out += types[WR_VAR_F(code)];
+    append_digits(out, WR_VAR_X(code), 2);
+    append_digits(out, WR_VAR_Y(code), 3);
+}
+
+/// Same as dballe::Datetime::to_stream_iso8601(out, 'T', "")
+void append_datetime(std::string& out, const dballe::Datetime& dt) {
+    append_digits(out, dt.year, 4);
+    out += '-';
+    append_digits(out, dt.month, 2);
+    out += '-';
+    append_digits(out, dt.day, 2);
+    out += 'T';
+    append_digits(out, dt.hour, 2);
+    out += ':';
+    append_digits(out, dt.minute, 2);
+    out += ':';
+    append_digits(out, dt.second, 2);
+}
+
+/// JSON string, escaped as json_dumps() does
+void append_json_string(std::string& out, const char* s) {
+    out += '"';
+    for (const char* p = s; *p; ++p) {
+        switch (*p) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)*p < 0x20) {
+                    char buf[7];
+                    snprintf(buf, sizeof(buf), "\\u%04X", (unsigned char)*p);
+                    out += buf;
+                } else {
+                    out += *p;
+                }
+                break;
+        }
     }
-    topic += "/";
-    {
-        std::stringstream ss;
-        // NOTE: at this moment, the station info level is not (-,-,-,-), so we
-        // have to translate from dballe internal representation.
-        level.to_stream(ss);
-        topic += ss.str();
+    out += '"';
+}
+
+/// Value as a JSON string
+void append_json_value(std::string& out, const wreport::Var& var) {
+    if (is_numeric(var)) {
+        out += '"';
+        append_int(out, var.enqi());
+        out += '"';
+    } else {
+        append_json_string(out, var.enqc());
     }
-    topic += "/";
-    topic += wreport::varcode_format(var.code());
+}
+
+void append_station_item(std::string& out, const dballe::msg::Context& ctx, wreport::Varcode code) {
+    if (const wreport::Var* v = ctx.find(code))
+        append_value(out, *v);
+    else
+        out += '-';
+}
+
+}
+
+void Parser::set_station(const dballe::msg::Context& station_context) {
+    station_prefix.clear();
+    station_prefix += '/';
+    append_station_item(station_prefix, station_context, WR_VAR(0, 1, 11));
+    station_prefix += '/';
+    append_station_item(station_prefix, station_context, WR_VAR(0, 6,  1));
+    station_prefix += ',';
+    append_station_item(station_prefix, station_context, WR_VAR(0, 5,  1));
+    station_prefix += '/';
+    append_station_item(station_prefix, station_context, WR_VAR(0, 1,194));
+    station_prefix += '/';
+}
 
-    json_t* root = json_object();
-    json_t* v;
-    RAIIJson raiijson(root);
-    v = json_string(var.enqc());
-    json_object_set_new(root, "v", v);
+void Parser::format(const wreport::Var& var, const dballe::Level& level, const dballe::Trange& trange,
+                    const dballe::Datetime& datetime,
+                    std::string& topic, std::string& payload) {
+    topic.assign(station_prefix);
+    append_int_or_missing(topic, trange.pind);
+    topic += ',';
+    append_int_or_missing(topic, trange.p1);
+    topic += ',';
+    append_int_or_missing(topic, trange.p2);
+    topic += '/';
+    // NOTE: at this moment, the station info level is not (-,-,-,-), so we
+    // have to translate from dballe internal representation.
+    append_int_or_missing(topic, level.ltype1);
+    topic += ',';
+    append_int_or_missing(topic, level.l1);
+    topic += ',';
+    append_int_or_missing(topic, level.ltype2);
+    topic += ',';
+    append_int_or_missing(topic, level.l2);
+    topic += '/';
+    append_varcode(topic, var.code());
+
+    // Same layout of json_dumps(root, 0)
+    payload.assign("{\"v\": ");
+    append_json_value(payload, var);
     if (level != dballe::Level() && trange != dballe::Trange()) {
-        std::stringstream ss;
-        datetime.to_stream_iso8601(ss, 'T', "");
-        v = json_string(ss.str().c_str());
-        json_object_set_new(root, "t", v);
+        payload += ", \"t\": \"";
+        append_datetime(payload, datetime);
+        payload += '"';
     }
-    v = NULL;
+    bool first = true;
     for (const wreport::Var* a = var.next_attr(); a != NULL; a = a->next_attr()) {
-        if (!v) {
-            v = json_object();
-            json_object_set_new(root, "a", v);
-        }
-        json_t* av = json_string(a->enqc());
-        json_object_set_new(v, wreport::varcode_format(a->code()).c_str(), av);
+        payload += first ? ", \"a\": {\"" : ", \"";
+        first = false;
+        append_varcode(payload, a->code());
+        payload += "\": ";
+        append_json_value(payload, *a);
     }
-    char* s = json_dumps(root, 0);
-    payload = s;
-    free(s);
+    if (!first)
+        payload += '}';
+    payload += '}';
+}
+
+void Parser::parse(const wreport::Var& var, const dballe::Level& level, const dballe::Trange& trange,
+                   const dballe::msg::Context& station_context,
+                   const dballe::Datetime& datetime,
+                   std::string& topic, std::string& payload) {
+    set_station(station_context);
+    format(var, level, trange, datetime, topic, payload);
 }
 
 }
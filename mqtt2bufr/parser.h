@@ -24,9 +24,11 @@
 #define MQTT2BUFR_PARSER_H
 
 #include <string>
-#include <dballe/core/record.h>
+#include <dballe/types.h>
 #include <dballe/msg/msg.h>
 
+#include "payload.h"
+
 namespace mqtt2bufr {
 
 dballe::Datetime datetime_now();
@@ -40,25 +42,41 @@ dballe::Datetime datetime_now();
  *   - VALUE: value of the variable VAR
  *     - if string or integer: CREX format
  *     - if double (e.g. 12.3, 33.0) : CREX format / scale
- *   - DATETIME: `YYYY-mm-ddTHH:MM:SS` or `YYYY-mm-dd HH:MM:SS`
+ *   - DATETIME: `YYYY-mm-ddTHH:MM:SS` or `YYYY-mm-dd HH:MM:SS`; minutes
+ *     and seconds are optional
+ *
+ * A message can also carry many variables with the same level, time range
+ * and datetime, and no attributes:
+ * - topic: `.../IDENT/LON,LAT/REP_MEMO/PIND,P1,P2/LT1,L1,LT2,L2`
+ * - payload: `{ "v": { "BXXYYY": VALUE, ... }, "t": "DATETIME" }`
  */
 class Parser {
  protected:
-  dballe::core::Record station_rec;
-  dballe::core::Record variable_rec;
-  dballe::core::Record attributes_rec;
+  // Variable, level and time range of the last parsed topic
+  wreport::Varcode code = 0;
+  dballe::Level level;
+  dballe::Trange trange;
+  PayloadDecoder decoder;
 
   /**
-   * Parse the topic.
+   * Parse the topic, setting the station variables in msg.
    */
-  void parse_topic(const std::string& topic);
+  void parse_topic(const char* topic, std::size_t size, dballe::Msg& msg);
   /**
-   * Parse payload.
+   * Parse payload, setting the variables and the datetime in msg.
    */
-  void parse_payload(const std::string& payload);
+  void parse_payload(const char* payload, std::size_t size, dballe::Msg& msg);
 
  public:
-  dballe::Msg parse(const std::string& topic, const std::string& payload);
+  /**
+   * Parse a message; topic and payload are read in place.
+   */
+  dballe::Msg parse(const char* topic, std::size_t topic_size,
+                    const char* payload, std::size_t payload_size);
+
+  dballe::Msg parse(const std::string& topic, const std::string& payload) {
+    return parse(topic.data(), topic.size(), payload.data(), payload.size());
+  }
 };
 
 }
@@ -70,10 +88,29 @@ namespace bufr2mqtt {
  * This class converts a (var, level, trange), station context and date to MQTT
  * topic and payload.
  *
+ * Topic and payload are written in buffers owned by the caller, that can be
+ * reused from one variable to the next.
+ *
  * @see mqtt2bufr::Parser for a description of the MQTT topic and payload.
  */
 class Parser {
+ protected:
+  // `/IDENT/LON,LAT/REP_MEMO/` of the current station
+  std::string station_prefix;
+
  public:
+  /**
+   * Set the station context of the next variables.
+   */
+  void set_station(const dballe::msg::Context& station_context);
+
+  /**
+   * Format a variable of the current station.
+   */
+  void format(const wreport::Var& var, const dballe::Level& level, const dballe::Trange& trange,
+              const dballe::Datetime& datetime,
+              std::string& topic, std::string& payload);
+
   void parse(const wreport::Var& var, const dballe::Level& level, const dballe::Trange& trange,
              const dballe::msg::Context& station_context,
              const dballe::Datetime& datetime,
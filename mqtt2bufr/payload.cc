@@ -0,0 +1,486 @@
+/*
+ * payload - MQTT payload decoder
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "payload.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#define PAYLOAD_NOT_OBJECT_MSG "Payload is not a valid JSON object (document is not a JSON object)"
+#define DATETIME_INVALID_MSG "Payload is not a valid JSON object (value associated to key \"t\" is not a valid datetime)"
+
+// Same limit of jansson
+#define MAX_DEPTH 2048
+
+namespace mqtt2bufr {
+
+namespace {
+
+inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+/**
+ * Read n digits.
+ */
+bool read_digits(const char*& p, const char* end, int n, int& res) {
+    if (end - p < n) return false;
+    res = 0;
+    for (int i = 0; i < n; ++i, ++p) {
+        if (!is_digit(*p)) return false;
+        res = res * 10 + (*p - '0');
+    }
+    return true;
+}
+
+int days_in_month(int year, int month) {
+    static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    if (month == 2 && (year % 4 == 0 && (year % 100 != 0 || year % 400 == 0)))
+        return 29;
+    return days[month - 1];
+}
+
+void append_utf8(std::string& out, unsigned cp) {
+    if (cp < 0x80) {
+        out += (char)cp;
+    } else if (cp < 0x800) {
+        out += (char)(0xc0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += (char)(0xe0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+    } else {
+        out += (char)(0xf0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3f));
+        out += (char)(0x80 | ((cp >> 6) & 0x3f));
+        out += (char)(0x80 | (cp & 0x3f));
+    }
+}
+
+bool read_hex4(const char*& p, const char* end, unsigned& res) {
+    if (end - p < 4) return false;
+    res = 0;
+    for (int i = 0; i < 4; ++i, ++p) {
+        res <<= 4;
+        if (*p >= '0' && *p <= '9') res |= *p - '0';
+        else if (*p >= 'a' && *p <= 'f') res |= *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F') res |= *p - 'A' + 10;
+        else return false;
+    }
+    return true;
+}
+
+}
+
+dballe::Datetime parse_datetime(const char* str, std::size_t size) {
+    const char* p = str;
+    const char* end = str + size;
+    int ye, mo, da, ho, mi = 0, se = 0;
+    if (!read_digits(p, end, 4, ye) || p == end || *p++ != '-' ||
+        !read_digits(p, end, 2, mo) || p == end || *p++ != '-' ||
+        !read_digits(p, end, 2, da) || p == end || (*p != 'T' && *p != ' '))
+        throw std::runtime_error(DATETIME_INVALID_MSG);
+    ++p;
+    if (!read_digits(p, end, 2, ho))
+        throw std::runtime_error(DATETIME_INVALID_MSG);
+    if (p != end && *p == ':') {
+        ++p;
+        if (!read_digits(p, end, 2, mi))
+            throw std::runtime_error(DATETIME_INVALID_MSG);
+        if (p != end && *p == ':') {
+            ++p;
+            if (!read_digits(p, end, 2, se))
+                throw std::runtime_error(DATETIME_INVALID_MSG);
+        }
+    }
+    if (p != end && *p == 'Z')
+        ++p;
+    if (p != end)
+        throw std::runtime_error(DATETIME_INVALID_MSG);
+    if (mo < 1 || mo > 12 || da < 1 || da > days_in_month(ye, mo) ||
+        ho > 23 || mi > 59 || se > 60)
+        throw std::runtime_error(DATETIME_INVALID_MSG);
+    return dballe::Datetime(ye, mo, da, ho, mi, se);
+}
+
+void PayloadDecoder::skip_ws() {
+    while (cur != end && (*cur == ' ' || *cur == '\t' || *cur == '\n' || *cur == '\r'))
+        ++cur;
+}
+
+bool PayloadDecoder::read_string(std::string& buf, const char*& data, std::size_t& size) {
+    // cur is on the opening quote
+    const char* start = ++cur;
+    // Fast path: no escapes, the string is a slice of the payload
+    while (cur != end && *cur != '"' && *cur != '\\') {
+        if ((unsigned char)*cur < 0x20) return false;
+        ++cur;
+    }
+    if (cur == end) return false;
+    if (*cur == '"') {
+        data = start;
+        size = cur - start;
+        ++cur;
+        return true;
+    }
+    // Slow path: unescape in buf
+    buf.assign(start, cur - start);
+    while (cur != end && *cur != '"') {
+        char c = *cur++;
+        if ((unsigned char)c < 0x20) return false;
+        if (c != '\\') {
+            buf += c;
+            continue;
+        }
+        if (cur == end) return false;
+        switch (*cur++) {
+            case '"': buf += '"'; break;
+            case '\\': buf += '\\'; break;
+            case '/': buf += '/'; break;
+            case 'b': buf += '\b'; break;
+            case 'f': buf += '\f'; break;
+            case 'n': buf += '\n'; break;
+            case 'r': buf += '\r'; break;
+            case 't': buf += '\t'; break;
+            case 'u': {
+                unsigned cp;
+                if (!read_hex4(cur, end, cp)) return false;
+                if (cp >= 0xd800 && cp <= 0xdbff) {
+                    // Surrogate pair
+                    unsigned lo;
+                    if (end - cur < 2 || cur[0] != '\\' || cur[1] != 'u') return false;
+                    cur += 2;
+                    if (!read_hex4(cur, end, lo) || lo < 0xdc00 || lo > 0xdfff) return false;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+                    return false;
+                }
+                // NUL characters are not allowed
+                if (cp == 0) return false;
+                append_utf8(buf, cp);
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    if (cur == end) return false;
+    ++cur;
+    data = buf.data();
+    size = buf.size();
+    return true;
+}
+
+bool PayloadDecoder::read_string(std::string& out) {
+    const char* data;
+    std::size_t size;
+    if (!read_string(out, data, size)) return false;
+    if (data != out.data())
+        out.assign(data, size);
+    return true;
+}
+
+bool PayloadDecoder::read_number(Type& type, long long& i, double& d) {
+    const char* start = cur;
+    bool real = false;
+    if (cur != end && *cur == '-') ++cur;
+    if (cur == end || !is_digit(*cur)) return false;
+    // No leading zeros
+    if (*cur == '0' && cur + 1 != end && is_digit(cur[1])) return false;
+    while (cur != end && is_digit(*cur)) ++cur;
+    if (cur != end && *cur == '.') {
+        real = true;
+        ++cur;
+        if (cur == end || !is_digit(*cur)) return false;
+        while (cur != end && is_digit(*cur)) ++cur;
+    }
+    if (cur != end && (*cur == 'e' || *cur == 'E')) {
+        real = true;
+        ++cur;
+        if (cur != end && (*cur == '+' || *cur == '-')) ++cur;
+        if (cur == end || !is_digit(*cur)) return false;
+        while (cur != end && is_digit(*cur)) ++cur;
+    }
+    if (!real) {
+        const char* p = start;
+        bool neg = *p == '-';
+        if (neg) ++p;
+        unsigned long long v = 0;
+        const unsigned long long limit = neg ? 9223372036854775808ULL : 9223372036854775807ULL;
+        for (; p != cur; ++p) {
+            unsigned digit = *p - '0';
+            // Too big integers are an error, as in jansson
+            if (v > (limit - digit) / 10) return false;
+            v = v * 10 + digit;
+        }
+        i = neg ? (long long)(0 - v) : (long long)v;
+        type = INTEGER;
+        return true;
+    }
+    // strtod needs a NUL terminated string
+    char tmp[64];
+    if ((std::size_t)(cur - start) >= sizeof(tmp)) {
+        std::string s(start, cur);
+        d = strtod(s.c_str(), NULL);
+    } else {
+        memcpy(tmp, start, cur - start);
+        tmp[cur - start] = 0;
+        d = strtod(tmp, NULL);
+    }
+    if (std::isinf(d)) return false;
+    type = REAL;
+    return true;
+}
+
+bool PayloadDecoder::read_literal(const char* lit, std::size_t len) {
+    if ((std::size_t)(end - cur) < len || memcmp(cur, lit, len) != 0) return false;
+    cur += len;
+    return true;
+}
+
+bool PayloadDecoder::skip_value(int depth) {
+    if (depth > MAX_DEPTH) return false;
+    skip_ws();
+    if (cur == end) return false;
+    switch (*cur) {
+        case '"': {
+            const char* data;
+            std::size_t size;
+            return read_string(key_buf, data, size);
+        }
+        case '{':
+        case '[': {
+            char close = *cur == '{' ? '}' : ']';
+            bool object = *cur == '{';
+            ++cur;
+            skip_ws();
+            if (cur != end && *cur == close) {
+                ++cur;
+                return true;
+            }
+            for (;;) {
+                if (object) {
+                    skip_ws();
+                    if (cur == end || *cur != '"') return false;
+                    const char* data;
+                    std::size_t size;
+                    if (!read_string(key_buf, data, size)) return false;
+                    skip_ws();
+                    if (cur == end || *cur++ != ':') return false;
+                }
+                if (!skip_value(depth + 1)) return false;
+                skip_ws();
+                if (cur == end) return false;
+                if (*cur == ',') {
+                    ++cur;
+                    continue;
+                }
+                if (*cur++ != close) return false;
+                return true;
+            }
+        }
+        case 't': return read_literal("true", 4);
+        case 'f': return read_literal("false", 5);
+        case 'n': return read_literal("null", 4);
+        default: {
+            Type type;
+            long long i;
+            double d;
+            return read_number(type, i, d);
+        }
+    }
+}
+
+bool PayloadDecoder::read_value(Type& type, std::string& s, long long& i, double& d) {
+    skip_ws();
+    if (cur == end) return false;
+    switch (*cur) {
+        case '"':
+            type = STRING;
+            return read_string(s);
+        case 'n':
+            type = NUL;
+            return read_literal("null", 4);
+        case '{':
+        case '[':
+        case 't':
+        case 'f':
+            type = OTHER;
+            return skip_value(1);
+        default:
+            return read_number(type, i, d);
+    }
+}
+
+bool PayloadDecoder::read_attributes() {
+    // cur is on the opening brace
+    ++cur;
+    attributes_count = 0;
+    skip_ws();
+    if (cur != end && *cur == '}') {
+        ++cur;
+        return true;
+    }
+    for (;;) {
+        skip_ws();
+        if (cur == end || *cur != '"') return false;
+        if (attributes.size() <= attributes_count)
+            attributes.resize(attributes_count + 1);
+        Attribute& attr = attributes[attributes_count++];
+        if (!read_string(attr.code)) return false;
+        skip_ws();
+        if (cur == end || *cur++ != ':') return false;
+        skip_ws();
+        if (cur != end && *cur == '"') {
+            attr.is_string = true;
+            if (!read_string(attr.value)) return false;
+        } else {
+            attr.is_string = false;
+            if (!skip_value(2)) return false;
+        }
+        skip_ws();
+        if (cur == end) return false;
+        if (*cur == ',') {
+            ++cur;
+            continue;
+        }
+        return *cur++ == '}';
+    }
+}
+
+bool PayloadDecoder::read_values() {
+    // cur is on the opening brace
+    ++cur;
+    values_count = 0;
+    skip_ws();
+    if (cur != end && *cur == '}') {
+        ++cur;
+        return true;
+    }
+    for (;;) {
+        skip_ws();
+        if (cur == end || *cur != '"') return false;
+        if (values.size() <= values_count)
+            values.resize(values_count + 1);
+        Value& value = values[values_count++];
+        if (!read_string(value.code)) return false;
+        skip_ws();
+        if (cur == end || *cur++ != ':') return false;
+        if (!read_value(value.type, value.string, value.integer, value.real))
+            return false;
+        skip_ws();
+        if (cur == end) return false;
+        if (*cur == ',') {
+            ++cur;
+            continue;
+        }
+        return *cur++ == '}';
+    }
+}
+
+bool PayloadDecoder::read_object() {
+    skip_ws();
+    if (cur == end || *cur != '{') return false;
+    ++cur;
+    skip_ws();
+    if (cur != end && *cur == '}') {
+        ++cur;
+        return true;
+    }
+    for (;;) {
+        skip_ws();
+        if (cur == end || *cur != '"') return false;
+        const char* key;
+        std::size_t key_size;
+        if (!read_string(key_buf, key, key_size)) return false;
+        skip_ws();
+        if (cur == end || *cur++ != ':') return false;
+        if (key_size == 1 && key[0] == 'v') {
+            skip_ws();
+            if (cur != end && *cur == '{') {
+                value_type = OBJECT;
+                if (!read_values()) return false;
+            } else if (!read_value(value_type, value_string, value_integer, value_real)) {
+                return false;
+            }
+        } else if (key_size == 1 && key[0] == 't') {
+            skip_ws();
+            if (cur != end && *cur == '"') {
+                datetime_type = STRING;
+                if (!read_string(datetime_buf, datetime_data, datetime_size))
+                    return false;
+            } else if (cur != end && *cur == 'n') {
+                datetime_type = NUL;
+                if (!read_literal("null", 4)) return false;
+            } else {
+                datetime_type = OTHER;
+                if (!skip_value(1)) return false;
+            }
+        } else if (key_size == 1 && key[0] == 'a') {
+            skip_ws();
+            if (cur != end && *cur == '{') {
+                attributes_type = OBJECT;
+                if (!read_attributes()) return false;
+            } else {
+                attributes_type = OTHER;
+                attributes_count = 0;
+                if (!skip_value(1)) return false;
+            }
+        } else {
+            if (!skip_value(1)) return false;
+        }
+        skip_ws();
+        if (cur == end) return false;
+        if (*cur == ',') {
+            ++cur;
+            continue;
+        }
+        return *cur++ == '}';
+    }
+}
+
+void PayloadDecoder::decode(const char* buf, std::size_t size) {
+    value_type = MISSING;
+    values_count = 0;
+    datetime_type = MISSING;
+    datetime_data = nullptr;
+    datetime_size = 0;
+    attributes_type = MISSING;
+    attributes_count = 0;
+
+    cur = buf;
+    // As json_loads(), stop at the first NUL
+    const char* nul = (const char*)memchr(buf, 0, size);
+    end = nul ? nul : buf + size;
+
+    bool ok = read_object();
+    if (ok) {
+        skip_ws();
+        ok = cur == end;
+    }
+    if (!ok)
+        throw std::runtime_error(PAYLOAD_NOT_OBJECT_MSG);
+}
+
+}
@@ -0,0 +1,127 @@
+/*
+ * payload - MQTT payload decoder
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_PAYLOAD_H
+#define MQTT2BUFR_PAYLOAD_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <dballe/types.h>
+
+namespace mqtt2bufr {
+
+/**
+ * Parse a datetime `YYYY-mm-ddTHH[:MM[:SS]]` (the separator can also be a
+ * space), with an optional trailing `Z`.
+ *
+ * @throw std::runtime_error if the datetime is not valid.
+ */
+dballe::Datetime parse_datetime(const char* str, std::size_t size);
+
+/**
+ * Streaming decoder for the payload `{ "v": VALUE, "t": "DATETIME", "a": {
+ * "BXXYYY": "...", } }`, where VALUE can also be an object `{ "BXXYYY":
+ * VALUE, ... }` with many values.
+ *
+ * The payload is decoded in place: values are copied only when they are
+ * strings, in buffers that are reused from one payload to the next. Keys
+ * other than "v", "t" and "a" are validated and skipped. As with jansson,
+ * the payload ends at the first NUL character and the last of duplicated
+ * keys wins.
+ */
+class PayloadDecoder {
+ public:
+  enum Type {
+    MISSING,
+    NUL,
+    STRING,
+    INTEGER,
+    REAL,
+    OBJECT,
+    OTHER,
+  };
+
+  struct Attribute {
+    std::string code;
+    std::string value;
+    bool is_string;
+  };
+
+  struct Value {
+    std::string code;
+    Type type;
+    std::string string;
+    long long integer;
+    double real;
+  };
+
+  /// Type and value of "v"
+  Type value_type;
+  std::string value_string;
+  long long value_integer;
+  double value_real;
+
+  /// Values of "v", when it is an object: only the first values_count
+  /// items are valid
+  std::vector<Value> values;
+  std::size_t values_count;
+
+  /// Type and value of "t"; the string is valid until the next decode()
+  Type datetime_type;
+  const char* datetime_data;
+  std::size_t datetime_size;
+
+  /// Type of "a"
+  Type attributes_type;
+  /// Attributes: only the first attributes_count items are valid
+  std::vector<Attribute> attributes;
+  std::size_t attributes_count;
+
+  /**
+   * Decode a payload.
+   *
+   * @throw std::runtime_error if the payload is not a JSON object.
+   */
+  void decode(const char* buf, std::size_t size);
+
+ protected:
+  const char* cur;
+  const char* end;
+  std::string datetime_buf;
+  std::string key_buf;
+
+  void skip_ws();
+  bool read_string(std::string& buf, const char*& data, std::size_t& size);
+  bool read_string(std::string& out);
+  bool read_number(Type& type, long long& i, double& d);
+  bool read_literal(const char* lit, std::size_t len);
+  bool skip_value(int depth);
+  bool read_value(Type& type, std::string& s, long long& i, double& d);
+  bool read_attributes();
+  bool read_values();
+  bool read_object();
+};
+
+}
+
+#endif
@@ -0,0 +1,323 @@
+/*
+ * queue - Queues for the multi-threaded pipelines
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_QUEUE_H
+#define MQTT2BUFR_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace mqtt2bufr {
+
+/**
+ * Bounded multi-producer multi-consumer queue.
+ *
+ * try_push() and try_pop() are lock-free (a ring of sequenced cells); the
+ * mutex is only taken by push() and pop() when they have to sleep because
+ * the queue is full or empty.
+ */
+template<typename T>
+class BoundedQueue {
+ protected:
+  struct Cell {
+    std::atomic<std::size_t> seq;
+    T data;
+  };
+
+  std::unique_ptr<Cell[]> cells;
+  std::size_t mask;
+  alignas(64) std::atomic<std::size_t> push_pos;
+  alignas(64) std::atomic<std::size_t> pop_pos;
+  std::atomic<bool> closed;
+  std::atomic<int> waiting_push;
+  std::atomic<int> waiting_pop;
+  std::mutex mutex;
+  std::condition_variable cond_push;
+  std::condition_variable cond_pop;
+
+  void wake(std::atomic<int>& waiting, std::condition_variable& cond) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load() > 0) {
+      std::lock_guard<std::mutex> lock(mutex);
+      cond.notify_one();
+    }
+  }
+
+ public:
+  /**
+   * @param capacity the capacity, rounded up to a power of 2
+   */
+  explicit BoundedQueue(std::size_t capacity)
+      : push_pos(0), pop_pos(0), closed(false), waiting_push(0), waiting_pop(0) {
+    std::size_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+    cells.reset(new Cell[size]);
+    mask = size - 1;
+    for (std::size_t i = 0; i < size; ++i)
+      cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  std::size_t capacity() const { return mask + 1; }
+
+  bool can_push() const {
+    std::size_t pos = push_pos.load(std::memory_order_relaxed);
+    return cells[pos & mask].seq.load(std::memory_order_acquire) == pos;
+  }
+
+  bool can_pop() const {
+    std::size_t pos = pop_pos.load(std::memory_order_relaxed);
+    return cells[pos & mask].seq.load(std::memory_order_acquire) == pos + 1;
+  }
+
+  /**
+   * Enqueue an item, if the queue is not full.
+   */
+  bool try_push(T& item) {
+    std::size_t pos = push_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = cells[pos & mask];
+      std::size_t seq = cell.seq.load(std::memory_order_acquire);
+      std::intptr_t diff = (std::intptr_t)seq - (std::intptr_t)pos;
+      if (diff == 0) {
+        if (push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.data = std::move(item);
+          cell.seq.store(pos + 1, std::memory_order_release);
+          wake(waiting_pop, cond_pop);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = push_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /**
+   * Dequeue an item, if the queue is not empty.
+   */
+  bool try_pop(T& item) {
+    std::size_t pos = pop_pos.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = cells[pos & mask];
+      std::size_t seq = cell.seq.load(std::memory_order_acquire);
+      std::intptr_t diff = (std::intptr_t)seq - (std::intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (pop_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          item = std::move(cell.data);
+          cell.seq.store(pos + mask + 1, std::memory_order_release);
+          wake(waiting_push, cond_push);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = pop_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /**
+   * Enqueue an item, waiting while the queue is full.
+   *
+   * @return false if the queue was closed
+   */
+  bool push(T& item) {
+    if (try_push(item)) return true;
+    ++waiting_push;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool res;
+    while (!(res = try_push(item)) && !closed) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!can_push() && !closed)
+        cond_push.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    --waiting_push;
+    return res;
+  }
+
+  /**
+   * Dequeue an item, waiting while the queue is empty.
+   *
+   * @return false if the queue is empty and closed
+   */
+  bool pop(T& item) {
+    if (try_pop(item)) return true;
+    ++waiting_pop;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool res;
+    while (!(res = try_pop(item)) && !closed) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!can_pop() && !closed)
+        cond_pop.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    // The queue may have been filled just before closing it
+    if (!res)
+      res = try_pop(item);
+    --waiting_pop;
+    return res;
+  }
+
+  /**
+   * Wake up all the waiting threads: push() fails, pop() fails once the
+   * queue is empty.
+   */
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    cond_push.notify_all();
+    cond_pop.notify_all();
+  }
+};
+
+/**
+ * Collect the results of parallel workers and give them back in the same
+ * order of the sequence numbers of their inputs.
+ *
+ * A producer can bound the inputs in flight, from when they are queued to
+ * when their result is taken with get(), by reserving a place for each
+ * input with reserve() or try_reserve().
+ */
+template<typename T>
+class OrderedResults {
+ protected:
+  std::map<std::uint64_t, T> pending;
+  std::uint64_t next = 0;
+  std::size_t window;
+  std::size_t reserved = 0;
+  bool closed = false;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::condition_variable cond_reserve;
+
+ public:
+  /**
+   * @param window the maximum number of reserved places
+   */
+  explicit OrderedResults(std::size_t window = SIZE_MAX) : window(window) {}
+
+  /**
+   * Reserve a place for the result of an input, if less than window inputs
+   * are in flight.
+   *
+   * @return false if the window is full or closed
+   */
+  bool try_reserve() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (closed || reserved >= window)
+      return false;
+    ++reserved;
+    return true;
+  }
+
+  /**
+   * Reserve a place for the result of an input, waiting while window
+   * inputs are in flight.
+   *
+   * @return false if closed
+   */
+  bool reserve() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!closed && reserved >= window)
+      cond_reserve.wait(lock);
+    if (closed)
+      return false;
+    ++reserved;
+    return true;
+  }
+
+  /**
+   * Give back a reserved place, when its input was not queued.
+   */
+  void release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (reserved > 0)
+      --reserved;
+    cond_reserve.notify_one();
+  }
+
+  /**
+   * Add the result for the input with sequence number seq.
+   */
+  void put(std::uint64_t seq, T&& result) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending.insert(std::make_pair(seq, std::move(result)));
+    if (seq == next)
+      cond.notify_one();
+  }
+
+  /**
+   * Wait for the next result in sequence.
+   *
+   * @param timeout maximum wait time
+   * @return false on timeout, or if closed and no more results are pending
+   */
+  template<typename Duration>
+  bool get(T& result, Duration timeout) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (;;) {
+      auto i = pending.find(next);
+      if (i != pending.end()) {
+        result = std::move(i->second);
+        pending.erase(i);
+        ++next;
+        if (reserved > 0) {
+          --reserved;
+          cond_reserve.notify_one();
+        }
+        return true;
+      }
+      if (closed)
+        return false;
+      if (cond.wait_until(lock, deadline) == std::cv_status::timeout)
+        return false;
+    }
+  }
+
+  /**
+   * No more results will be added: get() stops waiting, and no more places
+   * can be reserved.
+   */
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    cond.notify_all();
+    cond_reserve.notify_all();
+  }
+
+  bool finished() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return closed && pending.find(next) == pending.end();
+  }
+};
+
+}
+
+#endif
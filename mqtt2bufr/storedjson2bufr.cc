@@ -23,39 +23,349 @@
 #include "config.h"
 #endif
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
 #include <string>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <getopt.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <dballe/msg/msg.h>
 #include <dballe/msg/wr_codec.h>
-#include <dballe/core/record.h>
 
 #include "parser.h"
+#include "batch.h"
+#include "queue.h"
+#include "payload.h"
+#include "storeindex.h"
 
+/// Size of a record stored by the station
+static const std::size_t RECORD_SIZE = mqtt2bufr::StoreIndex::RECORD_SIZE;
+/// Number of records converted by a worker at a time: a block of the index
+static const std::size_t CHUNK_RECORDS = mqtt2bufr::StoreIndex::BLOCK_RECORDS;
+/// Minimum interval between two saves of the checkpoint in the index
+static const int CHECKPOINT_SECONDS = 10;
 
-struct FpRAII {
-    FILE* fp = nullptr;
-    bool close_on_exit = false;
+enum {
+    OPT_BATCH = 256,
+    OPT_WORKERS,
+    OPT_SINCE,
+};
 
-    FpRAII(const std::string& name) {
-        if (name == "-") {
-            fp = stdin;
-            close_on_exit = false;
-        } else {
-            fp = fopen(name.c_str(), "r");
-            close_on_exit = true;
-            if (fp == nullptr)
+/**
+ * The records of a file: regular files are memory mapped, the other ones
+ * (e.g. a pipe on stdin) are read in memory. For regular files, the bitmap
+ * of the records sent written by the station is read too.
+ */
+struct Input {
+    std::string name;
+    const char* data = nullptr;
+    std::size_t size = 0;
+    std::int64_t mtime = 0;
+    bool regular = false;
+    void* map = MAP_FAILED;
+    std::size_t map_size = 0;
+    std::string buf;
+    /// Bitmap of the records sent written by the station, if any
+    std::vector<std::uint8_t> sent;
+    bool has_sent = false;
+    std::uint64_t sent_size = 0;
+    std::int64_t sent_mtime = 0;
+
+    Input(const std::string& name) : name(name) {
+        int fd = 0;
+        if (name != "-") {
+            fd = open(name.c_str(), O_RDONLY);
+            if (fd == -1)
                 throw std::runtime_error("Cannot open file " + name);
         }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            regular = true;
+            mtime = st.st_mtime;
+        }
+        if (regular && st.st_size > 0) {
+            map_size = st.st_size;
+            map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (map != MAP_FAILED) {
+            madvise(map, map_size, MADV_SEQUENTIAL);
+            data = (const char*)map;
+            size = map_size;
+        } else {
+            char tmp[65536];
+            ssize_t n;
+            while ((n = read(fd, tmp, sizeof(tmp))) != 0) {
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n == -1) {
+                    if (fd != 0)
+                        close(fd);
+                    throw std::runtime_error("Cannot read file " + name);
+                }
+                buf.append(tmp, n);
+            }
+            data = buf.data();
+            size = buf.size();
+        }
+        if (fd != 0)
+            close(fd);
+        if (regular)
+            has_sent = mqtt2bufr::StoreIndex::load_sent(
+                mqtt2bufr::StoreIndex::sent_path(name), records(),
+                sent, sent_size, sent_mtime);
+    }
+    ~Input() {
+        if (map != MAP_FAILED)
+            munmap(map, map_size);
+    }
+    Input(const Input&) = delete;
+    Input& operator=(const Input&) = delete;
+
+    /// Number of complete records
+    std::size_t records() const { return size / RECORD_SIZE; }
+
+    /// Check if the record was sent: its first byte is set, or the station
+    /// marked it in its bitmap
+    bool is_sent(std::size_t record) const {
+        return data[record * RECORD_SIZE]
+            || (has_sent && (sent[record >> 3] & (1 << (record & 7))));
+    }
+};
+
+/**
+ * Output of the conversion of a chunk of records.
+ */
+struct Result {
+    std::string bufr;
+    std::string errors;
+    bool ok = true;
+};
+
+/**
+ * Convert records to BUFR. Every worker has its own converter, so that the
+ * parser and the exporter are reused.
+ */
+struct Converter {
+    mqtt2bufr::Parser parser;
+    dballe::msg::BufrExporter exporter;
+    mqtt2bufr::Batch batch;
+    bool exclude_sent;
+    std::size_t batch_size;
+    dballe::Datetime since;
+
+    Converter(bool exclude_sent, std::size_t batch_size, const dballe::Datetime& since)
+        : exclude_sent(exclude_sent), batch_size(batch_size), since(since) {}
+
+    void error(const Input& input, const std::string& msg, Result& res) {
+        res.ok = false;
+        res.errors += "Error while parsing " + input.name + msg + "\n";
+    }
+
+    /**
+     * Convert count records, starting from the record first.
+     *
+     * If index is not null, the sent flags are read from the index.
+     */
+    void convert(const Input& input, const mqtt2bufr::StoreIndex* index,
+                 std::size_t first, std::size_t count, Result& res) {
+        const char* buf = input.data + first * RECORD_SIZE;
+        for (std::size_t i = first; i < first + count; ++i, buf += RECORD_SIZE) {
+            bool already_sent = index ? index->is_sent(i) : input.is_sent(i);
+            if (exclude_sent and already_sent)
+                continue;
+
+            const char* sep = (const char*)memchr(buf + 1, ';', RECORD_SIZE - 1);
+            if (sep == nullptr || sep < buf + 2) {
+                error(input, ": record without topic separator", res);
+                continue;
+            }
+
+            // Topic and payload are NUL padded
+            const char* topic = buf + 1;
+            std::size_t topic_size = strnlen(topic, sep - 1 - topic);
+            const char* payload = sep + 1;
+            std::size_t payload_size = buf + RECORD_SIZE - payload;
+
+            try {
+                dballe::Msg msg = parser.parse(topic, topic_size, payload, payload_size);
+                if (!since.is_missing() && msg.get_datetime() < since)
+                    continue;
+                if (batch_size > 1) {
+                    batch.add(msg);
+                    if (batch.size() >= batch_size && !batch.flush(res.bufr))
+                        res.ok = false;
+                } else {
+                    dballe::Messages msgs;
+                    msgs.append(msg);
+                    res.bufr += exporter.to_binary(msgs);
+                }
+            } catch (const std::exception& e) {
+                error(input, "[" + std::string(topic, topic_size)
+                      + " " + std::string(payload, payload_size) + "]"
+                      + ": " + e.what(), res);
+            }
+        }
+        if (!batch.empty() && !batch.flush(res.bufr))
+            res.ok = false;
+    }
+};
+
+struct Job {
+    const Input* input = nullptr;
+    const mqtt2bufr::StoreIndex* index = nullptr;
+    std::size_t first = 0;
+    std::size_t count = 0;
+    std::uint64_t seq = 0;
+};
+
+typedef mqtt2bufr::BoundedQueue<Job> JobQueue;
+typedef mqtt2bufr::OrderedResults<Result> ResultQueue;
+
+void worker(JobQueue& jobs, ResultQueue& results, bool exclude_sent,
+            std::size_t batch_size, dballe::Datetime since)
+{
+    Converter converter(exclude_sent, batch_size, since);
+    Job job;
+    while (jobs.pop(job)) {
+        Result res;
+        converter.convert(*job.input, job.index, job.first, job.count, res);
+        results.put(job.seq, std::move(res));
+    }
+}
+
+/**
+ * Load the index of a file, or build it if it is missing or outdated.
+ */
+void load_index(const Input& input, mqtt2bufr::StoreIndex& index)
+{
+    std::string path = mqtt2bufr::StoreIndex::path(input.name);
+    if (index.load(path) && index.matches(input.size, input.mtime,
+                                          input.sent_size, input.sent_mtime))
+        return;
+    // The checkpoint is kept if the file has only grown
+    if (input.size < index.file_size)
+        index.checkpoint = 0;
+    index.build(input.data, input.size, input.mtime,
+                input.has_sent ? &input.sent : nullptr);
+    index.sent_size = input.sent_size;
+    index.sent_mtime = input.sent_mtime;
+}
+
+/**
+ * Select the chunks of records to convert.
+ */
+void select_chunks(std::size_t first, std::size_t records,
+                   const mqtt2bufr::StoreIndex* index,
+                   bool exclude_sent, const dballe::Datetime& since,
+                   std::vector<std::pair<std::size_t, std::size_t>>& chunks)
+{
+    std::int64_t since_seconds = since.is_missing()
+        ? std::numeric_limits<std::int64_t>::min()
+        : mqtt2bufr::StoreIndex::to_seconds(since);
+    chunks.clear();
+    while (first < records) {
+        std::size_t block = first / CHUNK_RECORDS;
+        std::size_t end = std::min((block + 1) * CHUNK_RECORDS, records);
+        bool skip = false;
+        if (index) {
+            const mqtt2bufr::StoreIndex::Block& b = index->blocks[block];
+            // Blocks with all the records sent, or with the records not
+            // yet sent older than since
+            if (exclude_sent && (b.unsent == 0 || b.time_max < since_seconds))
+                skip = true;
+        }
+        if (!skip)
+            chunks.push_back(std::make_pair(first, end - first));
+        first = end;
+    }
+}
+
+bool write_result(const Result& res)
+{
+    std::cout.write(res.bufr.data(), res.bufr.size());
+    std::cerr << res.errors;
+    return res.ok;
+}
+
+/**
+ * The checkpoint of a file in its index: the end of the last chunk written,
+ * as long as all the chunks before it were written without errors. It is
+ * saved at most every CHECKPOINT_SECONDS while converting, and at the end.
+ */
+class Checkpoint {
+    mqtt2bufr::StoreIndex* index;
+    std::string path;
+    bool failed = false;
+    std::size_t saved;
+    std::chrono::steady_clock::time_point saved_time;
+
+ public:
+    /**
+     * @param index the index of the file, or nullptr when there is none
+     */
+    Checkpoint(mqtt2bufr::StoreIndex* index, const std::string& file)
+        : index(index), path(mqtt2bufr::StoreIndex::path(file)),
+          saved(index ? index->checkpoint : 0),
+          saved_time(std::chrono::steady_clock::now()) {}
+
+    /**
+     * Record that the chunk of records ending at end was written (ok) or
+     * not.
+     *
+     * @return false if the index cannot be saved
+     */
+    bool written(std::size_t end, bool ok) {
+        if (!index)
+            return true;
+        if (!ok)
+            failed = true;
+        else if (!failed && end > index->checkpoint)
+            index->checkpoint = end;
+        if (index->checkpoint == saved || std::chrono::steady_clock::now() - saved_time
+                < std::chrono::seconds(CHECKPOINT_SECONDS))
+            return true;
+        return save();
+    }
+
+    /**
+     * All the chunks were written: the records after the last chunk had
+     * nothing to convert.
+     *
+     * @return false if the index cannot be saved
+     */
+    bool finish(std::size_t records) {
+        if (!index)
+            return true;
+        if (!failed)
+            index->checkpoint = records;
+        return save();
     }
-    ~FpRAII() {
-        if (close_on_exit)
-            fclose(fp);
+
+ protected:
+    bool save() {
+        saved = index->checkpoint;
+        saved_time = std::chrono::steady_clock::now();
+        try {
+            index->save(path);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return false;
+        }
+        return true;
     }
 };
 
@@ -67,7 +377,18 @@ void print_help(std::ostream& out)
         << "Options are" << std::endl
         << " --help             show this help and exit" << std::endl
         << " --version          show version and exit" << std::endl
-        << " --exclude-sent     exclude records already sent" << std::endl
+        << " --exclude-sent     exclude records already sent, also the ones marked in" << std::endl
+        << "                    the bitmap FILE.snt of the station" << std::endl
+        << " --batch N          group up to N records with the same station and date" << std::endl
+        << "                    in a BUFR (default: 1)" << std::endl
+        << " --workers N        convert the records in N threads (default: number of" << std::endl
+        << "                    CPUs; 0 converts them in the main thread)" << std::endl
+        << " --index            use the index FILE.idx of the sent records, building" << std::endl
+        << "                    it if missing or outdated, and save it with the" << std::endl
+        << "                    number of records converted as checkpoint" << std::endl
+        << " --resume           with --index, start from the checkpoint" << std::endl
+        << " --since DATETIME   exclude records older than DATETIME" << std::endl
+        << "                    (YYYY-mm-ddTHH:MM:SS)" << std::endl
         << std::endl
         << "Report bugs to: " << PACKAGE_BUGREPORT << std::endl;
         ;
@@ -83,6 +404,11 @@ int main(int argc, char** argv)
     static int show_help = 0;
     static int show_version = 0;
     static int exclude_sent = 0;
+    static int use_index = 0;
+    static int resume = 0;
+    dballe::Datetime since;
+    int batch_size = 1;
+    int workers = std::thread::hardware_concurrency();
     std::vector<std::string> files;
 
     while (1) {
@@ -92,6 +418,11 @@ int main(int argc, char** argv)
             { "help", no_argument, &show_help, 1 },
             { "version", no_argument, &show_version, 1 },
             { "exclude-sent", no_argument, &exclude_sent, 1},
+            { "batch", required_argument, 0, OPT_BATCH },
+            { "workers", required_argument, 0, OPT_WORKERS },
+            { "index", no_argument, &use_index, 1 },
+            { "resume", no_argument, &resume, 1 },
+            { "since", required_argument, 0, OPT_SINCE },
             { 0, 0, 0, 0 }
         };
 
@@ -110,6 +441,24 @@ int main(int argc, char** argv)
                   return 0;
                 }
                 break;
+            case OPT_BATCH:
+                batch_size = atoi(optarg);
+                if (batch_size < 1) {
+                    std::cerr << "Invalid batch size " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case OPT_WORKERS:
+                workers = atoi(optarg);
+                break;
+            case OPT_SINCE:
+                try {
+                    since = mqtt2bufr::parse_datetime(optarg, strlen(optarg));
+                } catch (const std::exception& e) {
+                    std::cerr << "Invalid datetime " << optarg << std::endl;
+                    return 1;
+                }
+                break;
             default:
                 print_help(std::cerr);
                 return 1;
@@ -123,35 +472,88 @@ int main(int argc, char** argv)
         files.push_back("-");
 
     int return_value = 0;
-    for (auto file: files) {
-        FpRAII f(file);
-        char buf[128];
-        while (fread(buf, sizeof(buf), 1, f.fp)) {
-            bool already_sent = buf[0];
-            if (exclude_sent and already_sent)
-                continue;
-            dballe::Messages msgs;
-            dballe::msg::BufrExporter exporter;
-            mqtt2bufr::Parser parser;
 
-	    char *sep = (char*)memchr( buf+1, ';', 127);
-	    
-	    std::string topic(buf + 1, sep - 1);
-            std::string payload(sep + 1, buf + 128);
+    // Chunks are sent to the workers at most window at a time, so that the
+    // results waiting to be written are bounded
+    const std::size_t window = workers > 0 ? 2 * workers : 1;
+    JobQueue jobs(window);
+    ResultQueue results;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; ++i)
+        threads.emplace_back(worker, std::ref(jobs), std::ref(results),
+                             exclude_sent, batch_size, since);
+    Converter converter(exclude_sent, batch_size, since);
+    std::vector<std::pair<std::size_t, std::size_t>> chunks;
+    std::uint64_t pushed = 0;
+    std::uint64_t written = 0;
 
+    for (auto file: files) {
+        std::unique_ptr<Input> input;
+        try {
+            input.reset(new Input(file));
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return_value = 1;
+            continue;
+        }
+        std::size_t records = input->records();
 
-	    try {
-                dballe::Msg msg = parser.parse(topic, payload);
-                msgs.append(msg);
-                std::cout << exporter.to_binary(msgs);
-            } catch (const std::exception& e) {
-                return_value = 1;
-                std::cerr << "Error while parsing "
-                    << file << "[" << topic << " " << payload << "]"
-                    << ": " << e.what() << std::endl;
+        mqtt2bufr::StoreIndex index;
+        const mqtt2bufr::StoreIndex* index_ptr = nullptr;
+        if (use_index && input->regular) {
+            load_index(*input, index);
+            index_ptr = &index;
+        } else if (use_index) {
+            std::cerr << "Cannot use an index for " << file << std::endl;
+        }
+        select_chunks(index_ptr && resume ? index.checkpoint : 0, records,
+                      index_ptr, exclude_sent, since, chunks);
+        Checkpoint checkpoint(index_ptr ? &index : nullptr, file);
+        // Sequence number of the first chunk of the file
+        const std::uint64_t first_seq = pushed;
+
+        for (std::size_t next = 0; next < chunks.size() || written < pushed; ) {
+            if (workers <= 0) {
+                Result res;
+                converter.convert(*input, index_ptr, chunks[next].first, chunks[next].second, res);
+                bool ok = write_result(res);
+                if (!ok)
+                    return_value = 1;
+                if (!checkpoint.written(chunks[next].first + chunks[next].second, ok))
+                    return_value = 1;
+                ++next;
+                continue;
+            }
+            while (next < chunks.size() && pushed - written < window) {
+                Job job;
+                job.input = input.get();
+                job.index = index_ptr;
+                job.first = chunks[next].first;
+                job.count = chunks[next].second;
+                job.seq = pushed++;
+                jobs.push(job);
+                ++next;
+            }
+            Result res;
+            if (results.get(res, std::chrono::seconds(1))) {
+                // The results come in order: this is the chunk written-first_seq
+                const std::pair<std::size_t, std::size_t>& chunk = chunks[written - first_seq];
+                ++written;
+                bool ok = write_result(res);
+                if (!ok)
+                    return_value = 1;
+                if (!checkpoint.written(chunk.first + chunk.second, ok))
+                    return_value = 1;
             }
         }
+
+        if (!checkpoint.finish(records))
+            return_value = 1;
     }
 
+    jobs.close();
+    for (auto& t: threads)
+        t.join();
+
     return return_value;
 }
@@ -0,0 +1,228 @@
+/*
+ * storeindex - Index of the records stored by the stations
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "storeindex.h"
+#include "payload.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <sys/stat.h>
+
+#define STOREINDEX_MAGIC "RMAPIDX2"
+
+namespace mqtt2bufr {
+
+namespace {
+
+/**
+ * Header of the index file, followed by the blocks and by the bitmap of the
+ * sent records. Integers are in host byte order.
+ */
+struct Header {
+    char magic[8];
+    std::uint32_t block_records;
+    std::uint32_t reserved;
+    std::uint64_t file_size;
+    std::int64_t file_mtime;
+    std::uint64_t sent_size;
+    std::int64_t sent_mtime;
+    std::uint64_t checkpoint;
+    std::uint64_t blocks;
+};
+
+/// Days since the epoch (proleptic Gregorian calendar)
+std::int64_t days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    const std::int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = (unsigned)(y - era * 400);
+    const unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (std::int64_t)doe - 719468;
+}
+
+/**
+ * Datetime of a record, if the payload has one.
+ */
+bool record_time(PayloadDecoder& decoder, const char* buf, std::int64_t& res) {
+    const char* sep = (const char*)memchr(buf + 1, ';', StoreIndex::RECORD_SIZE - 1);
+    if (sep == nullptr)
+        return false;
+    const char* payload = sep + 1;
+    try {
+        decoder.decode(payload, buf + StoreIndex::RECORD_SIZE - payload);
+        if (decoder.datetime_type != PayloadDecoder::STRING)
+            return false;
+        res = StoreIndex::to_seconds(parse_datetime(decoder.datetime_data, decoder.datetime_size));
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+}
+
+const std::size_t StoreIndex::RECORD_SIZE;
+const std::size_t StoreIndex::BLOCK_RECORDS;
+
+std::int64_t StoreIndex::to_seconds(const dballe::Datetime& dt) {
+    return days_from_civil(dt.year, dt.month, dt.day) * 86400
+        + dt.hour * 3600 + dt.minute * 60 + dt.second;
+}
+
+std::string StoreIndex::sent_path(const std::string& file) {
+    std::size_t slash = file.rfind('/');
+    std::size_t dot = file.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return file + ".snt";
+    return file.substr(0, dot) + ".snt";
+}
+
+bool StoreIndex::load_sent(const std::string& path, std::size_t records,
+                           std::vector<std::uint8_t>& bits,
+                           std::uint64_t& size, std::int64_t& mtime) {
+    bits.assign((records + 7) / 8, 0);
+    size = 0;
+    mtime = 0;
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr)
+        return false;
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0) {
+        size = st.st_size;
+        mtime = st.st_mtime;
+    }
+    unsigned char header[4];
+    if (fread(header, sizeof(header), 1, fp) == 1) {
+        std::uint32_t cursor = header[0] | (header[1] << 8) | (header[2] << 16)
+            | ((std::uint32_t)header[3] << 24);
+        std::size_t n = std::min<std::size_t>(cursor / RECORD_SIZE, records);
+        // Records before the cursor
+        std::fill(bits.begin(), bits.begin() + n / 8, 0xff);
+        for (std::size_t i = n & ~(std::size_t)7; i < n; ++i)
+            bits[i >> 3] |= 1 << (i & 7);
+        // Records marked one by one
+        std::vector<std::uint8_t> marked(bits.size());
+        std::size_t len = fread(marked.data(), 1, marked.size(), fp);
+        for (std::size_t i = 0; i < len; ++i)
+            bits[i] |= marked[i];
+        // Bits past the last record
+        if (records % 8 && !bits.empty())
+            bits.back() &= (1 << (records % 8)) - 1;
+    }
+    fclose(fp);
+    return true;
+}
+
+void StoreIndex::build(const char* data, std::size_t size, std::int64_t mtime,
+                       const std::vector<std::uint8_t>* station_sent) {
+    file_size = size;
+    file_mtime = mtime;
+    std::size_t n = records();
+    blocks.assign((n + BLOCK_RECORDS - 1) / BLOCK_RECORDS, Block());
+    sent.assign((n + 7) / 8, 0);
+    PayloadDecoder decoder;
+    for (std::size_t b = 0; b < blocks.size(); ++b) {
+        Block& block = blocks[b];
+        std::size_t first = b * BLOCK_RECORDS;
+        block.records = std::min(BLOCK_RECORDS, n - first);
+        block.unsent = 0;
+        block.time_min = std::numeric_limits<std::int64_t>::max();
+        block.time_max = std::numeric_limits<std::int64_t>::min();
+        for (std::size_t i = first; i < first + block.records; ++i) {
+            const char* buf = data + i * RECORD_SIZE;
+            if (buf[0] || (station_sent && ((*station_sent)[i >> 3] & (1 << (i & 7))))) {
+                sent[i >> 3] |= 1 << (i & 7);
+                continue;
+            }
+            ++block.unsent;
+            std::int64_t t;
+            // Records without a valid datetime are dated when converted
+            if (!record_time(decoder, buf, t))
+                t = std::numeric_limits<std::int64_t>::max();
+            if (t < block.time_min) block.time_min = t;
+            if (t > block.time_max) block.time_max = t;
+        }
+    }
+    if (checkpoint > n)
+        checkpoint = n;
+}
+
+bool StoreIndex::load(const std::string& path) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == nullptr)
+        return false;
+    Header h;
+    bool ok = fread(&h, sizeof(h), 1, fp) == 1
+        && memcmp(h.magic, STOREINDEX_MAGIC, sizeof(h.magic)) == 0
+        && h.block_records == BLOCK_RECORDS
+        && h.blocks == (h.file_size / RECORD_SIZE + BLOCK_RECORDS - 1) / BLOCK_RECORDS;
+    if (ok) {
+        file_size = h.file_size;
+        file_mtime = h.file_mtime;
+        sent_size = h.sent_size;
+        sent_mtime = h.sent_mtime;
+        checkpoint = h.checkpoint;
+        blocks.resize(h.blocks);
+        sent.resize((records() + 7) / 8);
+        ok = fread(blocks.data(), sizeof(Block), blocks.size(), fp) == blocks.size()
+            && fread(sent.data(), 1, sent.size(), fp) == sent.size();
+    }
+    fclose(fp);
+    if (!ok) {
+        file_size = 0;
+        blocks.clear();
+        sent.clear();
+    }
+    return ok;
+}
+
+void StoreIndex::save(const std::string& path) const {
+    std::string tmp = path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (fp == nullptr)
+        throw std::runtime_error("Cannot create index " + tmp);
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, STOREINDEX_MAGIC, sizeof(h.magic));
+    h.block_records = BLOCK_RECORDS;
+    h.file_size = file_size;
+    h.file_mtime = file_mtime;
+    h.sent_size = sent_size;
+    h.sent_mtime = sent_mtime;
+    h.checkpoint = checkpoint;
+    h.blocks = blocks.size();
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1
+        && fwrite(blocks.data(), sizeof(Block), blocks.size(), fp) == blocks.size()
+        && fwrite(sent.data(), 1, sent.size(), fp) == sent.size();
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        throw std::runtime_error("Cannot write index " + path);
+    }
+}
+
+}
@@ -0,0 +1,147 @@
+/*
+ * storeindex - Index of the records stored by the stations
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_STOREINDEX_H
+#define MQTT2BUFR_STOREINDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <dballe/types.h>
+
+namespace mqtt2bufr {
+
+/**
+ * Sidecar index of a file of 128-byte records stored by a station.
+ *
+ * The records are grouped in blocks of BLOCK_RECORDS records: for each block
+ * the index keeps the number of records not yet sent and the range of their
+ * datetimes; for each record a bit tells if it was already sent. The index
+ * also keeps a checkpoint, the number of records already converted, so that
+ * a conversion can be resumed.
+ *
+ * A record is sent if its first byte is set or if the station marked it in
+ * the bitmap FILE.snt (see load_sent()).
+ *
+ * The index is valid as long as the size and the modification time of the
+ * file and of its bitmap don't change.
+ */
+class StoreIndex {
+ public:
+  static const std::size_t RECORD_SIZE = 128;
+  static const std::size_t BLOCK_RECORDS = 4096;
+
+  struct Block {
+    /// Number of records in the block
+    std::uint32_t records;
+    /// Number of records not yet sent
+    std::uint32_t unsent;
+    /// Datetime range of the records not yet sent (seconds since the
+    /// epoch; the maximum value for records without a datetime), or
+    /// time_min > time_max if all the records were sent
+    std::int64_t time_min;
+    std::int64_t time_max;
+  };
+
+  std::uint64_t file_size = 0;
+  std::int64_t file_mtime = 0;
+  /// Size and modification time of the bitmap of the station (0 if missing)
+  std::uint64_t sent_size = 0;
+  std::int64_t sent_mtime = 0;
+  std::uint64_t checkpoint = 0;
+  std::vector<Block> blocks;
+  /// One bit for each record, set if the record was already sent
+  std::vector<std::uint8_t> sent;
+
+  /**
+   * Path of the index of a file.
+   */
+  static std::string path(const std::string& file) { return file + ".idx"; }
+
+  /**
+   * Path of the bitmap of the records sent written by the station next to a
+   * file: the extension of the file is replaced by .snt.
+   */
+  static std::string sent_path(const std::string& file);
+
+  /**
+   * Read the bitmap of the records sent written by the station: a 4 bytes
+   * little endian cursor, the offset of the first record not sent, followed
+   * by one bit for each record. Set in bits, one bit for each of the first
+   * records, the records sent; size and mtime are set to the ones of the
+   * bitmap.
+   *
+   * @return false if the bitmap is missing
+   */
+  static bool load_sent(const std::string& path, std::size_t records,
+                        std::vector<std::uint8_t>& bits,
+                        std::uint64_t& size, std::int64_t& mtime);
+
+  /**
+   * Seconds since the epoch of a datetime.
+   */
+  static std::int64_t to_seconds(const dballe::Datetime& dt);
+
+  /**
+   * Scan the records of a file; station_sent is the bitmap read by
+   * load_sent(), if any.
+   *
+   * The checkpoint is kept.
+   */
+  void build(const char* data, std::size_t size, std::int64_t mtime,
+             const std::vector<std::uint8_t>* station_sent = nullptr);
+
+  /**
+   * Read an index.
+   *
+   * @return false if the index is missing or not valid
+   */
+  bool load(const std::string& path);
+
+  /**
+   * Write the index, atomically replacing the old one.
+   *
+   * @throw std::runtime_error on write errors
+   */
+  void save(const std::string& path) const;
+
+  /**
+   * Check if the index describes a file with the given size and mtime,
+   * and a bitmap with the given size and mtime.
+   */
+  bool matches(std::uint64_t size, std::int64_t mtime,
+               std::uint64_t bitmap_size, std::int64_t bitmap_mtime) const {
+    return file_size == size && file_mtime == mtime
+        && sent_size == bitmap_size && sent_mtime == bitmap_mtime;
+  }
+
+  std::size_t records() const { return file_size / RECORD_SIZE; }
+
+  bool is_sent(std::size_t record) const {
+    return sent[record >> 3] & (1 << (record & 7));
+  }
+};
+
+}
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * topic - MQTT topic tokenizer
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+
+#include "topic.h"
+
+#include <stdexcept>
+
+// Same message of regerror(REG_NOMATCH) in the old regexp based parser
+#define TOPIC_NOMATCH_MSG "While parsing topic: No match"
+
+namespace mqtt2bufr {
+
+namespace {
+
+inline bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+/// [0-9]+
+bool is_number(const char* b, const char* e) {
+    if (b == e) return false;
+    for (; b != e; ++b)
+        if (!is_digit(*b)) return false;
+    return true;
+}
+
+/// [0-9]+|-
+bool is_number_or_missing(const char* b, const char* e) {
+    if (e - b == 1 && *b == '-') return true;
+    return is_number(b, e);
+}
+
+/// B[0-9]{5}
+bool is_varcode(const char* b, const char* e) {
+    return e - b == 6 && *b == 'B' && is_number(b + 1, e);
+}
+
+/**
+ * Split [b, e) by "," in exactly n tokens.
+ */
+bool split_fields(const char* b, const char* e, TopicToken* out, int n) {
+    int i = 0;
+    const char* start = b;
+    for (const char* p = b; p != e; ++p) {
+        if (*p != ',') continue;
+        if (i == n - 1) return false;
+        out[i].data = start;
+        out[i].size = p - start;
+        ++i;
+        start = p + 1;
+    }
+    if (i != n - 1) return false;
+    out[i].data = start;
+    out[i].size = e - start;
+    return true;
+}
+
+bool match_topic(const char* topic, std::size_t size, TopicItems& items) {
+    const char* end = topic + size;
+    // The last item is VAR or, in the messages with many variables, the
+    // level: it has commas, so it can't be taken for a VAR.
+    const char* last = end;
+    while (last != topic && last[-1] != '/')
+        --last;
+    bool has_var = is_varcode(last, end);
+    // Position of the last 6 "/" (5 without VAR, the 6th is the end), from
+    // the leftmost one: the first of them ends the (free) prefix, the others
+    // separate the items.
+    const char* sep[6];
+    int nsep = has_var ? 6 : 5;
+    sep[5] = end;
+    for (const char* p = end; p != topic && nsep > 0; ) {
+        --p;
+        if (*p == '/')
+            sep[--nsep] = p;
+    }
+    if (nsep > 0) return false;
+
+    TopicToken* t = items.items;
+    // IDENT
+    if (sep[1] - sep[0] == 1) return false;
+    t[TopicItems::IDENT].data = sep[0] + 1;
+    t[TopicItems::IDENT].size = sep[1] - sep[0] - 1;
+    // LON,LAT
+    if (!split_fields(sep[1] + 1, sep[2], t + TopicItems::LON, 2)) return false;
+    for (int i = TopicItems::LON; i <= TopicItems::LAT; ++i)
+        if (!is_number(t[i].data, t[i].data + t[i].size)) return false;
+    // REP_MEMO
+    if (sep[3] - sep[2] == 1) return false;
+    t[TopicItems::REP_MEMO].data = sep[2] + 1;
+    t[TopicItems::REP_MEMO].size = sep[3] - sep[2] - 1;
+    // PIND,P1,P2
+    if (!split_fields(sep[3] + 1, sep[4], t + TopicItems::PIND, 3)) return false;
+    // LT1,L1,LT2,L2
+    if (!split_fields(sep[4] + 1, sep[5], t + TopicItems::LT1, 4)) return false;
+    for (int i = TopicItems::PIND; i <= TopicItems::L2; ++i)
+        if (!is_number_or_missing(t[i].data, t[i].data + t[i].size)) return false;
+    // VAR
+    if (has_var) {
+        t[TopicItems::VAR].data = sep[5] + 1;
+        t[TopicItems::VAR].size = end - sep[5] - 1;
+    } else {
+        t[TopicItems::VAR] = TopicToken();
+    }
+    return true;
+}
+
+}
+
+void split_topic(const char* topic, std::size_t size, TopicItems& items) {
+    if (!match_topic(topic, size, items))
+        throw std::runtime_error(TOPIC_NOMATCH_MSG);
+}
+
+}
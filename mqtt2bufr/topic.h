@@ -0,0 +1,85 @@
+/*
+ * topic - MQTT topic tokenizer
+ *
+ * Copyright (C) 2013  ARPA-SIM <urpsim@smr.arpa.emr.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Author: Emanuele Di Giacomo <edigiacomo@arpa.emr.it>
+ *         Paolo Patruno <p.patruno@iperbole.bologna.it>
+ */
+#ifndef MQTT2BUFR_TOPIC_H
+#define MQTT2BUFR_TOPIC_H
+
+#include <cstddef>
+#include <string>
+
+namespace mqtt2bufr {
+
+/**
+ * A slice of the topic string. It doesn't own the memory.
+ */
+struct TopicToken {
+  const char* data = nullptr;
+  std::size_t size = 0;
+
+  std::string str() const { return std::string(data, size); }
+  bool is_missing() const { return size == 1 && data[0] == '-'; }
+};
+
+/**
+ * Items of a topic `.../IDENT/LON,LAT/REP_MEMO/PIND,P1,P2/LT1,L1,LT2,L2/VAR`,
+ * or `.../IDENT/LON,LAT/REP_MEMO/PIND,P1,P2/LT1,L1,LT2,L2` for the messages
+ * with many variables, where VAR is empty.
+ */
+struct TopicItems {
+  enum {
+    IDENT = 0, LON, LAT, REP_MEMO,
+    PIND, P1, P2,
+    LT1, L1, LT2, L2,
+    VAR,
+    SIZE
+  };
+  TopicToken items[SIZE];
+
+  const TopicToken& operator[](int i) const { return items[i]; }
+  bool has_var() const { return items[VAR].size != 0; }
+};
+
+/**
+ * Split the topic in its items, without copying or allocating memory.
+ *
+ * Only the last six `/`-separated items of the topic (five, if the last one
+ * is not a VAR) are validated, and they must be preceded by a `/` (any
+ * prefix is accepted):
+ * - IDENT and REP_MEMO: any non-empty string
+ * - LON and LAT: `[0-9]+`
+ * - PIND, P1, P2, LT1, L1, LT2, L2: `[0-9]+` or `-`
+ * - VAR: `B[0-9]{5}`
+ *
+ * @throw std::runtime_error if the topic doesn't match.
+ */
+void split_topic(const char* topic, std::size_t size, TopicItems& items);
+
+inline void split_topic(const std::string& topic, TopicItems& items) {
+  split_topic(topic.data(), topic.size(), items);
+}
+
+/// The items would point to a destroyed string.
+void split_topic(std::string&& topic, TopicItems& items) = delete;
+
+}
+
+#endif
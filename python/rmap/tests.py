@@ -0,0 +1,65 @@
+from django.test import SimpleTestCase, RequestFactory
+
+from rmap.views import acl, aclfetch
+
+
+def topic_matches(sub, topic):
+    # as mosquitto_topic_matches_sub(): "+" matches a level, also empty,
+    # "a/#" matches "a" and below, and wildcards at the first level do not
+    # match the topics starting with "$"
+    if topic.startswith("$") and sub[:1] in ("+", "#"):
+        return False
+    subs = sub.split("/")
+    levels = topic.split("/")
+    for i, s in enumerate(subs):
+        if s == "#":
+            return True
+        if i >= len(levels):
+            return False
+        if s != "+" and s != levels[i]:
+            return False
+    return len(subs) == len(levels)
+
+
+class AclTest(SimpleTestCase):
+    # the patterns of aclfetch() must allow exactly what acl() allows
+    USERNAME = "station1"
+    TOPICS = (
+        "test", "test/", "test/a", "test/a/b", "testa", "testa/b",
+        "rmap", "rmap/", "rmap/station1", "rmap/station1/",
+        "rmap/station1/a", "rmap/station1/a/b", "rmap/station11/a",
+        "rmap/other/a", "sample/station1", "sample/station1/a",
+        "report/station1/a/b", "maint/station1", "rpc/station1/com",
+        "a", "a/b", "/a", "$SYS/broker/uptime",
+    )
+
+    def setUp(self):
+        self.factory = RequestFactory()
+
+    def acl_allows(self, topic, acc):
+        request = self.factory.post("/auth/acl", {
+            "username": self.USERNAME, "topic": topic, "acc": str(acc)})
+        return acl(request).status_code == 200
+
+    def aclfetch_allows(self, patterns, topic, acc):
+        for line in patterns:
+            if line == "superuser":
+                return True
+            pacc, sub = line.split(" ", 1)
+            sub = sub.replace("%u", self.USERNAME)
+            if int(pacc) & acc and topic_matches(sub, topic):
+                return True
+        return False
+
+    def test_same_answers(self):
+        request = self.factory.post("/auth/aclfetch", {"username": self.USERNAME})
+        response = aclfetch(request)
+        self.assertEqual(response.status_code, 200)
+        patterns = response.content.decode().splitlines()
+
+        for topic in self.TOPICS:
+            for acc in (1, 2):
+                self.assertEqual(
+                    self.aclfetch_allows(patterns, topic, acc),
+                    self.acl_allows(topic, acc),
+                    "%s acc %d" % (topic, acc))
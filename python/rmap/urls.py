@@ -41,6 +41,7 @@ urlpatterns = [
 
     url(r'^auth/auth',     rmap.views.auth),
     url(r'^auth/superuser',rmap.views.superuser),
+    url(r'^auth/aclfetch', rmap.views.aclfetch),
     url(r'^auth/acl',      rmap.views.acl),
 
 
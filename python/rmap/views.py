@@ -215,6 +215,9 @@ def superuser(request):
     response.status_code=403
     return response
 
+# topics where users can write: below test/ and <prefix><username>/
+ACL_WRITE_PREFIXES=("sample/","rmap/","report/","maint/","rpc/")
+
 @csrf_exempt  
 def acl(request):
 
@@ -237,7 +240,7 @@ def acl(request):
             return response
 
         #write to all in rmap/username/# report/username/# mobile/username/# plus new sample/username/# fixed/username/# and rpc/username/#
-        if topic.startswith(("sample/"+username+"/","rmap/"+username+"/","report/"+username+"/","maint/"+username+"/","rpc/"+username+"/")) and acc == "2":
+        if topic.startswith(tuple(prefix+username+"/" for prefix in ACL_WRITE_PREFIXES)) and acc == "2":
             response=HttpResponse("allow")
             response.status_code=200
             return response
@@ -246,6 +249,39 @@ def acl(request):
     response.status_code=403
     return response
 
+@csrf_exempt  
+def aclfetch(request):
+    # all the ACL patterns of a user in one request, one "<acc> <topic>"
+    # per line, the same as acl() and superuser(); %u is the username
+
+    if 'username' in request.POST:
+        username = request.POST['username']
+
+        lines=[]
+        if username == "rmap":
+            lines.append("superuser")
+        # acl() allows to read any topic; "#" does not match the topics
+        # starting with "$", and the only ones the broker delivers are
+        # $SYS/# (clients cannot publish on "$" topics, and mosquitto
+        # strips $share/<group>/ before checking the ACL)
+        lines.append("1 #")
+        lines.append("1 $SYS/#")
+        # acl() allows to write below test/ and <prefix><username>/, not
+        # on the bare test or <prefix><username>, that "/#" would match
+        lines.append("2 test/+")
+        lines.append("2 test/+/#")
+        for prefix in ACL_WRITE_PREFIXES:
+            lines.append("2 "+prefix+"%u/+")
+            lines.append("2 "+prefix+"%u/+/#")
+
+        response=HttpResponse("\n".join(lines)+"\n",content_type="text/plain")
+        response.status_code=200
+        return response
+
+    response=HttpResponse("deny")
+    response.status_code=403
+    return response
+
 
 #user profile
 from django.contrib.auth.decorators import login_required